@@ -377,6 +377,7 @@ int16_t  LoRaBegin(uint32_t frequencyInHz, int8_t txPowerInDbm, float tcxoVoltag
 void     LoRaConfig(uint8_t spreadingFactor, uint8_t bandwidth, uint8_t codingRate, uint16_t preambleLength, uint8_t payloadLen, bool crcOn, bool invertIrq);
 uint8_t  LoRaReceive(uint8_t *pData, int16_t len);
 bool     LoRaSend(uint8_t *pData, int16_t len, uint8_t mode);
+uint32_t LoRaGetTimeOnAir(uint8_t len);
 void     LoRaDebugPrint(bool enable);
 
 // Private function
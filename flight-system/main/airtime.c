@@ -0,0 +1,151 @@
+#include "airtime.h"
+#include <stdio.h>
+#include <string.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+typedef struct {
+    uint32_t rate_ms;       // air earned per second
+    int64_t burst_us;
+    int64_t tokens_us;      // can go negative when telemetry is charged past its budget
+    uint32_t used_us[AIRTIME_WINDOW_S];   // one bin per second, for utilization
+} airtime_bucket_t;
+
+static const char *names[AIRTIME_CHANNELS] = { "telemetry", "image", "uplink" };
+
+static SemaphoreHandle_t airtime_mutex;
+static airtime_bucket_t buckets[AIRTIME_CHANNELS];
+static int64_t spare_us;
+static int64_t last_refill_us;
+static int64_t current_sec;     // second the newest bin belongs to
+
+void airtime_init(void)
+{
+    airtime_mutex = xSemaphoreCreateMutex();
+    last_refill_us = esp_timer_get_time();
+    current_sec = last_refill_us / 1000000;
+}
+
+void airtime_configure(airtime_channel_t ch, uint32_t rate_ms, uint32_t burst_ms)
+{
+    xSemaphoreTake(airtime_mutex, portMAX_DELAY);
+    buckets[ch].rate_ms = rate_ms;
+    buckets[ch].burst_us = (int64_t)burst_ms * 1000;
+    buckets[ch].tokens_us = buckets[ch].burst_us;
+    xSemaphoreGive(airtime_mutex);
+}
+
+// Tops up every bucket for the time since the last call, and moves the utilization bins along
+static void refill(int64_t now)
+{
+    int64_t elapsed = now - last_refill_us;
+    last_refill_us = now;
+
+    for (int i = 0; i < AIRTIME_CHANNELS; i++) {
+        airtime_bucket_t *b = &buckets[i];
+        b->tokens_us += elapsed * b->rate_ms / 1000;
+        if (b->tokens_us > b->burst_us) {
+            spare_us += b->tokens_us - b->burst_us;
+            b->tokens_us = b->burst_us;
+        }
+    }
+    if (spare_us > AIRTIME_SPARE_BURST_MS * 1000LL) spare_us = AIRTIME_SPARE_BURST_MS * 1000LL;
+
+    int64_t sec = now / 1000000;
+    if (sec - current_sec > AIRTIME_WINDOW_S) current_sec = sec - AIRTIME_WINDOW_S;
+    for (; current_sec < sec; current_sec++) {
+        for (int i = 0; i < AIRTIME_CHANNELS; i++) {
+            buckets[i].used_us[(current_sec + 1) % AIRTIME_WINDOW_S] = 0;
+        }
+    }
+}
+
+static void record(airtime_channel_t ch, uint32_t air_us)
+{
+    buckets[ch].used_us[current_sec % AIRTIME_WINDOW_S] += air_us;
+}
+
+// How many ms until ch has air_us of budget (its own bucket plus the spare one), 0 if it has
+// it now. Nothing is charged, call airtime_spend once the packet is actually sent.
+uint32_t airtime_wait_ms(airtime_channel_t ch, uint32_t air_us)
+{
+    uint32_t wait_ms = 0;
+
+    xSemaphoreTake(airtime_mutex, portMAX_DELAY);
+    refill(esp_timer_get_time());
+
+    airtime_bucket_t *b = &buckets[ch];
+    int64_t have = ((b->tokens_us > 0) ? b->tokens_us : 0) + spare_us;
+    if (have < air_us) {
+        // no share of its own means waiting for something to spill over
+        wait_ms = (b->rate_ms > 0) ? (uint32_t)((air_us - have) / b->rate_ms) + 1 : 100;
+    }
+    xSemaphoreGive(airtime_mutex);
+    return wait_ms;
+}
+
+// Charges a sent packet to ch, own bucket first, then the spare one. Traffic that goes out
+// regardless of budget (telemetry) can push the bucket into debt, later packets pay it back.
+void airtime_spend(airtime_channel_t ch, uint32_t air_us)
+{
+    xSemaphoreTake(airtime_mutex, portMAX_DELAY);
+    refill(esp_timer_get_time());
+
+    airtime_bucket_t *b = &buckets[ch];
+    int64_t from_own = (b->tokens_us > 0) ? b->tokens_us : 0;
+    if (from_own > air_us) from_own = air_us;
+    int64_t from_spare = air_us - from_own;
+    if (from_spare > spare_us) from_spare = spare_us;
+
+    b->tokens_us -= air_us - from_spare;
+    spare_us -= from_spare;
+    record(ch, air_us);
+    xSemaphoreGive(airtime_mutex);
+}
+
+// The other end's packets take up the same channel, count them towards utilization
+void airtime_heard(airtime_channel_t ch, uint32_t air_us)
+{
+    xSemaphoreTake(airtime_mutex, portMAX_DELAY);
+    refill(esp_timer_get_time());
+    record(ch, air_us);
+    xSemaphoreGive(airtime_mutex);
+}
+
+// Permille of the last AIRTIME_WINDOW_S - 1 full seconds spent on ch, or on everything for
+// AIRTIME_CHANNELS. The second in progress isn't counted.
+uint32_t airtime_utilization(airtime_channel_t ch)
+{
+    uint64_t used = 0;
+
+    xSemaphoreTake(airtime_mutex, portMAX_DELAY);
+    refill(esp_timer_get_time());
+    for (int i = 0; i < AIRTIME_CHANNELS; i++) {
+        if (ch != AIRTIME_CHANNELS && ch != i) continue;
+        for (int s = 0; s < AIRTIME_WINDOW_S; s++) {
+            if (s != current_sec % AIRTIME_WINDOW_S) used += buckets[i].used_us[s];
+        }
+    }
+    xSemaphoreGive(airtime_mutex);
+    return (uint32_t)(used / ((AIRTIME_WINDOW_S - 1) * 1000));
+}
+
+// One line per channel: name,rate_ms,tokens_ms,utilization_permille then spare and total
+int airtime_status(char *buf, size_t len)
+{
+    int n = 0;
+
+    for (int i = 0; i < AIRTIME_CHANNELS && n < (int)len; i++) {
+        uint32_t util = airtime_utilization(i);
+        xSemaphoreTake(airtime_mutex, portMAX_DELAY);
+        n += snprintf(buf + n, len - n, "%s,%lu,%lld,%lu\n", names[i], (unsigned long)buckets[i].rate_ms,
+                      (long long)buckets[i].tokens_us / 1000, (unsigned long)util);
+        xSemaphoreGive(airtime_mutex);
+    }
+    if (n < (int)len) {
+        n += snprintf(buf + n, len - n, "spare,0,%lld,0\ntotal,0,0,%lu\n",
+                      (long long)spare_us / 1000, (unsigned long)airtime_utilization(AIRTIME_CHANNELS));
+    }
+    return n;
+}
@@ -0,0 +1,33 @@
+#ifndef AIRTIME_H_
+#define AIRTIME_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Airtime budget for the LoRa link, kept the same on the can and the ground station.
+//
+// Each channel is a token bucket that earns rate_ms of air per second, up to burst_ms. What a
+// full bucket can't hold spills into a shared spare bucket that any channel can borrow from,
+// so a channel that isn't using its share (telemetry frames shorter than budgeted, no uplink
+// traffic) hands it to whoever has something to send instead of wasting it.
+//
+// Packet times come from LoRaGetTimeOnAir, so they follow whatever LoRaConfig set.
+#define AIRTIME_SPARE_BURST_MS  500
+#define AIRTIME_WINDOW_S        10      // utilization is averaged over this many seconds
+
+typedef enum {
+    AIRTIME_TELEMETRY = 0,
+    AIRTIME_IMAGE,
+    AIRTIME_UPLINK,
+    AIRTIME_CHANNELS
+} airtime_channel_t;
+
+void airtime_init(void);
+void airtime_configure(airtime_channel_t ch, uint32_t rate_ms, uint32_t burst_ms);
+uint32_t airtime_wait_ms(airtime_channel_t ch, uint32_t air_us);
+void airtime_spend(airtime_channel_t ch, uint32_t air_us);
+void airtime_heard(airtime_channel_t ch, uint32_t air_us);
+uint32_t airtime_utilization(airtime_channel_t ch);
+int airtime_status(char *buf, size_t len);
+
+#endif
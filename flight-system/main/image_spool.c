@@ -0,0 +1,245 @@
+#include "image_spool.h"
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include "freertos/semphr.h"
+
+static const char *TAG = "spool";
+
+typedef struct {
+    uint16_t image;
+    uint32_t total;
+    uint32_t received;      // bytes in from the start of the image, in order
+    uint32_t sent;          // bytes handed to the radio
+    size_t start;           // where byte 0 of the image is in the ring
+    int64_t last_us;        // when the last chunk arrived
+    bool priority;          // sent ahead of older images
+} spool_image_t;
+
+static SemaphoreHandle_t spool_mutex;
+static SemaphoreHandle_t spool_ready;   // given whenever there might be something new to send
+static uint8_t *ring;
+static size_t capacity;
+static size_t used;                     // reserved by images in the spool, sent or not
+static spool_image_t images[SPOOL_IMAGES];
+static int head, count;
+static int last_sent = -1;              // newest image that's been sent and freed
+
+// an image that didn't fit, asked for again once there's room
+static bool deferred;
+static uint16_t deferred_image;
+static uint32_t deferred_total;
+
+bool spool_init(void)
+{
+    ring = heap_caps_malloc(SPOOL_PSRAM_BYTES, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    capacity = SPOOL_PSRAM_BYTES;
+    if (ring == NULL) {
+        ring = heap_caps_malloc(SPOOL_INTERNAL_BYTES, MALLOC_CAP_8BIT);
+        capacity = SPOOL_INTERNAL_BYTES;
+    }
+    if (ring == NULL) {
+        ESP_LOGE(TAG, "No memory for the image spool");
+        return false;
+    }
+    spool_mutex = xSemaphoreCreateMutex();
+    spool_ready = xSemaphoreCreateBinary();
+    ESP_LOGI(TAG, "%u KB image spool in %s", (unsigned)(capacity / 1024),
+             capacity == SPOOL_PSRAM_BYTES ? "PSRAM" : "internal RAM");
+    return true;
+}
+
+static spool_image_t *newest(void)
+{
+    return count ? &images[(head + count - 1) % SPOOL_IMAGES] : NULL;
+}
+
+static spool_image_t *find(uint16_t image)
+{
+    for (int i = count - 1; i >= 0; i--) {
+        spool_image_t *img = &images[(head + i) % SPOOL_IMAGES];
+        if (img->image == image) return img;
+    }
+    return NULL;
+}
+
+static void ring_write(size_t pos, const uint8_t *data, size_t len)
+{
+    pos %= capacity;
+    size_t first = (len < capacity - pos) ? len : capacity - pos;
+    memcpy(ring + pos, data, first);
+    memcpy(ring, data + first, len - first);
+}
+
+static void ring_read(size_t pos, uint8_t *out, size_t len)
+{
+    pos %= capacity;
+    size_t first = (len < capacity - pos) ? len : capacity - pos;
+    memcpy(out, ring + pos, first);
+    memcpy(out + first, ring, len - first);
+}
+
+// Reserves room for a new image. The one before it gets cut short if it never finished, the duo
+// has moved on so the rest of it isn't coming.
+static spool_image_t *start_image(uint16_t image, uint32_t total, bool priority)
+{
+    spool_image_t *last = newest();
+    if (last && last->received < last->total) {
+        ESP_LOGW(TAG, "Image %u cut short at %lu of %lu bytes", last->image,
+                 (unsigned long)last->received, (unsigned long)last->total);
+        used -= last->total - last->received;
+        last->total = last->received;
+    }
+
+    if (count == SPOOL_IMAGES || total > capacity - used) return NULL;
+
+    spool_image_t *img = &images[(head + count) % SPOOL_IMAGES];
+    img->image = image;
+    img->total = total;
+    img->received = 0;
+    img->sent = 0;
+    img->start = last ? last->start + last->total : 0;
+    img->last_us = esp_timer_get_time();
+    img->priority = priority;
+    used += total;
+    count++;
+    return img;
+}
+
+// Stores one chunk from the duo. On SPOOL_GAP, want_offset is where the image needs resending from.
+spool_result_t spool_put(uint16_t image, uint32_t offset, uint32_t total, const uint8_t *data, size_t len,
+                         bool priority, uint32_t *want_offset)
+{
+    spool_result_t result = SPOOL_OK;
+
+    xSemaphoreTake(spool_mutex, portMAX_DELAY);
+    spool_image_t *img = find(image);
+    if (img == NULL) {
+        if (image == last_sent) {
+            result = SPOOL_DUPLICATE;
+        } else if (offset != 0) {
+            result = (deferred && deferred_image == image) ? SPOOL_FULL : SPOOL_STRAY;
+        } else if ((img = start_image(image, total, priority)) == NULL) {
+            if (!deferred || deferred_image != image) {
+                ESP_LOGW(TAG, "No room for image %u (%lu bytes), holding it at the duo", image, (unsigned long)total);
+            }
+            deferred = true;
+            deferred_image = image;
+            deferred_total = total;
+            result = SPOOL_FULL;
+        } else if (deferred && deferred_image == image) {
+            deferred = false;
+        }
+    }
+
+    if (img) {
+        img->last_us = esp_timer_get_time();
+        if (offset + len <= img->received) {
+            result = SPOOL_DUPLICATE;
+        } else if (offset > img->received) {
+            *want_offset = img->received;
+            result = SPOOL_GAP;
+        } else {
+            // might overlap what we already have, only keep the new part
+            size_t skip = img->received - offset;
+            size_t n = len - skip;
+            if (img->received + n > img->total) n = img->total - img->received;
+            ring_write(img->start + img->received, data + skip, n);
+            img->received += n;
+            xSemaphoreGive(spool_ready);
+        }
+    }
+    xSemaphoreGive(spool_mutex);
+    return result;
+}
+
+// The image the next bytes should come from: the oldest priority image with something waiting,
+// otherwise the oldest image that isn't all sent
+static spool_image_t *next_to_send(void)
+{
+    spool_image_t *first = NULL;
+    for (int i = 0; i < count; i++) {
+        spool_image_t *img = &images[(head + i) % SPOOL_IMAGES];
+        if (img->priority && img->received > img->sent) return img;
+        if (first == NULL && img->sent < img->total) first = img;
+    }
+    return first;
+}
+
+// Copies up to max bytes that haven't gone out yet into out, waiting up to wait for some to
+// arrive. Returns how many, 0 if there was nothing.
+size_t spool_next(uint16_t *image, uint32_t *offset, uint8_t *out, size_t max, TickType_t wait)
+{
+    while (1) {
+        size_t n = 0;
+        xSemaphoreTake(spool_mutex, portMAX_DELAY);
+        spool_image_t *img = next_to_send();
+        if (img) {
+            n = img->received - img->sent;
+            if (n > max) n = max;
+            if (n) {
+                *image = img->image;
+                *offset = img->sent;
+                ring_read(img->start + img->sent, out, n);
+                img->sent += n;
+            }
+        }
+        // everything that's all out from the oldest on, the space can go to the next images
+        while (count && images[head].sent == images[head].total) {
+            used -= images[head].total;
+            last_sent = images[head].image;
+            head = (head + 1) % SPOOL_IMAGES;
+            count--;
+        }
+        xSemaphoreGive(spool_mutex);
+
+        if (n || xSemaphoreTake(spool_ready, wait) != pdTRUE) return n;
+    }
+}
+
+// Whether there's an image the duo should be asked to (re)send: one that didn't fit and now
+// does, or an unfinished one that's gone quiet. Call it every second or so.
+bool spool_wanted(uint16_t *image, uint32_t *offset)
+{
+    bool want = false;
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(spool_mutex, portMAX_DELAY);
+    spool_image_t *last = newest();
+    if (last && last->received < last->total && now - last->last_us > SPOOL_STALL_MS * 1000LL) {
+        *image = last->image;
+        *offset = last->received;
+        last->last_us = now;    // give it another SPOOL_STALL_MS before asking again
+        want = true;
+    } else if (deferred && (last == NULL || last->received == last->total) &&
+               count < SPOOL_IMAGES && deferred_total <= capacity - used) {
+        *image = deferred_image;
+        *offset = 0;
+        want = true;
+    }
+    xSemaphoreGive(spool_mutex);
+    return want;
+}
+
+void spool_usage(size_t *bytes, size_t *cap, int *images_held)
+{
+    xSemaphoreTake(spool_mutex, portMAX_DELAY);
+    *bytes = used;
+    *cap = capacity;
+    *images_held = count;
+    xSemaphoreGive(spool_mutex);
+}
+
+// Bytes still to go out over the radio, counting the rest of any image that's still coming in
+size_t spool_backlog(void)
+{
+    size_t left = 0;
+    xSemaphoreTake(spool_mutex, portMAX_DELAY);
+    for (int i = 0; i < count; i++) {
+        spool_image_t *img = &images[(head + i) % SPOOL_IMAGES];
+        left += img->total - img->sent;
+    }
+    xSemaphoreGive(spool_mutex);
+    return left;
+}
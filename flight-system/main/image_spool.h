@@ -0,0 +1,44 @@
+#ifndef IMAGE_SPOOL_H_
+#define IMAGE_SPOOL_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+// Store-and-forward buffer between the duo and the radio. Images come in from the uart as fast
+// as the duo sends them and sit here until the image channel's airtime budget lets them out.
+//
+// The spool is one ring of bytes, in PSRAM if the board has it (CONFIG_SPIRAM) and a smaller
+// block of internal RAM if not. Images are stored whole and in the order they arrived, each one
+// gets its full size reserved as soon as its first chunk shows up. Data goes out as soon as it's
+// in, an image is only freed once every byte of it has been sent.
+//
+// Chunks have to arrive in order. A gap, an image that stops half way or one there wasn't room
+// for is reported back so the caller can ask the duo to resend it, the duo keeps every image on
+// its sd card.
+//
+// Priority images (thumbnails) go out ahead of whatever's left of the images before them, the
+// rest still go in order. Space is freed from the oldest image on, so a priority image that's
+// been sent holds its space until everything older than it has gone as well.
+#define SPOOL_PSRAM_BYTES       (2 * 1024 * 1024)
+#define SPOOL_INTERNAL_BYTES    (64 * 1024)
+#define SPOOL_IMAGES            16
+#define SPOOL_STALL_MS          3000    // an unfinished image that's quiet this long gets asked for again
+
+typedef enum {
+    SPOOL_OK = 0,
+    SPOOL_DUPLICATE,    // already had it
+    SPOOL_GAP,          // something before this went missing, resend from *want_offset
+    SPOOL_FULL,         // no room for this image yet, it'll be asked for again once there is
+    SPOOL_STRAY,        // part of an image we're not collecting
+} spool_result_t;
+
+bool spool_init(void);
+spool_result_t spool_put(uint16_t image, uint32_t offset, uint32_t total, const uint8_t *data, size_t len,
+                         bool priority, uint32_t *want_offset);
+size_t spool_next(uint16_t *image, uint32_t *offset, uint8_t *out, size_t max, TickType_t wait);
+bool spool_wanted(uint16_t *image, uint32_t *offset);
+void spool_usage(size_t *bytes, size_t *cap, int *images_held);
+size_t spool_backlog(void);
+
+#endif
@@ -5,6 +5,9 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "ra01s.h"
+#include "airtime.h"
+#include "duo_frame.h"
+#include "image_spool.h"
 #include "minmea.h"
 
 #undef LOW
@@ -46,8 +49,75 @@ int mpu_enabled = 1;
 int bmp_enabled = 1;
 static bool parachute_deployed = false;
 const uart_port_t image_uart_num = UART_NUM_2;
+#define DUO_TX_PIN          48
+#define DUO_RX_PIN          47
+#define IMAGE_LORA_DATA     100                 // image bytes per LoRa packet
+
+// The duo uart is serviced off the driver's event queue. Pattern detection on the 0x00 that ends
+// every frame means we only wake up once a whole frame is in the ring buffer, it gets read into
+// duo_rx and decoded in place. Whatever deals with the frame copies out what it wants to keep
+// before the next one is read, image chunks go into the spool (image_spool.h) at uart speed and
+// image_task drains it at radio speed.
+//
+// There's no RTS/CTS between us and the duo, so nothing holds it off. If the fifo or ring buffer
+// overflows the input is thrown away and we start again from the next frame, the spool sees the
+// gap in the image and asks the duo to resend from there.
+#define DUO_RX_BUF          4096
+#define DUO_TX_BUF          1024
+#define DUO_EVENTS          32
+#define DUO_STATS_MS        10000
+
+typedef struct {
+    uint8_t type;
+    uint16_t len;
+    const uint8_t *payload;     // points into duo_rx
+} duo_msg_t;
+
+typedef struct {
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    uint32_t frames;
+    uint32_t bad_frames;
+    uint32_t overruns;          // hardware fifo or ring buffer overflowed, data was lost
+    uint32_t pattern_drops;     // more frames ended than the pattern queue could remember
+} duo_stats_t;
+
+static QueueHandle_t duo_uart_queue;
+static uint8_t duo_rx[DUO_ENCODED_MAX];
+static duo_stats_t duo_stats;
 char send_queue[50];
 
+// Uplink commands are acked on the next telemetry frame instead of with a packet of their own.
+// Both of these are guarded by queueMutex like send_queue.
+#define ACK_PENDING_MAX     6       // acks waiting to go out, whatever doesn't fit in a frame waits for the next
+#define SEEN_IDS            32      // recently applied uplink ids, so retries aren't applied twice
+static uint16_t pending_acks[ACK_PENDING_MAX];
+static int pending_ack_count = 0;
+static uint16_t seen_ids[SEEN_IDS];
+static int seen_next = 0;
+
+// The duo sends DUO_SAME instead of an image that looks like one that already went down. It goes
+// on the next few frames as SAME:<image>,<same as>: rather than costing a packet of its own,
+// more than once so losing a frame doesn't lose it. Guarded by queueMutex too.
+#define SAME_REPEAT         3
+#define REPORT_MAX          252     // LoRa's 255 less the EOT
+static uint16_t same_image, same_as;
+static int same_left = 0;
+
+// Link schedule, anchored on the telemetry frame. Every frame announces an uplink window of
+// UPLINK_WINDOW_MS (UW:<ms>:) starting when it finishes sending. We stay off the air until it
+// closes so the ground station can transmit, anything else (images) goes after that.
+#define DOWNLINK_PERIOD_MS  1000
+#define UPLINK_WINDOW_MS    450     // one full size uplink packet plus some slack
+#define TELEMETRY_RATE_MS   350     // a bit more than a frame takes
+#define IMAGE_RATE_MS       (DOWNLINK_PERIOD_MS - UPLINK_WINDOW_MS - TELEMETRY_RATE_MS)
+
+// A transmitted image should be on the ground within IMAGE_DEADLINE_S, so the duo gets told how
+// many bytes that is at the image channel's rate, less what's still waiting in the spool
+#define IMAGE_DEADLINE_S    60
+#define IMAGE_BUDGET_MIN    1500    // below this there's no point, it just goes out late
+static volatile int64_t uplink_window_end_us = 0;
+
 typedef enum {
     STATE_GROUND = 0,
     STATE_LAUNCH,
@@ -57,17 +127,10 @@ typedef enum {
     STATE_LANDED
 } flight_state_t;
 
-enum image_state{
-    TRANSMIT,
-    SAVE,
-    NONE
-}
-
 static flight_state_t flight_state = STATE_GROUND;
 static float ground_altitude = -1;
 static float last_altitude = 0;
 static bool last_tof_valid = true;
-static enum image_state = NONE;
 
 static void deployParachute() {
     gpio_set_level(PARACHUTE_PIN, 0);
@@ -168,9 +231,31 @@ void getReport(char* out) {
     // build report
     char buf[280];
     if (xSemaphoreTake(queueMutex, portMAX_DELAY)==pdTRUE) {
-        snprintf(buf, sizeof(buf),
-            "DWL:{%d}ACC:%.2f,%.2f,%.2f:GY:%.2f,%.2f,%.2f:PITCH:%.2f:YAW:%.2f:ALT:%.2f:TOF:%.2f:STATE:%d:CHUTE:%d:DUO:%s:",
-            ts, ax,ay,az, gx,gy,gz, pitch,yaw, altitude, tof_m, flight_state, parachute_deployed, send_queue);
+        int n = snprintf(buf, sizeof(buf),
+            "DWL:{%d}ACC:%.2f,%.2f,%.2f:GY:%.2f,%.2f,%.2f:PITCH:%.2f:YAW:%.2f:ALT:%.2f:TOF:%.2f:STATE:%d:CHUTE:%d:DUO:%s:UW:%d:AIR:%lu,%lu,%lu,%lu:",
+            ts, ax,ay,az, gx,gy,gz, pitch,yaw, altitude, tof_m, flight_state, parachute_deployed, send_queue, UPLINK_WINDOW_MS,
+            (unsigned long)airtime_utilization(AIRTIME_CHANNELS), (unsigned long)airtime_utilization(AIRTIME_TELEMETRY),
+            (unsigned long)airtime_utilization(AIRTIME_IMAGE), (unsigned long)airtime_utilization(AIRTIME_UPLINK));
+        // piggyback acks for any uplink commands since the last frame, ACK:<id>,<id>: with as
+        // many as fit, the rest stay pending for the next frame
+        int acked = 0;
+        for (; acked < pending_ack_count; acked++) {
+            char field[12];
+            int len = snprintf(field, sizeof(field), "%s%u", acked ? "," : "ACK:", pending_acks[acked]);
+            if (n + len + 1 > REPORT_MAX) break;    // and the closing ':'
+            memcpy(buf + n, field, len + 1);
+            n += len;
+        }
+        if (acked) {
+            n += snprintf(buf + n, sizeof(buf) - n, ":");
+        }
+        pending_ack_count -= acked;
+        memmove(pending_acks, pending_acks + acked, pending_ack_count * sizeof(pending_acks[0]));
+        // if a full frame of acks leaves no room it waits for the next one
+        if (same_left && n + 18 <= REPORT_MAX) {
+            snprintf(buf + n, sizeof(buf) - n, "SAME:%u,%u:", same_image, same_as);
+            same_left--;
+        }
         xSemaphoreGive(queueMutex);
     }
     snprintf(rep, sizeof(rep), buf);
@@ -179,96 +264,331 @@ void getReport(char* out) {
 }
 
 void transmit_loop_task(void*pv) {
+    // frames start DOWNLINK_PERIOD_MS apart however long building and sending one takes
+    TickType_t last_wake = xTaskGetTickCount();
     while(1) {
         char report[300];
         getReport(report);
         ESP_LOGI(TAG, "%s", report);
         if (xSemaphoreTake(loraMutex, portMAX_DELAY)==pdTRUE) {
             LoRaSend((const char*)report, strlen(report), SX126x_TXMODE_SYNC);
+            // the radio is back in rx now, this is the window we just announced
+            uplink_window_end_us = esp_timer_get_time() + UPLINK_WINDOW_MS * 1000LL;
             xSemaphoreGive(loraMutex);
         }
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        // telemetry always goes out, the budget just keeps count so images know what's left
+        airtime_spend(AIRTIME_TELEMETRY, LoRaGetTimeOnAir(strlen(report)));
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(DOWNLINK_PERIOD_MS));
     }
 }
 
-void tx_image(uint8_t buf[100]){
-    char new_buf[107];
-    snprintf(new_buf, sizeof(new_buf), "IMG:%s:", (char *) buf);
-    if (xSemaphoreTake(loraMutex, portMAX_DELAY)==pdTRUE) {
-            LoRaSend((uint8_t*)new_buf, sizeof(new_buf), SX126x_TXMODE_SYNC);
+// Takes loraMutex for anything other than the telemetry frame, waiting out the uplink window
+// if it's open and then for ch to have budget for a len byte packet. Only transmit_loop_task
+// opens the window and it does that holding the mutex, so checking under the mutex is enough.
+// Returns the packet's airtime for airtime_spend.
+static uint32_t take_radio_for(airtime_channel_t ch, uint8_t len) {
+    uint32_t air_us = LoRaGetTimeOnAir(len);
+    while (1) {
+        uint32_t wait_ms = airtime_wait_ms(ch, air_us);
+        if (wait_ms == 0) {
+            xSemaphoreTake(loraMutex, portMAX_DELAY);
+            int64_t left_us = uplink_window_end_us - esp_timer_get_time();
+            if (left_us <= 0) return air_us;
             xSemaphoreGive(loraMutex);
+            wait_ms = left_us / 1000 + 1;
+        }
+        vTaskDelay(pdMS_TO_TICKS(wait_ms));
+    }
+}
+
+// Image data goes down IMAGE_LORA_DATA bytes at a time, each packet
+// 'I' | image u16 | offset u32 | data so the ground station can put them back together in any order
+static void tx_image(uint8_t *pkt, uint16_t image, uint32_t offset, size_t len) {
+    pkt[0] = 'I';
+    duo_put16(pkt + 1, image);
+    duo_put32(pkt + 3, offset);
+
+    uint32_t air_us = take_radio_for(AIRTIME_IMAGE, 7 + len);
+    LoRaSend(pkt, 7 + len, SX126x_TXMODE_SYNC);
+    xSemaphoreGive(loraMutex);
+    airtime_spend(AIRTIME_IMAGE, air_us);
+}
+
+// Commands can come from any task, uart_write_bytes does its own locking
+static void duo_send_command(const uint8_t *payload, size_t len) {
+    uint8_t buf[24];
+    size_t n = duo_frame_encode(DUO_CMD, payload, len, buf);
+    int sent = uart_write_bytes(image_uart_num, (const char *)buf, n);
+    if (sent > 0) duo_stats.tx_bytes += sent;
+}
+
+// Bytes the next image can be, see IMAGE_DEADLINE_S
+static uint32_t image_budget(void) {
+    uint32_t pkt_us = LoRaGetTimeOnAir(7 + IMAGE_LORA_DATA);
+    uint64_t packets = (uint64_t)IMAGE_DEADLINE_S * IMAGE_RATE_MS * 1000 / pkt_us;
+    int64_t budget = (int64_t)(packets * IMAGE_LORA_DATA) - (int64_t)spool_backlog();
+    return budget < IMAGE_BUDGET_MIN ? IMAGE_BUDGET_MIN : (uint32_t)budget;
+}
+
+// Our clock, same as the DWL:{ts} on every report, so the duo can tag images with it
+static uint32_t flight_ms(void) {
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static void duo_save(void) {
+    uint8_t payload[5] = { DUO_OP_SAVE };
+    duo_put32(payload + 1, flight_ms());
+    duo_send_command(payload, sizeof(payload));
+}
+
+static void duo_transmit(void) {
+    uint8_t payload[9] = { DUO_OP_TRANSMIT };
+    uint32_t budget = image_budget();
+    duo_put32(payload + 1, budget);
+    duo_put32(payload + 5, flight_ms());
+    ESP_LOGI(TAG, "Asking duo for an image of at most %lu bytes", (unsigned long)budget);
+    duo_send_command(payload, sizeof(payload));
+}
+
+static void duo_resend(uint16_t image, uint32_t offset) {
+    uint8_t payload[7] = { DUO_OP_RESEND };
+    duo_put16(payload + 1, image);
+    duo_put32(payload + 3, offset);
+    ESP_LOGI(TAG, "Asking duo for image %u from %lu", image, (unsigned long)offset);
+    duo_send_command(payload, sizeof(payload));
+}
+
+// Feeds the radio from the spool, as fast as the image channel's airtime allows
+static void image_task(void *pv) {
+    uint8_t pkt[7 + IMAGE_LORA_DATA];
+    uint16_t image;
+    uint32_t offset;
+    while (1) {
+        size_t len = spool_next(&image, &offset, pkt + 7, IMAGE_LORA_DATA, portMAX_DELAY);
+        if (len) tx_image(pkt, image, offset, len);
     }
 }
 
-void duo_comm_task(void*pv){
-    switch image_state{
-        case SAVE:
-            uart_write_bytes(image_uart_num, (const char*) "is", strlen(n));
+// Files an image chunk in the spool, asking for a resend if one went missing. Only the first
+// chunk past a gap asks, the rest of them are already on their way and get dropped.
+static void duo_image_chunk(const uint8_t *payload, size_t len) {
+    static int gap_image = -1;
+    static uint32_t gap_offset;
+
+    if (len < DUO_IMAGE_HEADER) return;
+    uint16_t image = duo_get16(payload);
+    uint32_t offset = duo_get32(payload + 2);
+    uint32_t total = duo_get32(payload + 6);
+    uint32_t want;
+
+    // thumbnails jump the queue so the ground gets a look at every image as soon as it's taken
+    spool_result_t r = spool_put(image, offset, total, payload + DUO_IMAGE_HEADER, len - DUO_IMAGE_HEADER,
+                                 (image & DUO_IMAGE_THUMB) != 0, &want);
+    if (r == SPOOL_GAP && (gap_image != image || gap_offset != want)) {
+        gap_image = image;
+        gap_offset = want;
+        duo_resend(image, want);
+    }
+}
+
+// Hands a decoded frame on, it's only good until the next one is read
+static void duo_dispatch(duo_msg_t *msg) {
+    switch (msg->type) {
+        case DUO_IMAGE:
+            duo_image_chunk(msg->payload, msg->len);
+            break;
+        case DUO_GPS:
+            // small enough to just copy into the next report
+            if (xSemaphoreTake(queueMutex, portMAX_DELAY)==pdTRUE) {
+                snprintf(send_queue, sizeof(send_queue), "%.*s", (int)msg->len, (const char *)msg->payload);
+                xSemaphoreGive(queueMutex);
+            }
             break;
-        case TRANSMIT:
-            uart_write_bytes(image_uart_num, (const char*) "it", strlen(t));
+        case DUO_SAME:
+            if (msg->len < 5) break;
+            ESP_LOGI(TAG, "Duo image %u looks like %u (%u bits off), not sent", duo_get16(msg->payload),
+                     duo_get16(msg->payload + 2), msg->payload[4]);
+            if (xSemaphoreTake(queueMutex, portMAX_DELAY)==pdTRUE) {
+                same_image = duo_get16(msg->payload);
+                same_as = duo_get16(msg->payload + 2);
+                same_left = SAME_REPEAT;
+                xSemaphoreGive(queueMutex);
+            }
             break;
-        case NONE:
+        case DUO_ACK:
+            if (msg->len >= 2) ESP_LOGI(TAG, "Duo %s op %u", msg->payload[1] ? "failed" : "did", msg->payload[0]);
             break;
+        default:
+            ESP_LOGW(TAG, "Unknown frame type 0x%02x from duo", msg->type);
+            break;
+    }
+}
+
+// A frame finished at pos in the ring buffer, read it and the 0x00 after it into duo_rx
+static void duo_read_frame(int pos) {
+    uint8_t *buf = duo_rx;
+    size_t len = pos + 1;
+
+    if (len > DUO_ENCODED_MAX) {
+        // longer than any frame, throw it away a buffer at a time
+        while (len) {
+            size_t n = len < DUO_ENCODED_MAX ? len : DUO_ENCODED_MAX;
+            int got = uart_read_bytes(image_uart_num, buf, n, pdMS_TO_TICKS(100));
+            if (got <= 0) break;
+            duo_stats.rx_bytes += got;
+            len -= got;
+        }
+        duo_stats.bad_frames++;
+        return;
+    }
+
+    int got = uart_read_bytes(image_uart_num, buf, len, pdMS_TO_TICKS(100));
+    if (got > 0) duo_stats.rx_bytes += got;
+
+    duo_msg_t msg;
+    size_t plen;
+    if (got != (int)len || len == 1 || duo_frame_decode(buf, len - 1, &msg.type, &msg.payload, &plen) != 0) {
+        if (len > 1) duo_stats.bad_frames++;
+        return;
     }
-    char buf[1024];
-    char final[1024];
-    int length = 0;
-    int packet_len = 0;
-    ESP_ERROR_CHECK(uart_get_buffered_data_len(image_uart_num, (size_t*)&length));
-    if(length > 0){
-        uart_read_bytes(image_uart_num, buf, length, 100);
-        if(buf[0] == 'I'){
-            while(length>0){
-                tx_image(buf);
-                ESP_ERROR_CHECK(uart_get_buffered_data_len(image_uart_num, (size_t*)&length));
+    msg.len = plen;
+    duo_stats.frames++;
+    duo_dispatch(&msg);
+}
+
+static void duo_resync(void) {
+    uart_flush_input(image_uart_num);
+    uart_pattern_queue_reset(image_uart_num, DUO_EVENTS);
+    xQueueReset(duo_uart_queue);
+}
+
+void duo_uart_task(void*pv){
+    uart_event_t event;
+    int64_t last_stats = esp_timer_get_time();
+    duo_stats_t last = duo_stats;
+
+    while (1) {
+        if (xQueueReceive(duo_uart_queue, &event, pdMS_TO_TICKS(1000)) == pdTRUE) {
+            switch (event.type) {
+                case UART_PATTERN_DET: {
+                    int pos = uart_pattern_pop_pos(image_uart_num);
+                    if (pos < 0) {
+                        // lost track of where frames end, start again from the next one
+                        duo_stats.pattern_drops++;
+                        duo_resync();
+                    } else {
+                        duo_read_frame(pos);
+                    }
+                    break;
+                }
+                case UART_FIFO_OVF:
+                case UART_BUFFER_FULL:
+                    duo_stats.overruns++;
+                    duo_resync();
+                    break;
+                default:
+                    // UART_DATA is a partial frame, the pattern event comes once it's whole
+                    break;
             }
-            
-        }else if(buf[0] == 'G'){
-            snprintf(buf, length, final);
-            packet_len += length;
-            ESP_ERROR_CHECK(uart_get_buffered_data_len(image_uart_num, (size_t*)&length));
-            while(length>0){
-                snprintf(buf, length, final);
-                packet_len += length;
-                ESP_ERROR_CHECK(uart_get_buffered_data_len(image_uart_num, (size_t*)&length));
+        }
+
+        // images that didn't fit or stopped half way
+        uint16_t image;
+        uint32_t offset;
+        if (spool_wanted(&image, &offset)) duo_resend(image, offset);
+
+        int64_t now = esp_timer_get_time();
+        if (now - last_stats >= DUO_STATS_MS * 1000LL) {
+            uint32_t ms = (now - last_stats) / 1000;
+            ESP_LOGI(TAG, "Duo uart: rx %lu B/s tx %lu B/s, %lu frames %lu bad, %lu overruns %lu pattern drops",
+                (unsigned long)((duo_stats.rx_bytes - last.rx_bytes) * 1000ULL / ms),
+                (unsigned long)((duo_stats.tx_bytes - last.tx_bytes) * 1000ULL / ms),
+                (unsigned long)(duo_stats.frames - last.frames), (unsigned long)(duo_stats.bad_frames - last.bad_frames),
+                (unsigned long)duo_stats.overruns, (unsigned long)duo_stats.pattern_drops);
+            size_t spooled, cap;
+            int held;
+            spool_usage(&spooled, &cap, &held);
+            ESP_LOGI(TAG, "Image spool: %d images, %u of %u KB", held, (unsigned)(spooled / 1024), (unsigned)(cap / 1024));
+            last = duo_stats;
+            last_stats = now;
+        }
+    }
+}
+
+// parse uplink command
+static void apply_command(const char *cmd) {
+    if (strncmp(cmd, "CMD:STATE:",10)==0) {
+        int s = atoi(cmd+10);
+        if (s>=STATE_GROUND && s<=STATE_LANDED) {
+            flight_state = (flight_state_t)s;
+            ESP_LOGI(TAG, "State overridden to %d via CMD", s);
+        }
+    }else if (strncmp(cmd, "CMD:IMAGE:",10)==0) {
+        duo_save();
+    }else if (strncmp(cmd, "CMD:TIMAGE:",11)==0) {
+        duo_transmit();
+    }
+}
+
+// The ground station batches commands as UPL:<id>=<cmd>\n<id>=<cmd>\n... and resends anything
+// we don't ack, so apply each id only once but ack it every time it shows up. The acks go out
+// with the next telemetry frame.
+static void handle_uplink(char *buf) {
+    char *save;
+
+    for (char *line = strtok_r(buf + 4, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *eq = strchr(line, '=');
+        if (eq == NULL) continue;
+        *eq = '\0';
+        uint16_t id = (uint16_t)strtoul(line, NULL, 10);
+        if (id == 0) continue;
+
+        bool seen = false;
+        for (int i = 0; i < SEEN_IDS; i++) {
+            if (seen_ids[i] == id) seen = true;
+        }
+        if (seen) {
+            ESP_LOGI(TAG, "Uplink #%u is a retry, already applied", id);
+        } else {
+            apply_command(eq + 1);
+            seen_ids[seen_next] = id;
+            seen_next = (seen_next + 1) % SEEN_IDS;
+        }
+
+        if (xSemaphoreTake(queueMutex, portMAX_DELAY)==pdTRUE) {
+            bool pending = false;
+            for (int i = 0; i < pending_ack_count; i++) {
+                if (pending_acks[i] == id) pending = true;
             }
-            if (xSemaphoreTake(queueMutex, portMAX_DELAY)==pdTRUE) {
-                snprintf(send_queue, packet_len, final);
-                xSemaphoreGive(queueMutex);
+            // if there's no room the ground station just retries and we ack it then
+            if (!pending && pending_ack_count < ACK_PENDING_MAX) {
+                pending_acks[pending_ack_count++] = id;
             }
+            xSemaphoreGive(queueMutex);
         }
-        ESP_ERROR_CHECK(uart_get_buffered_data_len(image_uart_num, (size_t*)&length));
     }
-    transmit_image = false;
-    vTaskDelete(NULL);
 }
 
 void rx_task(void*pv) {
     while(1) {
         if (xSemaphoreTake(loraMutex, portMAX_DELAY)==pdTRUE) {
-            char buf[128];
-            uint8_t len = LoRaReceive((uint8_t*)buf, sizeof(buf));
+            char buf[256];
+            uint8_t len = LoRaReceive((uint8_t*)buf, sizeof(buf) - 1);
             if (len) {
                 buf[len]='\0';
                 ESP_LOGI(TAG, "Received: %s", buf);
-                // parse uplink command
-                if (strncmp(buf, "CMD:STATE:",10)==0) {
-                    int s = atoi(buf+10);
-                    if (s>=STATE_GROUND && s<=STATE_LANDED) {
-                        flight_state = (flight_state_t)s;
-                        ESP_LOGI(TAG, "State overridden to %d via CMD", s);
-                    }
-                }else if (strncmp(buf, "CMD:IMAGE:",10)==0) {
-                    image_state = SAVE;
-                }else if (strncmp(buf, "CMD:TIMAGE:",11)==0) {
-                    image_state = TRANSMIT;
+                airtime_heard(AIRTIME_UPLINK, LoRaGetTimeOnAir(len));
+                if (strncmp(buf, "UPL:", 4)==0) {
+                    handle_uplink(buf);
+                } else {
+                    // bare commands from older ground station builds
+                    apply_command(buf);
                 }
-            
             }
             xSemaphoreGive(loraMutex);
         }
-        vTaskDelay(pdMS_TO_TICKS(500));
+        // poll often enough to catch every packet of an uplink window
+        vTaskDelay(pdMS_TO_TICKS(50));
     }
 }
 
@@ -281,6 +601,12 @@ void app_main() {
     }
     LoRaConfig(7,4,1,8,0,true,false);
     loraMutex = xSemaphoreCreateMutex();
+
+    // Each second is one frame, the uplink window, and whatever's left for images. Telemetry's
+    // share is a bit more than a frame takes, what it doesn't use spills over to images.
+    airtime_init();
+    airtime_configure(AIRTIME_TELEMETRY, TELEMETRY_RATE_MS, 700);
+    airtime_configure(AIRTIME_IMAGE, IMAGE_RATE_MS, 400);
     queueMutex = xSemaphoreCreateMutex();
 
     nvs_flash_init(); esp_netif_init(); esp_event_loop_create_default();
@@ -335,19 +661,24 @@ if (bmp180_read_temperature(&t) == ESP_OK && bmp180_read_pressure(&p) == ESP_OK)
     }
 
     uart_config_t image_uart_config = {
-        .baud_rate = 115200,
+        .baud_rate = DUO_BAUD,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS,
-        .rx_flow_ctrl_thresh = 122,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
     };
     // Configure image UART parameters
-    ESP_ERROR_CHECK(uart_driver_install(image_uart_num, 1024, 1024, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_driver_install(image_uart_num, DUO_RX_BUF, DUO_TX_BUF, DUO_EVENTS, &duo_uart_queue, 0));
     ESP_ERROR_CHECK(uart_param_config(image_uart_num, &image_uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(image_uart_num, 48, 47, -1, -1)); //image tx: 48, rx: 47
+    ESP_ERROR_CHECK(uart_set_pin(image_uart_num, DUO_TX_PIN, DUO_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    // COBS means a 0x00 only ever shows up at the end of a frame, so it's safe to trigger on
+    ESP_ERROR_CHECK(uart_enable_pattern_det_baud_intr(image_uart_num, 0x00, 1, 9, 0, 0));
+    ESP_ERROR_CHECK(uart_pattern_queue_reset(image_uart_num, DUO_EVENTS));
+
+    spool_init();
 
     xTaskCreate(rx_task,"rx",4096,NULL,3,&rx_task_handle);
     xTaskCreate(transmit_loop_task,"tx",4096,NULL,4,NULL);
-    xTaskCreate(duo_comm_task, "duo comm",4096,NULL,3,NULL);
+    xTaskCreate(duo_uart_task, "duo uart",4096,NULL,5,NULL);
+    xTaskCreate(image_task, "image",4096,NULL,2,NULL);
 }
\ No newline at end of file
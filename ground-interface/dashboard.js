@@ -18,7 +18,8 @@ const gyroChart = createChart("gyro-chart", "Gyroscope", ["X", "Y", "Z"], -400,
 const pitchYawChart = createChart("pitch-yaw-chart", "Pitch/Yaw", ["Pitch", "Yaw"], -90, 90);
 const magChart = createChart("mag-chart", "Magnetometer", ["X", "Y", "Z"], 0, 1);
 
-let eventSource = null;
+let socket = null;
+let lastSeq = 0;
 let lastDataTime = Date.now();
 let staleTimeout = 5000; // 5 seconds
 
@@ -67,10 +68,11 @@ function updateChart(chart, values) {
 }
 
 function parseReport(report) {
-    if (!report.startsWith("DWL:1:")) return;
+    if (!report.startsWith("DWL:")) return;
 
     const data = {};
-    const fields = report.split(":");
+    // The timestamp is wrapped in braces with no separator after it, e.g. DWL:{1234}ACC:...
+    const fields = report.replace("}", "}:").split(":");
 
     for (let i = 0; i < fields.length; i++) {
         switch (fields[i]) {
@@ -98,21 +100,75 @@ function parseReport(report) {
             case "CHUTE":
                 data.chute = parseInt(fields[++i]);
                 break;
+            case "ALT":
+                data.alt = parseFloat(fields[++i]);
+                break;
+            case "TOF":
+                data.tof = parseFloat(fields[++i]);
+                break;
+            case "STATE":
+                data.state = parseInt(fields[++i]);
+                break;
         }
     }
 
     return data;
 }
 
+// Binary records from /ws, see ground-station/main/telemetry.h for the layout
+const RECORD_DOWNLINK = 1;
+const RECORD_TEXT = 2;
+const RECORD_REPLAY = 3;
+
+function parseDownlink(view, off) {
+    return {
+        seq: view.getUint32(off, true),
+        ts: view.getUint32(off + 4, true),
+        acc: [0, 1, 2].map(i => view.getFloat32(off + 8 + i * 4, true)),
+        gyro: [0, 1, 2].map(i => view.getFloat32(off + 20 + i * 4, true)),
+        pitch: view.getFloat32(off + 32, true),
+        yaw: view.getFloat32(off + 36, true),
+        alt: view.getFloat32(off + 40, true),
+        tof: view.getFloat32(off + 44, true),
+        state: view.getUint8(off + 48),
+        chute: view.getUint8(off + 49),
+        rssi: view.getInt8(off + 50),
+        snr: view.getInt8(off + 51)
+    };
+}
+
+function handleBatch(buffer) {
+    const view = new DataView(buffer);
+    let off = 0;
+
+    while (off + 3 <= view.byteLength) {
+        const type = view.getUint8(off);
+        const len = view.getUint16(off + 1, true);
+        off += 3;
+        if (off + len > view.byteLength) break;
+
+        if (type === RECORD_DOWNLINK || type === RECORD_REPLAY) {
+            const parsed = parseDownlink(view, off);
+            // A replay's seq is from whenever it was recorded, not where this boot's history is up to
+            if (type === RECORD_DOWNLINK) lastSeq = Math.max(lastSeq, parsed.seq);
+            updateUI(parsed);
+        } else if (type === RECORD_TEXT) {
+            const text = new TextDecoder().decode(new Uint8Array(buffer, off, len));
+            updateUI(parseReport(text));
+        }
+        off += len;
+    }
+}
+
 function updateUI(parsed) {
     if (!parsed) return;
 
-    updateChart(accChart, parsed.acc);
-    updateChart(gyroChart, parsed.gyro);
+    if (parsed.acc) updateChart(accChart, parsed.acc);
+    if (parsed.gyro) updateChart(gyroChart, parsed.gyro);
     updateChart(pitchYawChart, [parsed.pitch, parsed.yaw]);
-    updateChart(magChart, parsed.mag);
+    if (parsed.mag) updateChart(magChart, parsed.mag);
 
-    tempBox.textContent = `${parsed.temp.toFixed(2)} Â°C`;
+    if (parsed.temp !== undefined) tempBox.textContent = `${parsed.temp.toFixed(2)} Â°C`;
     wheelBox.textContent = parsed.wheel ?? '-';
     chuteBox.textContent = parsed.chute ? 'Deployed' : 'Not Deployed';
 }
@@ -128,18 +184,42 @@ function checkStale() {
     }
 }
 
-function startSSE() {
-    if (eventSource) {
-        eventSource.close();
+// Fills in whatever we missed while disconnected, one line per packet: seq,arrival_ms,rssi,snr,packet
+async function backfill() {
+    try {
+        const response = await fetch(`http://192.168.4.1/history?since=${lastSeq}`);
+        const text = await response.text();
+        for (const line of text.split("\n")) {
+            const parts = line.split(",");
+            if (parts.length < 5) continue;
+            lastSeq = Math.max(lastSeq, parseInt(parts[0]));
+            updateUI(parseReport(parts.slice(4).join(",")));
+        }
+    } catch (error) {
+        console.error("Failed to backfill history", error);
+    }
+}
+
+function startSocket() {
+    if (socket) {
+        socket.onclose = null;
+        socket.close();
     }
-    eventSource = new EventSource("http://192.168.4.1/sse");
-    eventSource.onmessage = (event) => {
-        const message = event.data;
+    socket = new WebSocket("ws://192.168.4.1/ws");
+    socket.binaryType = "arraybuffer";
+    socket.onopen = backfill;
+    socket.onmessage = (event) => {
+        // Text frames are replies to our own instructions
+        if (typeof event.data === "string") {
+            console.log("Instruction reply:", event.data);
+            return;
+        }
         resetStaleTimer();
-        updateUI(parseReport(message));
+        handleBatch(event.data);
     };
-    eventSource.onerror = () => {
-        console.error("SSE connection lost");
+    socket.onclose = () => {
+        console.error("Websocket connection lost, retrying");
+        if (!priorityMode) setTimeout(startSocket, 1000);
     };
 }
 
@@ -147,6 +227,13 @@ sendButton.addEventListener("click", async () => {
     const data = inputField.value.trim();
     if (!data) return;
 
+    // Commands share the telemetry socket, fall back to a POST if it isn't up
+    if (socket && socket.readyState === WebSocket.OPEN) {
+        socket.send(data);
+        inputField.value = "";
+        return;
+    }
+
     try {
         const response = await fetch("http://192.168.4.1/instruction", {
             method: "POST",
@@ -167,14 +254,94 @@ sendButton.addEventListener("click", async () => {
         priorityToggle.addEventListener("click", () => {
             priorityMode = !priorityMode;
             if (priorityMode) {
-                if (eventSource) eventSource.close();
+                if (socket) {
+                    socket.onclose = null;
+                    socket.close();
+                }
                 priorityToggle.innerText = "Disable Priority Transmission";
             } else {
-                startSSE();
+                startSocket();
                 priorityToggle.innerText = "Enable Priority Transmission";
             }
         });
 
 
+// The can sends a thumbnail of each image first, then the image in tiles that fill in as they
+// come down, grey until then. /images says how far each has got:
+// name,image,bytes,complete,packets,dropped,tiles,good
+// and same,image,as when the can didn't send an image because it looked like an earlier one, and
+// geo,image,lat,lon,alt_cm,fix,sats,unix_s,flight_ms for where and when an image was taken
+const imageView = document.getElementById("image-view");
+const imageInfo = document.getElementById("image-info");
+const IMAGE_MIN_BYTES = 1500;   // a few rows of tiles, less than that and the thumbnail says more
+let imageShown = "";
+
+// Where and when an image was taken, from its geo line
+function describeGeo(g) {
+    if (!g) return "";
+    let text = g.fix ? `, taken at ${g.lat.toFixed(6)}, ${g.lon.toFixed(6)}, ${g.alt.toFixed(1)} m` : ", no GPS fix";
+    if (g.unix) text += ` at ${new Date(g.unix * 1000).toISOString().slice(11, 19)} UTC`;
+    if (g.flight) text += ` (flight time ${(g.flight / 1000).toFixed(1)} s)`;
+    return text;
+}
+
+async function pollImages() {
+    try {
+        const response = await fetch("http://192.168.4.1/images");
+        const slots = {};
+        let same = null;
+        const geo = {};
+        for (const line of (await response.text()).split("\n")) {
+            const parts = line.split(",");
+            if (parts[0] === "same" && parts.length >= 3) {
+                same = { image: parseInt(parts[1]), as: parseInt(parts[2]) };
+                continue;
+            }
+            if (parts[0] === "geo" && parts.length >= 9) {
+                const [lat, lon, alt, fix, sats, unix, flight] = parts.slice(2).map(Number);
+                geo[parseInt(parts[1])] = { lat: lat / 1e7, lon: lon / 1e7, alt: alt / 100, fix, sats, unix, flight };
+                continue;
+            }
+            if (parts.length < 6) continue;
+            slots[parts[0]] = {
+                image: parseInt(parts[1]), bytes: parseInt(parts[2]), complete: parts[3] === "1",
+                tiles: parseInt(parts[6] ?? "0"), good: parseInt(parts[7] ?? "0")
+            };
+        }
+
+        // The full image once enough of it is in to beat the thumbnail, the thumbnail until then
+        const { image, thumb } = slots;
+        let show = null;
+        let url = "";
+        if (image && (!thumb || image.image >= thumb.image) && (image.complete || image.bytes >= IMAGE_MIN_BYTES)) {
+            show = image;
+            url = "http://192.168.4.1/image";
+        } else if (thumb) {
+            show = thumb;
+            url = "http://192.168.4.1/image?thumb=1";
+        }
+        if (!show) {
+            if (same) imageInfo.textContent = `Image ${same.image} looked like ${same.as}, not sent`;
+            return;
+        }
+
+        // Only refetch when something new has arrived
+        const key = `${url}:${show.image}:${show.bytes}`;
+        if (key !== imageShown) {
+            imageShown = key;
+            imageView.src = `${url}${url.includes("?") ? "&" : "?"}t=${Date.now()}`;
+            imageView.classList.remove("hidden");
+        }
+        imageInfo.textContent = `Image ${show.image}${show === thumb ? " (thumbnail)" : ""}, ` +
+            `${show.bytes} bytes${show.complete ? "" : ", still coming"}` +
+            (show.tiles ? `, ${show.good} of ${show.tiles} tiles` : "") +
+            describeGeo(geo[show.image]) +
+            (same && same.image > show.image ? `. Image ${same.image} looked like ${same.as}, not sent` : "");
+    } catch (error) {
+        console.error("Failed to poll images", error);
+    }
+}
+
 setInterval(checkStale, 1000);
-startSSE();
+setInterval(pollImages, 2000);
+startSocket();
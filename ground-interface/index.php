@@ -58,6 +58,11 @@
                 <h2 class="font-semibold">Parachute</h2>
                 <div id="chute-box">--</div>
             </div>
+            <div class="tile h-[300px] bg-gray-700 p-4 rounded-xl">
+                <h2 class="font-semibold">Camera</h2>
+                <img id="image-view" class="h-[220px] mx-auto hidden" style="image-rendering: auto" alt="">
+                <div id="image-info">No image yet</div>
+            </div>
         </div>
 
         <!-- Transmission -->
@@ -26,6 +26,7 @@ static spi_device_handle_t SpiHandle;
 
 // Global Stuff
 static uint8_t PacketParams[6];
+static uint8_t ModulationParams[4];
 static bool txActive;
 static int txLost = 0;
 static bool debugPrint;
@@ -295,6 +296,50 @@ void LoRaConfig(uint8_t spreadingFactor, uint8_t bandwidth, uint8_t codingRate,
 }
 
 
+static uint32_t LoRaBandwidthHz(uint8_t bandwidth)
+{
+	switch (bandwidth) {
+		case SX126X_LORA_BW_7_8:	return 7810;
+		case SX126X_LORA_BW_10_4:	return 10420;
+		case SX126X_LORA_BW_15_6:	return 15630;
+		case SX126X_LORA_BW_20_8:	return 20830;
+		case SX126X_LORA_BW_31_25:	return 31250;
+		case SX126X_LORA_BW_41_7:	return 41670;
+		case SX126X_LORA_BW_62_5:	return 62500;
+		case SX126X_LORA_BW_125_0:	return 125000;
+		case SX126X_LORA_BW_250_0:	return 250000;
+		case SX126X_LORA_BW_500_0:	return 500000;
+	}
+	return 125000;
+}
+
+
+// Time on air in microseconds of a len byte packet with the current LoRaConfig settings.
+// This is the formula from the SX126x datasheet (6.1.4), worked in quarter symbols.
+uint32_t LoRaGetTimeOnAir(uint8_t len)
+{
+	uint8_t sf = ModulationParams[0];
+	uint32_t bw = LoRaBandwidthHz(ModulationParams[1]);
+	uint8_t cr = ModulationParams[2];
+	bool ldro = ModulationParams[3];
+	uint16_t preamble = (PacketParams[0] << 8) | PacketParams[1];
+	bool implicitHeader = (PacketParams[2] == 0x01);
+	bool crcOn = (PacketParams[4] == SX126X_LORA_CRC_ON);
+
+	if (sf == 0) return 0; // LoRaConfig hasn't been called
+
+	int32_t bits = 8 * len + (crcOn ? 16 : 0) - 4 * sf + (implicitHeader ? 0 : 20);
+	if (sf >= 7) bits += 8;
+	if (bits < 0) bits = 0;
+	int32_t bitsPerSymbol = 4 * (ldro ? sf - 2 : sf);
+	uint32_t payloadSymbols = (bits + bitsPerSymbol - 1) / bitsPerSymbol * (cr + 4);
+
+	// preamble + 4.25 sync symbols (6.25 for SF5/6) + 8 header symbols
+	uint32_t quarterSymbols = (payloadSymbols + preamble + 8) * 4 + ((sf < 7) ? 25 : 17);
+	return (uint32_t)(((uint64_t)quarterSymbols << sf) * 1000000 / bw / 4);
+}
+
+
 void LoRaDebugPrint(bool enable) 
 {
 	debugPrint = enable;
@@ -656,6 +701,7 @@ void SetModulationParams(uint8_t spreadingFactor, uint8_t bandwidth, uint8_t cod
 	data[1] = bandwidth;
 	data[2] = codingRate;
 	data[3] = lowDataRateOptimize;
+	memcpy(ModulationParams, data, 4); // kept for LoRaGetTimeOnAir
 	WriteCommand(SX126X_CMD_SET_MODULATION_PARAMS, data, 4); // 0x8B
 }
 
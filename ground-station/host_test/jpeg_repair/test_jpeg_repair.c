@@ -0,0 +1,226 @@
+// Runs jpeg_repair over tiled jpegs with packets dropped the way LoRa drops them and checks
+// every tile it keeps ends up where it came from. The images are a mix of flat and noisy
+// patches, so a big tile sits among small ones like in a real picture, which is where guessing
+// a tile's number after a hole goes wrong.
+#include "jpeg_repair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#define WIDTH           320
+#define HEIGHT          240
+#define TILE_BYTES      200     // what the can aims for
+#define PACKET_BYTES    100
+#define LOSS_PERCENT    5       // single packets, never two in a row
+#define IMAGES          200
+#define MISPLACED_MAX   1       // percent of the tiles kept
+
+static uint32_t rng = 12345;
+
+static uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Flat colour, gradients and noise in random patches
+static void make_image(uint8_t *rgb)
+{
+    for (int i = 0; i < WIDTH * HEIGHT * 3; i++) rgb[i] = 60;
+    for (int patch = 0; patch < 12; patch++) {
+        int x0 = next_random() % WIDTH, y0 = next_random() % HEIGHT;
+        int w = 16 + next_random() % 120, h = 16 + next_random() % 90;
+        int kind = next_random() % 3;
+        uint8_t base[3] = { next_random(), next_random(), next_random() };
+        for (int y = y0; y < y0 + h && y < HEIGHT; y++) {
+            for (int x = x0; x < x0 + w && x < WIDTH; x++) {
+                for (int c = 0; c < 3; c++) {
+                    uint8_t v = base[c];
+                    if (kind == 1) v += (x - x0) + (y - y0);
+                    if (kind == 2) v = next_random();
+                    rgb[(y * WIDTH + x) * 3 + c] = v;
+                }
+            }
+        }
+    }
+}
+
+static size_t encode(const uint8_t *rgb, unsigned restart, uint8_t **out)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned long len = 0;
+
+    *out = NULL;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, out, &len);
+    cinfo.image_width = WIDTH;
+    cinfo.image_height = HEIGHT;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 75, TRUE);
+    cinfo.restart_interval = restart;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < HEIGHT) {
+        JSAMPROW row = (JSAMPROW)(rgb + cinfo.next_scanline * WIDTH * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return len;
+}
+
+// Splits the scan at its restart markers, returns how many tiles there are
+static int split_tiles(const uint8_t *buf, size_t len, uint32_t *start, uint32_t *end)
+{
+    size_t p = 2;
+    while (p + 4 <= len && !(buf[p] == 0xFF && buf[p + 1] == 0xDA)) p += 2 + ((buf[p + 2] << 8) | buf[p + 3]);
+    if (p + 4 > len) return 0;
+    p += 2 + ((buf[p + 2] << 8) | buf[p + 3]);
+
+    int n = 0;
+    start[0] = p;
+    for (; p + 1 < len && n < JPEG_REPAIR_TILES_MAX; p++) {
+        if (buf[p] != 0xFF || buf[p + 1] == 0x00) continue;
+        if (buf[p + 1] >= 0xD0 && buf[p + 1] <= 0xD7) {
+            end[n++] = p;
+            start[n] = p + 2;
+        } else if (buf[p + 1] == 0xD9) {
+            end[n++] = p;
+            break;
+        }
+        p++;
+    }
+    return n;
+}
+
+struct decode_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void decode_failed(j_common_ptr cinfo)
+{
+    longjmp(((struct decode_error *)cinfo->err)->jump, 1);
+}
+
+// Warnings are still counted, just not printed
+static void decode_quiet(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+// Whether libjpeg reads it all the way through without complaining
+static bool decodes(const uint8_t *buf, size_t len)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct decode_error err;
+    static uint8_t row[WIDTH * 3];
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = decode_failed;
+    err.mgr.output_message = decode_quiet;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, buf, len);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW r = row;
+        jpeg_read_scanlines(&cinfo, &r, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    bool clean = err.mgr.num_warnings == 0;
+    jpeg_destroy_decompress(&cinfo);
+    return clean;
+}
+
+int main(void)
+{
+    static uint8_t rgb[WIDTH * HEIGHT * 3];
+    static uint8_t received[256 * 1024], repaired[256 * 1024];
+    static jpeg_span_t spans[4096];
+    static uint32_t orig_start[JPEG_REPAIR_TILES_MAX + 1], orig_end[JPEG_REPAIR_TILES_MAX];
+    static uint32_t rep_start[JPEG_REPAIR_TILES_MAX + 1], rep_end[JPEG_REPAIR_TILES_MAX];
+    int correct = 0, misplaced = 0, lost = 0, failed = 0;
+
+    for (int image = 0; image < IMAGES; image++) {
+        make_image(rgb);
+
+        // Restart interval for tiles of about TILE_BYTES, from how big the image is without
+        uint8_t *jpeg;
+        size_t len = encode(rgb, 0, &jpeg);
+        unsigned mcus = (WIDTH / 16) * (HEIGHT / 16);
+        unsigned restart = (unsigned)((uint64_t)mcus * TILE_BYTES / len);
+        free(jpeg);
+        len = encode(rgb, restart ? restart : 1, &jpeg);
+        int tiles = split_tiles(jpeg, len, orig_start, orig_end);
+
+        // Nothing before the scan is dropped, jpeg_repair can't do anything without the headers
+        int nspans = 0;
+        bool dropped_last = true;
+        memset(received, 0, len);
+        for (size_t p = 0; p < len; p += PACKET_BYTES) {
+            size_t end = (p + PACKET_BYTES < len) ? p + PACKET_BYTES : len;
+            if (p >= orig_start[0] && !dropped_last && next_random() % 100 < LOSS_PERCENT) {
+                dropped_last = true;
+                continue;
+            }
+            memcpy(received + p, jpeg + p, end - p);
+            if (nspans && spans[nspans - 1].end == p) {
+                spans[nspans - 1].end = end;
+            } else {
+                spans[nspans].start = p;
+                spans[nspans++].end = end;
+            }
+            dropped_last = false;
+        }
+
+        jpeg_repair_stats_t stats;
+        size_t out = jpeg_repair(received, spans, nspans, repaired, sizeof(repaired), &stats);
+        if (out == 0 || stats.tiles != tiles || split_tiles(repaired, out, rep_start, rep_end) != tiles ||
+            !decodes(repaired, out)) {
+            failed++;
+            free(jpeg);
+            continue;
+        }
+
+        // A tile that's byte for byte one of the originals was kept, the rest are grey
+        for (int k = 0; k < tiles; k++) {
+            uint32_t n = rep_end[k] - rep_start[k];
+            if (n == orig_end[k] - orig_start[k] && memcmp(repaired + rep_start[k], jpeg + orig_start[k], n) == 0) {
+                correct++;
+                continue;
+            }
+            bool found = false;
+            for (int j = 0; j < tiles && !found; j++) {
+                found = n == orig_end[j] - orig_start[j] && memcmp(repaired + rep_start[k], jpeg + orig_start[j], n) == 0;
+            }
+            if (found) {
+                misplaced++;
+            } else {
+                lost++;
+            }
+        }
+        free(jpeg);
+    }
+
+    printf("%d images: %d tiles in the right place, %d in the wrong place, %d grey, %d not repaired\n", IMAGES,
+           correct, misplaced, lost, failed);
+    if (failed || misplaced * 100 > correct * MISPLACED_MAX) {
+        printf("FAIL\n");
+        return 1;
+    }
+    return 0;
+}
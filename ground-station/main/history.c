@@ -0,0 +1,98 @@
+#include "history.h"
+#include <string.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "history";
+
+static rx_packet_t *entries;
+static size_t capacity;
+static size_t head;     // where the next packet goes
+static size_t count;
+static SemaphoreHandle_t history_mutex;
+
+esp_err_t history_init(void)
+{
+    capacity = HISTORY_PSRAM_ENTRIES;
+    entries = heap_caps_malloc(capacity * sizeof(rx_packet_t), MALLOC_CAP_SPIRAM);
+    if (entries == NULL) {
+        ESP_LOGW(TAG, "No PSRAM, falling back to %d entries in internal RAM", HISTORY_INTERNAL_ENTRIES);
+        capacity = HISTORY_INTERNAL_ENTRIES;
+        entries = heap_caps_malloc(capacity * sizeof(rx_packet_t), MALLOC_CAP_DEFAULT);
+    }
+    if (entries == NULL) {
+        capacity = 0;
+        return ESP_ERR_NO_MEM;
+    }
+
+    history_mutex = xSemaphoreCreateMutex();
+    ESP_LOGI(TAG, "Keeping the last %d packets", (int)capacity);
+    return ESP_OK;
+}
+
+size_t history_capacity(void)
+{
+    return capacity;
+}
+
+// i is the logical index, 0 being the oldest entry still held
+static rx_packet_t *entry_at(size_t i)
+{
+    return &entries[(head + capacity - count + i) % capacity];
+}
+
+void history_append(const rx_packet_t *pkt)
+{
+    if (entries == NULL) return;
+
+    xSemaphoreTake(history_mutex, portMAX_DELAY);
+    entries[head] = *pkt;
+    head = (head + 1) % capacity;
+    if (count < capacity) count++;
+    xSemaphoreGive(history_mutex);
+}
+
+// Packets go in in seq and arrival order, so both are sorted and we can binary search for the
+// first entry past the cursor instead of walking the ring
+static size_t lower_bound(uint32_t after_seq, uint32_t min_ms)
+{
+    size_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const rx_packet_t *e = entry_at(mid);
+        if (e->seq <= after_seq || e->arrival_ms < min_ms) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+size_t history_read(history_cursor_t *cur, rx_packet_t *out, size_t max)
+{
+    size_t n = 0;
+
+    if (entries == NULL) return 0;
+
+    xSemaphoreTake(history_mutex, portMAX_DELAY);
+    while (n < max) {
+        uint32_t min_ms = (cur->next_ms > cur->from_ms) ? cur->next_ms : cur->from_ms;
+        size_t i = lower_bound(cur->after_seq, min_ms);
+        if (i >= count) break;
+
+        const rx_packet_t *e = entry_at(i);
+        if (e->arrival_ms > cur->to_ms) break;
+
+        out[n++] = *e;
+        cur->after_seq = e->seq;
+        if (cur->step_ms) {
+            cur->next_ms = e->arrival_ms - (e->arrival_ms - cur->from_ms) % cur->step_ms + cur->step_ms;
+        }
+    }
+    xSemaphoreGive(history_mutex);
+    return n;
+}
@@ -0,0 +1,27 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+#include "esp_err.h"
+#include "telemetry.h"
+
+// Every received packet is kept in a ring so a dashboard that (re)connects mid flight can
+// backfill. The ring lives in PSRAM when there is some, otherwise a much smaller one is
+// carved out of internal RAM.
+#define HISTORY_PSRAM_ENTRIES       4096
+#define HISTORY_INTERNAL_ENTRIES    128
+
+// Query state for history_read, fill in the filters and zero the rest. The cursor is
+// advanced on every call so the same struct can be used to page through a long range.
+typedef struct {
+    uint32_t after_seq;     // only entries with a larger seq
+    uint32_t from_ms;       // arrival time window, inclusive
+    uint32_t to_ms;
+    uint32_t step_ms;       // downsampling, at most one entry per step (0 keeps everything)
+    uint32_t next_ms;       // start of the next downsampling bucket, managed by history_read
+} history_cursor_t;
+
+esp_err_t history_init(void);
+void history_append(const rx_packet_t *pkt);
+size_t history_read(history_cursor_t *cur, rx_packet_t *out, size_t max);
+size_t history_capacity(void);
+
+#endif
@@ -1,33 +1,158 @@
 #include "http.h"
+#include "telemetry.h"
+#include "history.h"
+#include "journal.h"
+#include "uplink.h"
+#include "airtime.h"
+#include "image_rx.h"
 #include "esp_tls_crypto.h"
 #include <esp_http_server.h>
 #include <string.h>
+#include <stdlib.h>
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include "lwip/sys.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
 #include <sys/param.h>
 
 static const char *TAG = "http";
 
-// Global queues for incoming/outgoing messages
-static QueueHandle_t *outgoing;
+// Global queues for incoming messages
 static QueueHandle_t *incoming;
-static QueueHandle_t *image_out;
 
 // Buffer to store the latest received LoRa message
 static char latest_message[400] = "No data received";
 
+static httpd_handle_t server_handle = NULL;
+
+// The publisher owns `incoming` and fans every packet out to the websocket clients
+static TaskHandle_t publish_task_handle;
+
+#define WS_BATCH_MAX        1024    // largest binary frame we push to a websocket client
+#define WS_BATCH_LINGER_MS  20      // how long to wait for more packets before sending a batch
+#define WS_PENDING_MAX      4       // batches queued for the httpd task and not sent yet
+static SemaphoreHandle_t ws_pending;
+
+// ------------------------- UPLINK HELPER -------------------------
+// Hands an instruction to the uplink for the LoRa tx_task, shared by /instruction and /ws.
+// Returns the command id to watch on /commands, 0 if it was dropped.
+static uint16_t queue_instruction(const char *cmd)
+{
+    uint16_t id = uplink_submit(cmd);
+    if (id == 0) {
+        ESP_LOGE(TAG, "Too many commands waiting on acks! Dropping message.");
+        return 0;
+    }
+    // tx_task picks it up in the can's next uplink window
+    ESP_LOGI(TAG, "Queued uplink command #%u.", id);
+    return id;
+}
+
+// ------------------------- PUBLISHER -------------------------
+// A batch on its way to the httpd task, freed once it's gone to every client
+typedef struct {
+    size_t len;
+    uint8_t data[];
+} ws_batch_t;
+
+// Runs in the httpd task, the only place the session list can be walked and written to without
+// racing httpd closing a session under us
+static void ws_broadcast_work(void *arg)
+{
+    ws_batch_t *b = arg;
+    size_t fds = CONFIG_LWIP_MAX_SOCKETS;
+    int client_fds[CONFIG_LWIP_MAX_SOCKETS];
+
+    if (server_handle != NULL && httpd_get_client_list(server_handle, &fds, client_fds) == ESP_OK) {
+        httpd_ws_frame_t frame = {
+            .final      = true,
+            .fragmented = false,
+            .type       = HTTPD_WS_TYPE_BINARY,
+            .payload    = b->data,
+            .len        = b->len
+        };
+
+        for (size_t i = 0; i < fds; i++) {
+            if (httpd_ws_get_fd_info(server_handle, client_fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET) continue;
+            if (httpd_ws_send_frame_async(server_handle, client_fds[i], &frame) != ESP_OK) {
+                ESP_LOGW(TAG, "Failed to send ws frame to fd %d", client_fds[i]);
+            }
+        }
+    }
+    free(b);
+    xSemaphoreGive(ws_pending);
+}
+
+// Hands one batch to the httpd task for every connected websocket client. At most
+// WS_PENDING_MAX batches wait for it and past that they're dropped, so a slow httpd task can't
+// hold up the publisher, a client that misses some can catch up from /history.
+static void ws_broadcast(const uint8_t *batch, size_t len)
+{
+    if (server_handle == NULL || xSemaphoreTake(ws_pending, 0) != pdTRUE) {
+        return;
+    }
+    ws_batch_t *b = malloc(sizeof(*b) + len);
+    if (b == NULL) {
+        xSemaphoreGive(ws_pending);
+        return;
+    }
+    b->len = len;
+    memcpy(b->data, batch, len);
+    if (httpd_queue_work(server_handle, ws_broadcast_work, b) != ESP_OK) {
+        ESP_LOGW(TAG, "Couldn't queue a ws batch");
+        free(b);
+        xSemaphoreGive(ws_pending);
+    }
+}
+
+static void publish_task(void *pvParameters)
+{
+    static rx_packet_t pkt;
+    static uint8_t batch[WS_BATCH_MAX];
+
+    while (1) {
+        size_t batch_len = 0;
+        TickType_t wait = portMAX_DELAY;
+
+        // Block for the first packet, then grab whatever else shows up within the linger time
+        while (xQueueReceive(*incoming, (void *)&pkt, wait) == pdTRUE) {
+            pkt.data[RX_PACKET_MAX] = '\0';
+            snprintf(latest_message, sizeof(latest_message), "%s", pkt.data); // Store latest message
+
+            // Replayed packets go to the clients like live ones but aren't live history
+            if (!(pkt.flags & RX_PACKET_REPLAY)) {
+                history_append(&pkt);
+            }
+
+            size_t n = telemetry_encode_record(&pkt, batch + batch_len, sizeof(batch) - batch_len);
+            if (n == 0) {
+                // Batch is full, flush it and start a new one with this packet
+                ws_broadcast(batch, batch_len);
+                batch_len = telemetry_encode_record(&pkt, batch, sizeof(batch));
+            } else {
+                batch_len += n;
+            }
+            wait = pdMS_TO_TICKS(WS_BATCH_LINGER_MS);
+        }
+
+        if (batch_len > 0) {
+            ws_broadcast(batch, batch_len);
+        }
+    }
+}
+
 // ------------------------- STATUS ENDPOINT -------------------------
 static esp_err_t status_get_handler(httpd_req_t *req)
 {
     ESP_LOGI(TAG, "Status requested");
     httpd_resp_set_type(req, "text/plain");
-    httpd_resp_send(req, ":) please poll sse endpoint or latest for data", HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, ":) connect to /ws or poll latest for data", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
@@ -38,85 +163,239 @@ static const httpd_uri_t status = {
     .user_ctx  = NULL
 };
 
-// ------------------------- SSE ENDPOINT -------------------------
-static esp_err_t sse_handler(httpd_req_t *req)
+// ------------------------- LATEST MESSAGE ENDPOINT -------------------------
+static esp_err_t latest_get_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "text/event-stream");
-    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
-    httpd_resp_set_hdr(req, "Connection", "keep-alive");
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, latest_message, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
 
-    char in[400];
+static const httpd_uri_t latest = {
+    .uri       = "/latest",
+    .method    = HTTP_GET,
+    .handler   = latest_get_handler,
+    .user_ctx  = NULL
+};
 
-    while (1) {
-        if (xQueueReceive(*incoming, (void *)&in, 0) == pdTRUE) {
-            snprintf(latest_message, sizeof(latest_message), "%s", in); // Store latest message
-            char sse_data[420];
-            int len = snprintf(sse_data, sizeof(sse_data), "data: %s\n\n", in);
-            if (httpd_resp_send_chunk(req, sse_data, len) != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to send SSE data");
-                break;
+// ------------------------- HISTORY ENDPOINT -------------------------
+// /history?since=<seq> returns everything received after seq, /history?from=&to=&step= returns
+// packets that arrived in [from, to] ms of ground station uptime, at most one per step ms.
+// One packet per line: seq,arrival_ms,rssi,snr,packet
+static uint32_t query_u32(const char *query, const char *key, uint32_t fallback)
+{
+    char val[16];
+    if (httpd_query_key_value(query, key, val, sizeof(val)) != ESP_OK) return fallback;
+    return (uint32_t)strtoul(val, NULL, 10);
+}
+
+static esp_err_t history_get_handler(httpd_req_t *req)
+{
+    char query[96] = "";
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+
+    history_cursor_t cur = {
+        .after_seq = query_u32(query, "since", 0),
+        .from_ms   = query_u32(query, "from", 0),
+        .to_ms     = query_u32(query, "to", UINT32_MAX),
+        .step_ms   = query_u32(query, "step", 0),
+    };
+
+    // Lets the client line its from/to up with our clock
+    static char now_ms[16];
+    snprintf(now_ms, sizeof(now_ms), "%lu", (unsigned long)(esp_timer_get_time() / 1000));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "X-Uptime-Ms", now_ms);
+
+    // Copy out a page at a time so the history isn't locked while we wait on the socket
+    static rx_packet_t page[8];
+    static char line[RX_PACKET_MAX + 48];
+    size_t n;
+
+    while ((n = history_read(&cur, page, sizeof(page) / sizeof(page[0]))) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            int len = snprintf(line, sizeof(line), "%lu,%lu,%d,%d,%s\n",
+                               (unsigned long)page[i].seq, (unsigned long)page[i].arrival_ms,
+                               page[i].rssi, page[i].snr, page[i].data);
+            if (httpd_resp_send_chunk(req, line, MIN(len, (int)sizeof(line) - 1)) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to send history");
+                return ESP_FAIL;
             }
         }
-        vTaskDelay(pdMS_TO_TICKS(500)); // Send data every 500ms
     }
 
-    httpd_resp_send_chunk(req, NULL, 0);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static const httpd_uri_t history = {
+    .uri       = "/history",
+    .method    = HTTP_GET,
+    .handler   = history_get_handler,
+    .user_ctx  = NULL
+};
+
+// ------------------------- JOURNAL / REPLAY ENDPOINTS -------------------------
+static esp_err_t journal_get_handler(httpd_req_t *req)
+{
+    static char buf[1024];
+    journal_status(buf, sizeof(buf));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
+}
+
+static const httpd_uri_t journal = {
+    .uri       = "/journal",
+    .method    = HTTP_GET,
+    .handler   = journal_get_handler,
+    .user_ctx  = NULL
+};
+
+static esp_err_t journal_erase_handler(httpd_req_t *req)
+{
+    journal_erase();
+    httpd_resp_send(req, "ACK", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
-static const httpd_uri_t sse = {
-    .uri       = "/sse",
+static const httpd_uri_t journal_erase_uri = {
+    .uri       = "/journal/erase",
+    .method    = HTTP_POST,
+    .handler   = journal_erase_handler,
+    .user_ctx  = NULL
+};
+
+// /replay?boot=<n> plays back one recorded flight, /replay?from=<seq> starts at a journal seq.
+// speed=<n> plays it back n times faster (default 1, 0 is as fast as possible), stop=1 ends it.
+// Replayed packets come out of /ws like live ones.
+static esp_err_t replay_get_handler(httpd_req_t *req)
+{
+    char query[96] = "";
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+    if (query_u32(query, "stop", 0)) {
+        journal_replay_stop();
+        return httpd_resp_send(req, "stopping replay", HTTPD_RESP_USE_STRLEN);
+    }
+
+    esp_err_t err = journal_replay_start(*incoming,
+                                         (uint16_t)query_u32(query, "boot", 0),
+                                         query_u32(query, "from", 0),
+                                         query_u32(query, "speed", 1));
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Replay not started: %s", esp_err_to_name(err));
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_send(req, esp_err_to_name(err), HTTPD_RESP_USE_STRLEN);
+    }
+    return httpd_resp_send(req, "replaying", HTTPD_RESP_USE_STRLEN);
+}
+
+static const httpd_uri_t replay = {
+    .uri       = "/replay",
     .method    = HTTP_GET,
-    .handler   = sse_handler,
+    .handler   = replay_get_handler,
     .user_ctx  = NULL
 };
 
-// ------------------------- SSE2 ENDPOINT -------------------------
-static esp_err_t sse2_handler(httpd_req_t *req)
+// ------------------------- COMMANDS ENDPOINT -------------------------
+// Recent uplink commands and how long they took, see uplink_status for the format
+static esp_err_t commands_get_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "text/event-stream");
-    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
-    httpd_resp_set_hdr(req, "Connection", "keep-alive");
+    static char buf[UPLINK_TRACKED * (UPLINK_CMD_MAX + 48)];
+    uplink_status(buf, sizeof(buf));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
+}
 
-    char in[110];
+static const httpd_uri_t commands = {
+    .uri       = "/commands",
+    .method    = HTTP_GET,
+    .handler   = commands_get_handler,
+    .user_ctx  = NULL
+};
 
-    while (1) {
-        if (xQueueReceive(*image_out, (void *)&in, 0) == pdTRUE) {
-            snprintf(latest_message, sizeof(latest_message), "%s", in); // Store latest message
-            char sse_data[130];
-            int len = snprintf(sse_data, sizeof(sse_data), "data: %s\n\n", in);
-            if (httpd_resp_send_chunk(req, sse_data, len) != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to send SSE data");
-                break;
-            }
-        }
-        vTaskDelay(pdMS_TO_TICKS(500)); // Send data every 500ms
+// ------------------------- AIRTIME ENDPOINT -------------------------
+// How busy the channel is, see airtime_status for the format. Utilization counts our uplink and
+// every packet we heard from the can, the can's own view is in the AIR: telemetry field.
+static esp_err_t airtime_get_handler(httpd_req_t *req)
+{
+    char buf[256];
+    airtime_status(buf, sizeof(buf));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
+}
+
+static const httpd_uri_t airtime = {
+    .uri       = "/airtime",
+    .method    = HTTP_GET,
+    .handler   = airtime_get_handler,
+    .user_ctx  = NULL
+};
+
+// ------------------------- IMAGE ENDPOINTS -------------------------
+// /image is the latest image as far as it's got, with grey where tiles are missing, and
+// /image?thumb=1 its thumbnail. X-Image says which image it is so a client can tell when it changes.
+static esp_err_t image_get_handler(httpd_req_t *req)
+{
+    char query[32] = "";
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+    bool thumb = query_u32(query, "thumb", 0) != 0;
+
+    static uint8_t chunk[1024];
+    uint16_t image = 0;
+    uint32_t offset = 0;
+    size_t n = image_rx_read(thumb, &image, 0, chunk, sizeof(chunk));
+
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    if (n == 0) {
+        httpd_resp_set_status(req, "404 Not Found");
+        return httpd_resp_send(req, NULL, 0);
     }
 
-    httpd_resp_send_chunk(req, NULL, 0);
-    return ESP_OK;
-    vTaskDelay(pdMS_TO_TICKS(50));
+    static char image_hdr[8];
+    snprintf(image_hdr, sizeof(image_hdr), "%u", image);
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "X-Image", image_hdr);
+
+    // A copy at a time, packets keep landing while we're waiting on the socket
+    while (n > 0) {
+        if (httpd_resp_send_chunk(req, (const char *)chunk, n) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        offset += n;
+        n = image_rx_read(thumb, &image, offset, chunk, sizeof(chunk));
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
-static const httpd_uri_t sse2 = {
-    .uri       = "/sse2",
+static const httpd_uri_t image_uri = {
+    .uri       = "/image",
     .method    = HTTP_GET,
-    .handler   = sse_handler,
+    .handler   = image_get_handler,
     .user_ctx  = NULL
 };
 
-// ------------------------- LATEST MESSAGE ENDPOINT -------------------------
-static esp_err_t latest_get_handler(httpd_req_t *req)
+// One line each for the image and thumbnail: name,image,bytes,complete,packets,dropped,tiles,good
+// and same,image,as for the last one that wasn't sent
+static esp_err_t images_get_handler(httpd_req_t *req)
 {
+    char buf[IMAGE_RX_STATUS_MAX];
+    int n = image_rx_status(buf, sizeof(buf));
     httpd_resp_set_type(req, "text/plain");
-    httpd_resp_send(req, latest_message, HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, buf, n);
 }
 
-static const httpd_uri_t latest = {
-    .uri       = "/latest",
+static const httpd_uri_t images_uri = {
+    .uri       = "/images",
     .method    = HTTP_GET,
-    .handler   = latest_get_handler,
+    .handler   = images_get_handler,
     .user_ctx  = NULL
 };
 
@@ -125,6 +404,7 @@ static esp_err_t instruction_post_handler(httpd_req_t *req)
 {
     char buf[100];
     int ret, remaining = req->content_len;
+    uint16_t id = 0;
 
     while (remaining > 0) {
         if ((ret = httpd_req_recv(req, buf, MIN(remaining, sizeof(buf) - 1))) <= 0) {
@@ -135,25 +415,16 @@ static esp_err_t instruction_post_handler(httpd_req_t *req)
         buf[ret] = '\0'; // Null-terminate received data
         ESP_LOGI(TAG, "Received instruction: %s", buf);
 
-        // Prepare a safe copy
-        char temp[200];
-        strncpy(temp, buf, sizeof(temp));
-        temp[sizeof(temp) - 1] = '\0'; // Ensure null-termination
-
         // Queue the message for later transmission
-        if (xQueueSend(*outgoing, (void *)temp, pdMS_TO_TICKS(10)) != pdTRUE) {
-            ESP_LOGE(TAG, "Outgoing queue full! Dropping message.");
-        } else {
-            ESP_LOGI(TAG, "Message added to outgoing queue.");
-
-            // Wake up tx_task to immediately process the queue
-            xTaskNotifyGive(tx_task_handle); // tx_task_handle is the task handle for tx_task
-        }
+        id = queue_instruction(buf);
 
         remaining -= ret;
     }
 
-    httpd_resp_send(req, "ACK", HTTPD_RESP_USE_STRLEN);
+    // The id is what shows up on /commands once the can acks it
+    char reply[16];
+    snprintf(reply, sizeof(reply), id ? "QUEUED:%u" : "NAK", id);
+    httpd_resp_send(req, reply, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
@@ -167,24 +438,93 @@ static const httpd_uri_t instruction = {
     .user_ctx  = NULL
 };
 
+// ------------------------- WEBSOCKET ENDPOINT -------------------------
+// Telemetry goes out as batched binary records (see telemetry.h), anything the client sends
+// back is treated as an uplink instruction, same as a POST to /instruction.
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET) {
+        ESP_LOGI(TAG, "Websocket client connected on fd %d", httpd_req_to_sockfd(req));
+        return ESP_OK;
+    }
+
+    char buf[100];
+    httpd_ws_frame_t pkt;
+    memset(&pkt, 0, sizeof(pkt));
+
+    // First call with len 0 just fills in the frame length
+    esp_err_t ret = httpd_ws_recv_frame(req, &pkt, 0);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read ws frame length: %d", ret);
+        return ret;
+    }
+    if (pkt.type != HTTPD_WS_TYPE_TEXT && pkt.type != HTTPD_WS_TYPE_BINARY) {
+        return ESP_OK;
+    }
+    if (pkt.len >= sizeof(buf)) {
+        ESP_LOGE(TAG, "Instruction too long (%d bytes)", (int)pkt.len);
+        return ESP_FAIL;
+    }
+
+    pkt.payload = (uint8_t *)buf;
+    ret = httpd_ws_recv_frame(req, &pkt, pkt.len);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read ws frame: %d", ret);
+        return ret;
+    }
+    buf[pkt.len] = '\0';
+    ESP_LOGI(TAG, "Received ws instruction: %s", buf);
+
+    char reply[16];
+    uint16_t id = queue_instruction(buf);
+    snprintf(reply, sizeof(reply), id ? "QUEUED:%u" : "NAK", id);
+    httpd_ws_frame_t resp = {
+        .final   = true,
+        .type    = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t *)reply,
+        .len     = strlen(reply)
+    };
+    return httpd_ws_send_frame(req, &resp);
+}
+
+static const httpd_uri_t ws = {
+    .uri          = "/ws",
+    .method       = HTTP_GET,
+    .handler      = ws_handler,
+    .user_ctx     = NULL,
+    .is_websocket = true
+};
+
 // ------------------------- WEB SERVER START/STOP -------------------------
-httpd_handle_t start_webserver(QueueHandle_t *out, QueueHandle_t *in, QueueHandle_t *image)
+httpd_handle_t start_webserver(QueueHandle_t *in)
 {
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.lru_purge_enable = true;
-    outgoing = out;
+    config.max_uri_handlers = 16;
     incoming = in;
-    image_out = image;
+
+    if (publish_task_handle == NULL) {
+        ws_pending = xSemaphoreCreateCounting(WS_PENDING_MAX, WS_PENDING_MAX);
+        xTaskCreate(publish_task, "publish task", 4096, NULL, 10, &publish_task_handle);
+    }
 
     ESP_LOGI(TAG, "Starting server on port: %d", config.server_port);
     if (httpd_start(&server, &config) == ESP_OK) {
         ESP_LOGI(TAG, "Registering URI handlers");
         httpd_register_uri_handler(server, &status);
-        httpd_register_uri_handler(server, &sse);
-        httpd_register_uri_handler(server, &sse2);
         httpd_register_uri_handler(server, &latest);
         httpd_register_uri_handler(server, &instruction);
+        httpd_register_uri_handler(server, &ws);
+        httpd_register_uri_handler(server, &history);
+        httpd_register_uri_handler(server, &journal);
+        httpd_register_uri_handler(server, &journal_erase_uri);
+        httpd_register_uri_handler(server, &replay);
+        httpd_register_uri_handler(server, &commands);
+        httpd_register_uri_handler(server, &airtime);
+        httpd_register_uri_handler(server, &image_uri);
+        httpd_register_uri_handler(server, &images_uri);
+        server_handle = server;
         return server;
     }
 
@@ -194,7 +534,14 @@ httpd_handle_t start_webserver(QueueHandle_t *out, QueueHandle_t *in, QueueHandl
 
 esp_err_t stop_webserver(httpd_handle_t server)
 {
-    return httpd_stop(server);
+    if (server == server_handle) {
+        server_handle = NULL;
+    }
+    esp_err_t err = httpd_stop(server);
+    // work still queued is dropped with the server, give back the slots those batches held
+    while (ws_pending != NULL && xSemaphoreGive(ws_pending) == pdTRUE) {
+    }
+    return err;
 }
 
 // ------------------------- NETWORK EVENT HANDLERS -------------------------
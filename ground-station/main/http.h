@@ -5,7 +5,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
-httpd_handle_t start_webserver(QueueHandle_t *out, QueueHandle_t *in, QueueHandle_t *image);
+httpd_handle_t start_webserver(QueueHandle_t *in);
 esp_err_t stop_webserver(httpd_handle_t server);
 
 #endif
\ No newline at end of file
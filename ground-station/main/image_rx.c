@@ -0,0 +1,274 @@
+#include "image_rx.h"
+#include "jpeg_repair.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "image_rx";
+
+typedef struct {
+    bool valid;
+    uint16_t image;         // without IMAGE_RX_THUMB
+    uint8_t *buf;
+    size_t capacity;
+    jpeg_span_t spans[IMAGE_RX_SPANS];  // what we have, in order with gaps between
+    int nspans;
+    uint32_t received;
+    uint32_t packets;
+    uint32_t dropped;       // packets that didn't fit in buf or spans
+} rx_image_t;
+
+static rx_image_t slots[2];     // [0] the image, [1] its thumbnail
+static uint8_t thumb_buf[IMAGE_RX_THUMB_BYTES];
+static SemaphoreHandle_t image_mutex;
+
+// The last image the can didn't send because it looked like another
+static bool same_valid;
+static uint16_t same_image, same_as;
+
+// The repaired copy of slots[0] that's being served, rebuilt whenever a read starts from 0
+static uint8_t *repaired;
+static size_t repaired_cap, repaired_len;
+static uint16_t repaired_image;
+static jpeg_repair_stats_t repair_stats;
+
+static uint8_t *alloc_psram(size_t *bytes, size_t psram, size_t internal)
+{
+    *bytes = psram;
+    uint8_t *buf = heap_caps_malloc(psram, MALLOC_CAP_SPIRAM);
+    if (buf == NULL) {
+        *bytes = internal;
+        buf = heap_caps_malloc(internal, MALLOC_CAP_DEFAULT);
+    }
+    if (buf == NULL) *bytes = 0;
+    return buf;
+}
+
+esp_err_t image_rx_init(void)
+{
+    slots[0].buf = alloc_psram(&slots[0].capacity, IMAGE_RX_PSRAM_BYTES, IMAGE_RX_INTERNAL_BYTES);
+    repaired = alloc_psram(&repaired_cap, IMAGE_RX_PSRAM_BYTES + IMAGE_RX_REPAIR_SLACK,
+                           IMAGE_RX_INTERNAL_BYTES + IMAGE_RX_REPAIR_SLACK);
+    if (slots[0].capacity == IMAGE_RX_INTERNAL_BYTES) {
+        ESP_LOGW(TAG, "No PSRAM, images are cut off at %d KB", IMAGE_RX_INTERNAL_BYTES / 1024);
+    }
+    slots[1].buf = thumb_buf;
+    slots[1].capacity = sizeof(thumb_buf);
+
+    image_mutex = xSemaphoreCreateMutex();
+    if (slots[0].buf == NULL || repaired == NULL) {
+        slots[0].capacity = 0;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+// Image numbers count up from the duo and wrap at 15 bits
+static bool newer(uint16_t image, uint16_t than)
+{
+    uint16_t ahead = (image - than) & ~IMAGE_RX_THUMB;
+    return ahead != 0 && ahead < 0x4000;
+}
+
+// Adds [start, end) to the spans, merging it with any it touches. False if there's no room.
+static bool add_span(rx_image_t *slot, uint32_t start, uint32_t end)
+{
+    int i = 0;
+    while (i < slot->nspans && slot->spans[i].end < start) i++;
+
+    // swallow every span this one overlaps or touches
+    int j = i;
+    while (j < slot->nspans && slot->spans[j].start <= end) {
+        if (slot->spans[j].start < start) start = slot->spans[j].start;
+        if (slot->spans[j].end > end) end = slot->spans[j].end;
+        j++;
+    }
+    if (j == i && slot->nspans == IMAGE_RX_SPANS) return false;
+
+    memmove(&slot->spans[i + 1], &slot->spans[j], (slot->nspans - j) * sizeof(jpeg_span_t));
+    slot->nspans += 1 - (j - i);
+    slot->spans[i].start = start;
+    slot->spans[i].end = end;
+    return true;
+}
+
+void image_rx_packet(const uint8_t *pkt, size_t len)
+{
+    if (image_mutex == NULL || len <= IMAGE_RX_HEADER || pkt[0] != 'I') return;
+
+    uint16_t id = pkt[1] | (pkt[2] << 8);
+    uint32_t offset = pkt[3] | (pkt[4] << 8) | ((uint32_t)pkt[5] << 16) | ((uint32_t)pkt[6] << 24);
+    const uint8_t *data = pkt + IMAGE_RX_HEADER;
+    size_t n = len - IMAGE_RX_HEADER;
+    rx_image_t *slot = &slots[(id & IMAGE_RX_THUMB) ? 1 : 0];
+    uint16_t image = id & ~IMAGE_RX_THUMB;
+
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    if (!slot->valid || newer(image, slot->image)) {
+        if (slot == &slots[0]) {
+            ESP_LOGI(TAG, "Image %u coming in", image);
+        }
+        slot->valid = true;
+        slot->image = image;
+        slot->nspans = 0;
+        slot->received = 0;
+        slot->packets = 0;
+        slot->dropped = 0;
+    }
+
+    if (slot->image != image) {
+        // a straggler from one we've already moved on from
+    } else if (offset > slot->capacity || n > slot->capacity - offset || !add_span(slot, offset, offset + n)) {
+        slot->dropped++;
+    } else {
+        memcpy(slot->buf + offset, data, n);
+        slot->packets++;
+        slot->received = 0;
+        for (int i = 0; i < slot->nspans; i++) slot->received += slot->spans[i].end - slot->spans[i].start;
+    }
+    xSemaphoreGive(image_mutex);
+}
+
+// Picks SAME:<image>,<same as>: out of a telemetry frame, if it's there
+void image_rx_same(const char *msg)
+{
+    const char *p = strstr(msg, ":SAME:");
+    unsigned image, as;
+    if (image_mutex == NULL || p == NULL || sscanf(p + 6, "%u,%u", &image, &as) != 2) return;
+
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    // the can repeats it on a few frames, only the first is news
+    if (!same_valid || same_image != image) {
+        ESP_LOGI(TAG, "Image %u looks like %u, not sent", image, as);
+    }
+    same_valid = true;
+    same_image = image;
+    same_as = as;
+    xSemaphoreGive(image_mutex);
+}
+
+// Bytes from the start with nothing missing
+static uint32_t prefix(const rx_image_t *slot)
+{
+    return (slot->nspans && slot->spans[0].start == 0) ? slot->spans[0].end : 0;
+}
+
+// Copies up to max bytes of the latest image (or thumbnail) from offset into out. Reading from
+// offset 0 sets *image to the image being read, and for the image takes a fresh repaired copy
+// that later offsets read from, so a reader never stitches two versions together.
+size_t image_rx_read(bool thumb, uint16_t *image, uint32_t offset, uint8_t *out, size_t max)
+{
+    const uint8_t *from = NULL;
+    size_t n = 0;
+
+    if (image_mutex == NULL) return 0;
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    if (thumb) {
+        rx_image_t *slot = &slots[1];
+        if (slot->valid && (offset == 0 || slot->image == *image)) {
+            *image = slot->image;
+            from = slot->buf;
+            n = prefix(slot);
+        }
+    } else {
+        rx_image_t *slot = &slots[0];
+        if (offset == 0 && slot->valid) {
+            // only whoever's serving /image uses this, and the web server does one request at a time
+            repaired_len = jpeg_repair(slot->buf, slot->spans, slot->nspans, repaired, repaired_cap, &repair_stats);
+            if (repaired_len == 0) {
+                // not a tiled jpeg, or the headers haven't arrived
+                repaired_len = prefix(slot);
+                memcpy(repaired, slot->buf, repaired_len);
+                memset(&repair_stats, 0, sizeof(repair_stats));
+            }
+            repaired_image = slot->image;
+            *image = slot->image;
+        }
+        if (repaired_image == *image) {
+            from = repaired;
+            n = repaired_len;
+        }
+    }
+
+    if (from && offset < n) {
+        n -= offset;
+        if (n > max) n = max;
+        memcpy(out, from + offset, n);
+    } else {
+        n = 0;
+    }
+    xSemaphoreGive(image_mutex);
+    return n;
+}
+
+// The fields of the GEO: comment right after the SOI, if that much has come down
+static bool find_geo(const rx_image_t *slot, char *out, size_t max)
+{
+    const uint8_t *b = slot->buf;
+    uint32_t end = prefix(slot);
+    if (end < 10 || b[0] != 0xFF || b[1] != 0xD8 || b[2] != 0xFF || b[3] != 0xFE) return false;
+    uint32_t len = (b[4] << 8) | b[5];
+    if (len < 6 || 4 + len > end || memcmp(b + 6, "GEO:", 4) != 0) return false;
+    size_t n = len - 6;
+    if (n >= max) n = max - 1;
+    memcpy(out, b + 10, n);
+    out[n] = '\0';
+    return true;
+}
+
+// One line per slot: name,image,bytes,complete,packets,dropped,tiles,good. Complete means it all
+// came down in one piece up to the jpeg's end of image marker, tiles and good are from the last
+// time the image was repaired. Then same,<image>,<same as> for the last image that wasn't sent,
+// and geo,<image>,<GEO: fields> for each image we know the whereabouts of.
+// Appends one line at buf + *n if all of it fits in len, otherwise leaves buf ending on the
+// last whole line and returns false
+static bool append_line(char *buf, size_t len, int *n, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int w = vsnprintf(buf + *n, len - *n, fmt, ap);
+    va_end(ap);
+    if (w < 0 || w >= (int)len - *n) {
+        buf[*n] = '\0';
+        return false;
+    }
+    *n += w;
+    return true;
+}
+
+int image_rx_status(char *buf, size_t len)
+{
+    static const char *names[2] = { "image", "thumb" };
+    int n = 0;
+    bool room = len > 0;
+
+    if (image_mutex == NULL) return 0;
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    for (int i = 0; i < 2 && room; i++) {
+        rx_image_t *slot = &slots[i];
+        if (!slot->valid) continue;
+        uint32_t end = prefix(slot);
+        bool complete = slot->nspans == 1 && end >= 2 && slot->buf[end - 2] == 0xFF && slot->buf[end - 1] == 0xD9;
+        bool repaired_this = i == 0 && repaired_image == slot->image;
+        room = append_line(buf, len, &n, "%s,%u,%lu,%d,%lu,%lu,%d,%d\n", names[i], slot->image,
+                           (unsigned long)slot->received, complete, (unsigned long)slot->packets,
+                           (unsigned long)slot->dropped, repaired_this ? repair_stats.tiles : 0,
+                           repaired_this ? repair_stats.good : 0);
+    }
+    if (same_valid && room) {
+        room = append_line(buf, len, &n, "same,%u,%u\n", same_image, same_as);
+    }
+    for (int i = 0; i < 2 && room; i++) {
+        char geo[80];
+        if (!slots[i].valid || !find_geo(&slots[i], geo, sizeof(geo))) continue;
+        // the thumbnail's is the same as the image's when they're the same image
+        if (i == 1 && slots[0].valid && slots[0].image == slots[1].image && find_geo(&slots[0], geo, sizeof(geo))) continue;
+        room = append_line(buf, len, &n, "geo,%u,%s\n", slots[i].image, geo);
+    }
+    xSemaphoreGive(image_mutex);
+    return n;
+}
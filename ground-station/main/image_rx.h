@@ -0,0 +1,40 @@
+#ifndef IMAGE_RX_H_
+#define IMAGE_RX_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Puts the can's image packets back together so the dashboard can show an image while it's
+// still coming down. Packets are 'I' | image u16 | offset u32 | data.
+//
+// The can sends a small thumbnail of every image first, with IMAGE_RX_THUMB set in its image
+// number, then the image itself cut into tiles. Packets are kept wherever they land, holes and
+// all. The thumbnail is served as far as it's got with nothing missing, the image goes through
+// jpeg_repair so every tile that's arrived whole shows up and the rest are grey.
+//
+// An image that looks like one that's already come down isn't sent, the can says
+// SAME:<image>,<same as>: on its telemetry instead and rx_task hands that to image_rx_same.
+//
+// Both the thumbnail and the image start with a jpeg comment saying where and when it was taken,
+// GEO:lat,lon,alt cm,fix,sats,unix s,flight ms (lat and lon in 1e-7 degrees), so that's known
+// as soon as the first packet of either is in.
+//
+// The latest image and the latest thumbnail are kept, the buffers for the image are in PSRAM
+// when there is some.
+#define IMAGE_RX_THUMB          0x8000  // same bit the can uses
+#define IMAGE_RX_HEADER         7
+#define IMAGE_RX_PSRAM_BYTES    (64 * 1024)
+#define IMAGE_RX_INTERNAL_BYTES (16 * 1024)
+#define IMAGE_RX_THUMB_BYTES    (4 * 1024)
+#define IMAGE_RX_REPAIR_SLACK   (8 * 1024)  // grey tiles and markers on top of what came down
+#define IMAGE_RX_SPANS          48          // runs of bytes with holes between them
+#define IMAGE_RX_STATUS_MAX     384         // image_rx_status with every line as long as it gets
+
+esp_err_t image_rx_init(void);
+void image_rx_packet(const uint8_t *pkt, size_t len);
+void image_rx_same(const char *msg);
+size_t image_rx_read(bool thumb, uint16_t *image, uint32_t offset, uint8_t *out, size_t max);
+int image_rx_status(char *buf, size_t len);
+
+#endif
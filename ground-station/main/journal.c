@@ -0,0 +1,369 @@
+#include "journal.h"
+#include <string.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "journal";
+
+#define RECORD_SIZE(len)    ((sizeof(journal_header_t) + (len) + 3) & ~3u)
+
+typedef struct {
+    uint32_t seq;
+    uint32_t offset;
+} journal_index_t;
+
+typedef struct {
+    uint16_t boot;
+    uint32_t first_seq;
+} journal_boot_t;
+
+static const esp_partition_t *partition;
+static QueueHandle_t journal_queue;
+static TaskHandle_t journal_task_handle;
+static TaskHandle_t replay_task_handle;
+static SemaphoreHandle_t journal_mutex;
+
+// Everything below is protected by journal_mutex
+static uint32_t flushed_end;    // readers never look past this
+static uint32_t next_seq = 1;
+static uint16_t boot_id = 1;
+static uint32_t records;
+static uint32_t dropped;
+static bool full;
+static journal_index_t index_table[JOURNAL_INDEX_MAX];
+static size_t index_len;
+static journal_boot_t boots[JOURNAL_MAX_BOOTS];
+static size_t boots_len;
+
+// Replay settings, only touched by the http handler before the replay task starts
+static QueueHandle_t replay_dest;
+static uint16_t replay_boot;
+static uint32_t replay_from_seq;
+static uint32_t replay_speed;
+static volatile bool replay_stop;
+
+static uint32_t record_crc(const journal_header_t *hdr, const uint8_t *data)
+{
+    journal_header_t tmp = *hdr;
+    tmp.crc = 0;
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&tmp, sizeof(tmp));
+    return esp_rom_crc32_le(crc, data, hdr->len);
+}
+
+static bool is_erased(const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+// Finds the first intact record at or after *offset and before end. On success *offset points
+// just past it. Anything that fails its crc (a write torn by a reset) is stepped over 4 bytes
+// at a time until we line up with a good record again. Hitting erased flash means the log
+// ends here.
+static bool read_next(uint32_t *offset, uint32_t end, journal_header_t *hdr, uint8_t *data)
+{
+    uint32_t off = *offset;
+
+    while (off + sizeof(journal_header_t) <= end) {
+        if (esp_partition_read(partition, off, hdr, sizeof(*hdr)) != ESP_OK) return false;
+
+        if (is_erased((const uint8_t *)hdr, sizeof(*hdr))) return false;
+
+        if (hdr->magic == JOURNAL_MAGIC && off + RECORD_SIZE(hdr->len) <= end &&
+            esp_partition_read(partition, off + sizeof(*hdr), data, hdr->len) == ESP_OK &&
+            record_crc(hdr, data) == hdr->crc) {
+            *offset = off + RECORD_SIZE(hdr->len);
+            return true;
+        }
+        off += 4;
+    }
+    return false;
+}
+
+static void note_record(const journal_header_t *hdr, uint32_t offset)
+{
+    if (hdr->seq % JOURNAL_INDEX_STRIDE == 0 && index_len < JOURNAL_INDEX_MAX) {
+        index_table[index_len].seq = hdr->seq;
+        index_table[index_len].offset = offset;
+        index_len++;
+    }
+    if (boots_len == 0 || boots[boots_len - 1].boot != hdr->boot) {
+        if (boots_len == JOURNAL_MAX_BOOTS) {
+            memmove(boots, boots + 1, sizeof(boots) - sizeof(boots[0]));
+            boots_len--;
+        }
+        boots[boots_len].boot = hdr->boot;
+        boots[boots_len].first_seq = hdr->seq;
+        boots_len++;
+    }
+    records++;
+}
+
+// Walks the whole log once at boot to rebuild the index and find where to append
+static void scan(void)
+{
+    static uint8_t data[RX_PACKET_MAX];
+    journal_header_t hdr;
+    uint32_t off = 0, start = 0;
+
+    while (read_next(&off, partition->size, &hdr, data)) {
+        note_record(&hdr, off - RECORD_SIZE(hdr.len));
+        next_seq = hdr.seq + 1;
+        boot_id = hdr.boot + 1;
+        start = off;
+    }
+
+    // A torn record at the tail leaves programmed bytes behind, step past them
+    while (start < partition->size) {
+        uint8_t word[4];
+        esp_partition_read(partition, start, word, sizeof(word));
+        if (is_erased(word, sizeof(word))) break;
+        start += 4;
+    }
+    flushed_end = start;
+    full = flushed_end + RECORD_SIZE(RX_PACKET_MAX) > partition->size;
+}
+
+static void flush(uint8_t *batch, size_t *batch_len)
+{
+    if (*batch_len == 0) return;
+
+    if (esp_partition_write(partition, flushed_end, batch, *batch_len) != ESP_OK) {
+        ESP_LOGE(TAG, "Flash write failed at 0x%lx", (unsigned long)flushed_end);
+    }
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    flushed_end += *batch_len;
+    xSemaphoreGive(journal_mutex);
+    *batch_len = 0;
+}
+
+static void erase_all(void)
+{
+    ESP_LOGW(TAG, "Erasing journal");
+    esp_partition_erase_range(partition, 0, partition->size);
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    flushed_end = 0;
+    records = 0;
+    index_len = 0;
+    boots_len = 0;
+    full = false;
+    xSemaphoreGive(journal_mutex);
+}
+
+static void journal_task(void *pvParameters)
+{
+    static uint8_t batch[JOURNAL_BATCH_BYTES];
+    static rx_packet_t pkt;
+    size_t batch_len = 0;
+    TickType_t first_buffered = 0;
+
+    while (1) {
+        // Never block forever so an erase request gets picked up while idle
+        TickType_t wait = pdMS_TO_TICKS(JOURNAL_FLUSH_MS);
+        if (batch_len > 0) {
+            TickType_t age = xTaskGetTickCount() - first_buffered;
+            wait = (age >= pdMS_TO_TICKS(JOURNAL_FLUSH_MS)) ? 0 : pdMS_TO_TICKS(JOURNAL_FLUSH_MS) - age;
+        }
+
+        if (xQueueReceive(journal_queue, &pkt, wait) != pdTRUE) {
+            flush(batch, &batch_len);
+        } else {
+            journal_header_t hdr = {
+                .magic = JOURNAL_MAGIC,
+                .arrival_ms = pkt.arrival_ms,
+                .boot = boot_id,
+                .len = pkt.len,
+                .flags = pkt.flags,
+                .rssi = pkt.rssi,
+                .snr = pkt.snr,
+            };
+            size_t size = RECORD_SIZE(hdr.len);
+
+            if (batch_len + size > sizeof(batch)) {
+                flush(batch, &batch_len);
+            }
+
+            xSemaphoreTake(journal_mutex, portMAX_DELAY);
+            if (flushed_end + batch_len + size > partition->size) {
+                if (!full) ESP_LOGE(TAG, "Journal partition full, no longer recording");
+                full = true;
+            }
+            if (!full) {
+                hdr.seq = next_seq++;
+                hdr.crc = record_crc(&hdr, (const uint8_t *)pkt.data);
+                note_record(&hdr, flushed_end + batch_len);
+            }
+            xSemaphoreGive(journal_mutex);
+
+            if (!full) {
+                if (batch_len == 0) first_buffered = xTaskGetTickCount();
+                memset(batch + batch_len, 0xFF, size);
+                memcpy(batch + batch_len, &hdr, sizeof(hdr));
+                memcpy(batch + batch_len + sizeof(hdr), pkt.data, hdr.len);
+                batch_len += size;
+            }
+        }
+
+        if (ulTaskNotifyTake(pdTRUE, 0)) {
+            batch_len = 0;
+            erase_all();
+        }
+    }
+}
+
+esp_err_t journal_init(void)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, JOURNAL_PARTITION_LABEL);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "No \"%s\" partition, packets will not be recorded", JOURNAL_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    journal_mutex = xSemaphoreCreateMutex();
+    scan();
+    ESP_LOGI(TAG, "%lu records, %lu of %lu bytes used, this is boot %u",
+             (unsigned long)records, (unsigned long)flushed_end, (unsigned long)partition->size, boot_id);
+
+    journal_queue = xQueueCreate(32, sizeof(rx_packet_t));
+    xTaskCreate(journal_task, "journal task", 4096, NULL, 5, &journal_task_handle);
+    return ESP_OK;
+}
+
+void journal_append(const rx_packet_t *pkt)
+{
+    if (journal_queue == NULL) return;
+
+    if (xQueueSend(journal_queue, pkt, 0) != pdTRUE) {
+        dropped++;
+    }
+}
+
+void journal_erase(void)
+{
+    if (journal_task_handle != NULL) {
+        xTaskNotifyGive(journal_task_handle);
+    }
+}
+
+int journal_status(char *buf, size_t len)
+{
+    if (partition == NULL) {
+        return snprintf(buf, len, "no journal partition\n");
+    }
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    int n = snprintf(buf, len, "boot:%u\nrecords:%lu\nused:%lu\nsize:%lu\ndropped:%lu\nfull:%d\nreplaying:%d\n",
+                     boot_id, (unsigned long)records, (unsigned long)flushed_end,
+                     (unsigned long)partition->size, (unsigned long)dropped, full,
+                     replay_task_handle != NULL);
+    for (size_t i = 0; i < boots_len && n < (int)len; i++) {
+        n += snprintf(buf + n, len - n, "boot %u starts at seq %lu\n",
+                      boots[i].boot, (unsigned long)boots[i].first_seq);
+    }
+    xSemaphoreGive(journal_mutex);
+    return n;
+}
+
+// ------------------------- REPLAY -------------------------
+// Where to start reading for seq, from the sparse index
+static uint32_t seek(uint32_t seq)
+{
+    uint32_t off = 0;
+    for (size_t i = 0; i < index_len && index_table[i].seq <= seq && index_table[i].offset < flushed_end; i++) {
+        off = index_table[i].offset;
+    }
+    return off;
+}
+
+static void replay_task(void *pvParameters)
+{
+    static uint8_t data[RX_PACKET_MAX];
+    static rx_packet_t pkt;
+    journal_header_t hdr;
+    uint32_t sent = 0, last_ms = 0;
+    bool first = true;
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    uint32_t off = seek(replay_from_seq);
+    xSemaphoreGive(journal_mutex);
+
+    ESP_LOGI(TAG, "Replaying from seq %lu at %lux", (unsigned long)replay_from_seq, (unsigned long)replay_speed);
+
+    while (!replay_stop) {
+        xSemaphoreTake(journal_mutex, portMAX_DELAY);
+        uint32_t end = flushed_end;
+        xSemaphoreGive(journal_mutex);
+
+        if (!read_next(&off, end, &hdr, data)) break;
+        if (hdr.seq < replay_from_seq) continue;
+        if (replay_boot != 0 && hdr.boot != replay_boot) break;
+        // Image packets are binary and the live image is still coming in, so they stay in the journal
+        if (hdr.len > 0 && data[0] == 'I') continue;
+
+        // Keep the recorded spacing between packets, scaled by the speed. A jump backwards in
+        // arrival time is a new boot, so there's nothing to wait for.
+        if (!first && replay_speed > 0 && hdr.arrival_ms > last_ms) {
+            vTaskDelay(pdMS_TO_TICKS((hdr.arrival_ms - last_ms) / replay_speed));
+        }
+        first = false;
+        last_ms = hdr.arrival_ms;
+
+        memcpy(pkt.data, data, hdr.len);
+        pkt.data[hdr.len] = '\0';
+        pkt.len = hdr.len;
+        pkt.seq = hdr.seq;
+        pkt.arrival_ms = hdr.arrival_ms;
+        pkt.rssi = hdr.rssi;
+        pkt.snr = hdr.snr;
+        pkt.flags = hdr.flags | RX_PACKET_REPLAY;
+
+        while (!replay_stop && xQueueSend(replay_dest, &pkt, pdMS_TO_TICKS(100)) != pdTRUE) {
+        }
+        sent++;
+    }
+
+    ESP_LOGI(TAG, "Replay finished, %lu packets", (unsigned long)sent);
+    replay_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+esp_err_t journal_replay_start(QueueHandle_t dest, uint16_t boot, uint32_t from_seq, uint32_t speed)
+{
+    if (partition == NULL) return ESP_ERR_NOT_FOUND;
+    if (replay_task_handle != NULL) return ESP_ERR_INVALID_STATE;
+
+    if (boot != 0) {
+        bool found = false;
+        xSemaphoreTake(journal_mutex, portMAX_DELAY);
+        for (size_t i = 0; i < boots_len; i++) {
+            if (boots[i].boot == boot) {
+                from_seq = boots[i].first_seq;
+                found = true;
+            }
+        }
+        xSemaphoreGive(journal_mutex);
+        if (!found) return ESP_ERR_NOT_FOUND;
+    }
+
+    replay_dest = dest;
+    replay_boot = boot;
+    replay_from_seq = from_seq;
+    replay_speed = speed;
+    replay_stop = false;
+    if (xTaskCreate(replay_task, "replay task", 4096, NULL, 5, &replay_task_handle) != pdPASS) {
+        replay_task_handle = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void journal_replay_stop(void)
+{
+    replay_stop = true;
+}
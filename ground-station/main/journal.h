@@ -0,0 +1,46 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "telemetry.h"
+
+// Append-only log of every received packet on the "journal" flash partition (see
+// partitions.csv). rx_task hands packets over through a queue and a background task writes
+// them in batches, so the radio side never waits on flash.
+#define JOURNAL_PARTITION_LABEL     "journal"
+#define JOURNAL_MAGIC               0x4C4E524A  // "JRNL"
+#define JOURNAL_BATCH_BYTES         4096        // flushed when this fills up...
+#define JOURNAL_FLUSH_MS            1000        // ...or when the oldest buffered packet is this old
+#define JOURNAL_INDEX_STRIDE        64          // one index entry every this many records
+#define JOURNAL_INDEX_MAX           1024
+#define JOURNAL_MAX_BOOTS           32
+
+// On flash every record is this header, then len bytes of packet, padded to 4 bytes. The crc
+// covers the header (with crc zeroed) and the data, so a record torn by a power cut is
+// skipped instead of replayed.
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;           // journal sequence, keeps counting across boots
+    uint32_t arrival_ms;    // ground station uptime in the boot that received it
+    uint16_t boot;          // which boot (flight) the packet belongs to
+    uint8_t len;
+    uint8_t flags;
+    int8_t rssi;
+    int8_t snr;
+    uint16_t reserved;
+    uint32_t crc;
+} journal_header_t;
+
+esp_err_t journal_init(void);
+void journal_append(const rx_packet_t *pkt);
+void journal_erase(void);
+int journal_status(char *buf, size_t len);
+
+// Streams recorded packets back into dest (normally the incoming queue) flagged as
+// RX_PACKET_REPLAY. speed is a multiplier on the recorded timing, 0 sends as fast as dest
+// takes them. A boot of 0 means start at from_seq instead.
+esp_err_t journal_replay_start(QueueHandle_t dest, uint16_t boot, uint32_t from_seq, uint32_t speed);
+void journal_replay_stop(void);
+
+#endif
@@ -0,0 +1,328 @@
+#include "jpeg_repair.h"
+#include <string.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint8_t counts[16];     // codes of each length, 1 to 16 bits
+    uint8_t symbols[256];
+} huff_table_t;
+
+typedef struct {
+    uint32_t width, height;
+    int ncomp;
+    uint8_t id[4], h[4], v[4];
+    int scan_comps;
+    uint8_t scan_comp[4];   // index into id/h/v
+    uint8_t dc_table[4], ac_table[4];
+    huff_table_t dc[4], ac[4];
+    uint32_t restart;       // MCUs per tile
+    uint32_t scan_start;    // first byte of entropy coded data
+} jpeg_info_t;
+
+typedef struct {
+    uint8_t *out;
+    size_t max, n;
+    uint32_t acc;
+    int bits;
+    bool overflow;
+} bit_writer_t;
+
+// One slot per tile, only used by whoever is serving an image right now
+static uint32_t tile_start[JPEG_REPAIR_TILES_MAX];
+static uint32_t tile_end[JPEG_REPAIR_TILES_MAX];    // 0 for a tile we didn't get
+
+static uint32_t be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+// Reads the headers from SOI to the end of SOS. Returns false for anything we can't repair.
+static bool parse_headers(const uint8_t *buf, uint32_t avail, jpeg_info_t *info)
+{
+    bool have_frame = false;
+    uint32_t p = 2;
+
+    memset(info, 0, sizeof(*info));
+    if (avail < 4 || buf[0] != 0xFF || buf[1] != 0xD8) return false;
+
+    while (1) {
+        while (p + 1 < avail && buf[p] == 0xFF && buf[p + 1] == 0xFF) p++;    // fill bytes
+        if (p + 4 > avail || buf[p] != 0xFF) return false;
+        uint8_t marker = buf[p + 1];
+        uint32_t len = be16(buf + p + 2);
+        if (len < 2 || p + 2 + len > avail) return false;
+        const uint8_t *seg = buf + p + 4;
+        uint32_t seglen = len - 2;
+
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (seglen < 6) return false;
+            info->height = be16(seg + 1);
+            info->width = be16(seg + 3);
+            info->ncomp = seg[5];
+            if (info->ncomp < 1 || info->ncomp > 4 || seglen < 6 + 3u * info->ncomp) return false;
+            for (int i = 0; i < info->ncomp; i++) {
+                info->id[i] = seg[6 + 3 * i];
+                info->h[i] = seg[7 + 3 * i] >> 4;
+                info->v[i] = seg[7 + 3 * i] & 0x0F;
+                if (info->h[i] < 1 || info->v[i] < 1) return false;
+            }
+            have_frame = true;
+        } else if ((marker >= 0xC2 && marker <= 0xCF) && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            return false;   // progressive, lossless or arithmetic coded
+        } else if (marker == 0xC4) {
+            uint32_t q = 0;
+            while (q + 17 <= seglen) {
+                int cls = seg[q] >> 4, slot = seg[q] & 0x0F;
+                if (slot > 3) return false;
+                huff_table_t *t = cls ? &info->ac[slot] : &info->dc[slot];
+                uint32_t total = 0;
+                for (int i = 0; i < 16; i++) total += seg[q + 1 + i];
+                if (total > 256 || q + 17 + total > seglen) return false;
+                memcpy(t->counts, seg + q + 1, 16);
+                memcpy(t->symbols, seg + q + 17, total);
+                q += 17 + total;
+            }
+        } else if (marker == 0xDD) {
+            if (seglen < 2) return false;
+            info->restart = be16(seg);
+        } else if (marker == 0xDA) {
+            if (!have_frame || seglen < 1) return false;
+            info->scan_comps = seg[0];
+            if (info->scan_comps < 1 || info->scan_comps > info->ncomp || seglen < 1 + 2u * info->scan_comps) {
+                return false;
+            }
+            for (int i = 0; i < info->scan_comps; i++) {
+                int c = 0;
+                while (c < info->ncomp && info->id[c] != seg[1 + 2 * i]) c++;
+                if (c == info->ncomp) return false;
+                info->scan_comp[i] = c;
+                info->dc_table[i] = seg[2 + 2 * i] >> 4;
+                info->ac_table[i] = seg[2 + 2 * i] & 0x0F;
+                if (info->dc_table[i] > 3 || info->ac_table[i] > 3) return false;
+            }
+            info->scan_start = p + 2 + len;
+            return true;
+        }
+        p += 2 + len;
+    }
+}
+
+// Canonical huffman code for symbol, returns its length or 0 if the table doesn't have it
+static int huff_code(const huff_table_t *t, uint8_t symbol, uint32_t *code)
+{
+    uint32_t c = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < t->counts[len - 1]; i++, k++, c++) {
+            if (t->symbols[k] == symbol) {
+                *code = c;
+                return len;
+            }
+        }
+        c <<= 1;
+    }
+    return 0;
+}
+
+static void put_byte(bit_writer_t *w, uint8_t b)
+{
+    if (w->n >= w->max) {
+        w->overflow = true;
+        return;
+    }
+    w->out[w->n++] = b;
+}
+
+static void put_bytes(bit_writer_t *w, const uint8_t *data, size_t len)
+{
+    if (w->n + len > w->max) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->out + w->n, data, len);
+    w->n += len;
+}
+
+// Entropy coded data, so a 0xFF gets a 0x00 stuffed after it
+static void put_bits(bit_writer_t *w, uint32_t code, int len)
+{
+    w->acc = (w->acc << len) | code;
+    w->bits += len;
+    while (w->bits >= 8) {
+        uint8_t b = (w->acc >> (w->bits - 8)) & 0xFF;
+        put_byte(w, b);
+        if (b == 0xFF) put_byte(w, 0x00);
+        w->bits -= 8;
+    }
+    w->acc &= (1u << w->bits) - 1;
+}
+
+// A tile ends on a byte boundary, padded with 1 bits
+static void flush_bits(bit_writer_t *w)
+{
+    if (w->bits) put_bits(w, (1u << (8 - w->bits)) - 1, 8 - w->bits);
+}
+
+static uint32_t mcu_count(const jpeg_info_t *info)
+{
+    int hmax = 1, vmax = 1;
+    for (int i = 0; i < info->ncomp; i++) {
+        if (info->h[i] > hmax) hmax = info->h[i];
+        if (info->v[i] > vmax) vmax = info->v[i];
+    }
+    if (info->scan_comps == 1) {
+        // not interleaved, an MCU is one block of the component
+        int c = info->scan_comp[0];
+        uint32_t w = (info->width * info->h[c] + hmax - 1) / hmax;
+        uint32_t h = (info->height * info->v[c] + vmax - 1) / vmax;
+        return ((w + 7) / 8) * ((h + 7) / 8);
+    }
+    return ((info->width + 8 * hmax - 1) / (8 * hmax)) * ((info->height + 8 * vmax - 1) / (8 * vmax));
+}
+
+// Bytes taken up by up to count tiles after the marker at p, for sizing tiles around a hole.
+// Returns how many tiles that was.
+static int tiles_after(const uint8_t *buf, uint32_t p, uint32_t end, int count, uint32_t *bytes)
+{
+    uint32_t start = p + 2;
+    int n = 0;
+    for (p = start; p + 1 < end && n < count; p++) {
+        if (buf[p] == 0xFF && buf[p + 1] >= 0xD0 && buf[p + 1] <= 0xD7) {
+            n++;
+            *bytes = p - start;
+        }
+    }
+    return n;
+}
+
+// Which tile a restart marker ends when we don't know where we are: the one with the right
+// number mod 8 closest to where the missing bytes say we should have got to
+static int place_marker(int n, int cut_tile, uint32_t missing, uint32_t avg)
+{
+    int j = cut_tile + ((n - cut_tile) % 8 + 8) % 8;
+    if (avg == 0) return j;
+    double est = cut_tile + (double)missing / avg;
+    while (j + 8 - est < est - j) j += 8;
+    return j;
+}
+
+size_t jpeg_repair(const uint8_t *buf, const jpeg_span_t *spans, int nspans, uint8_t *out, size_t max,
+                   jpeg_repair_stats_t *stats)
+{
+    jpeg_info_t info;
+    if (nspans < 1 || spans[0].start != 0 || !parse_headers(buf, spans[0].end, &info) || info.restart == 0) {
+        return 0;
+    }
+
+    // A grey block is a DC difference of 0 and an end of block, the DC predictor starts from 0
+    // (mid grey) at every restart marker
+    uint32_t dc_code[4], ac_code[4];
+    int dc_len[4], ac_len[4];
+    for (int i = 0; i < info.scan_comps; i++) {
+        dc_len[i] = huff_code(&info.dc[info.dc_table[i]], 0x00, &dc_code[i]);
+        ac_len[i] = huff_code(&info.ac[info.ac_table[i]], 0x00, &ac_code[i]);
+        if (dc_len[i] == 0 || ac_len[i] == 0) return 0;
+    }
+
+    uint32_t mcus = mcu_count(&info);
+    int tiles = (mcus + info.restart - 1) / info.restart;
+    if (tiles > JPEG_REPAIR_TILES_MAX) return 0;
+    memset(tile_end, 0, tiles * sizeof(tile_end[0]));
+
+    // Find every tile that's all there, which is any run between two markers with no hole in it
+    int idx = 0;                        // tile the next byte belongs to
+    uint32_t from = info.scan_start;    // where that tile started
+    bool known = true;                  // false once a hole means we've lost count
+    uint32_t missing = 0;               // bytes lost in holes since the last marker
+    int good = 0;
+    bool done = false;
+    // sizes of the last few whole tiles, neighbouring tiles are the best guess at the size of
+    // the ones in a hole (how much detail there is changes across the image)
+    uint32_t recent[JPEG_REPAIR_NEAR] = { 0 };
+    int nrecent = 0;
+
+    for (int s = 0; s < nspans && !done; s++) {
+        uint32_t p = s ? spans[s].start : info.scan_start;
+        if (s) {
+            known = false;
+            missing += spans[s].start - spans[s - 1].end;
+        }
+
+        for (; p + 1 < spans[s].end; p++) {
+            if (buf[p] != 0xFF || buf[p + 1] == 0xFF) continue;
+            uint8_t m = buf[p + 1];
+            if (m == 0x00) {
+                p++;
+                continue;
+            }
+            if ((m < 0xD0 || m > 0xD7) && m != 0xD9) {
+                done = true;
+                break;
+            }
+
+            int ends = idx;
+            if (known && m != 0xD9 && (m & 7) != (idx & 7)) known = false;
+            if (!known && m == 0xD9) {
+                ends = tiles - 1;
+            } else if (!known) {
+                uint32_t bytes = 0;
+                int n = tiles_after(buf, p, spans[s].end, JPEG_REPAIR_NEAR, &bytes);
+                int near = (nrecent < JPEG_REPAIR_NEAR) ? nrecent : JPEG_REPAIR_NEAR;
+                for (int i = 0; i < near; i++) bytes += recent[i];
+                ends = place_marker(m & 7, idx, missing, (n + near) ? bytes / (n + near) : 0);
+            } else if (idx < tiles) {
+                tile_start[idx] = from;
+                tile_end[idx] = p;
+                recent[nrecent++ % JPEG_REPAIR_NEAR] = p - from;
+                good++;
+            }
+
+            idx = ends + 1;
+            from = p + 2;
+            known = true;
+            missing = 0;
+            p++;
+            if (m == 0xD9 || idx >= tiles) {
+                done = true;
+                break;
+            }
+        }
+    }
+
+    // Put it back together with grey wherever a tile is missing
+    bit_writer_t w = { .out = out, .max = max };
+    put_bytes(&w, buf, info.scan_start);
+    good = 0;
+    for (int k = 0; k < tiles && !w.overflow; k++) {
+        if (k) {
+            put_byte(&w, 0xFF);
+            put_byte(&w, 0xD0 + ((k - 1) & 7));
+        }
+        if (tile_end[k]) {
+            put_bytes(&w, buf + tile_start[k], tile_end[k] - tile_start[k]);
+            good++;
+            continue;
+        }
+        uint32_t n = (k < tiles - 1) ? info.restart : mcus - info.restart * (tiles - 1);
+        for (uint32_t mcu = 0; mcu < n; mcu++) {
+            for (int i = 0; i < info.scan_comps; i++) {
+                int c = info.scan_comp[i];
+                int blocks = (info.scan_comps == 1) ? 1 : info.h[c] * info.v[c];
+                for (int b = 0; b < blocks; b++) {
+                    put_bits(&w, dc_code[i], dc_len[i]);
+                    put_bits(&w, ac_code[i], ac_len[i]);
+                }
+            }
+        }
+        flush_bits(&w);
+    }
+    put_byte(&w, 0xFF);
+    put_byte(&w, 0xD9);
+    if (w.overflow) return 0;
+
+    if (stats) {
+        stats->tiles = tiles;
+        stats->good = good;
+    }
+    return w.n;
+}
@@ -0,0 +1,34 @@
+#ifndef JPEG_REPAIR_H_
+#define JPEG_REPAIR_H_
+#include <stdint.h>
+#include <stddef.h>
+
+// Turns a baseline jpeg with holes in it into one any decoder will show. The can cuts its
+// images into tiles with restart markers (DRI), and the entropy coder starts over at each
+// marker, so a tile only needs its own bytes to decode. Every tile that came down whole is kept
+// as it is and every other one is swapped for a tile of flat grey, which is a handful of bits
+// per block with the image's own huffman tables.
+//
+// After a hole the next restart marker only says which tile it is mod 8, the rest is worked out
+// from how many bytes went missing and how big the tiles on either side of it are. That's right
+// unless a hole swallows eight or more tiles that are far off the size of their neighbours.
+//
+// Needs the headers up to the start of the scan. Progressive jpegs and ones without restart
+// markers aren't repaired.
+#define JPEG_REPAIR_TILES_MAX   1024
+#define JPEG_REPAIR_NEAR        4       // tiles either side of a hole used to size it
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;           // one past the last byte
+} jpeg_span_t;
+
+typedef struct {
+    int tiles;
+    int good;               // came down whole
+} jpeg_repair_stats_t;
+
+size_t jpeg_repair(const uint8_t *buf, const jpeg_span_t *spans, int nspans, uint8_t *out, size_t max,
+                   jpeg_repair_stats_t *stats);
+
+#endif
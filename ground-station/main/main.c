@@ -5,21 +5,27 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "ra01s.h"
 #include "esp_netif.h"
 #include <esp_event.h>
+#include <esp_timer.h>
 #include "wifi.h"
 #include "http.h"
+#include "telemetry.h"
+#include "history.h"
+#include "journal.h"
+#include "uplink.h"
+#include "airtime.h"
+#include "image_rx.h"
 
 static const char *TAG = "main";
 
 // Queue variable definitions
 static uint8_t msg_queue_len = 10;
 QueueHandle_t incoming;
-QueueHandle_t outgoing;
-static uint8_t image_queue_len = 100;
-QueueHandle_t image_out;
 TaskHandle_t tx_task_handle = NULL;  // Declare the task handle globally
+SemaphoreHandle_t loraMutex;        // tx_task and rx_task share the radio
 
 // This task gets the network up and running (see wifi.c for more info)
 void start_network_task(void *pvParameters) {
@@ -31,47 +37,88 @@ void start_network_task(void *pvParameters) {
 // This task gets the HTTP server going (see http.c for more info)
 void webserver_task(void *pvParameters) {
     httpd_handle_t server = NULL;
-    server = start_webserver(&outgoing, &incoming, &image_out);
+    server = start_webserver(&incoming);
     vTaskDelete(NULL);
 }
 
-// LoRa Transmit Task - Send messages from the outgoing queue
+// LoRa Transmit Task - Send uplink commands inside the can's uplink window
 void tx_task(void *pvParameters) {
-    char out[200];
+    char out[UPLINK_PACKET_MAX];
 
     while (1) {
-        // Wait indefinitely for data in the outgoing queue or a task notification
-        if (xQueueReceive(outgoing, (void *)&out, portMAX_DELAY) == pdTRUE) {
-            int txLen = strlen(out) + 1; // Ensure correct length
-            ESP_LOGI(pcTaskGetName(NULL), "Sending %d-byte packet: %s", txLen, out);
+        // rx_task wakes us when a telemetry frame opens an uplink window, anything queued in
+        // between (including retries) waits for the next one
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-            if (!LoRaSend((uint8_t *)out, txLen, SX126x_TXMODE_SYNC)) {
-                ESP_LOGE(pcTaskGetName(NULL), "LoRaSend failed!");
+        // Pack as many commands per packet as fit, and keep sending while a full size packet
+        // still fits in what's left of the window and the uplink budget
+        uint32_t max_air_us = LoRaGetTimeOnAir(UPLINK_PACKET_MAX);
+        size_t txLen;
+        while (uplink_window_left_ms() > max_air_us / 1000 &&
+               airtime_wait_ms(AIRTIME_UPLINK, max_air_us) == 0 &&
+               (txLen = uplink_build_packet(out, sizeof(out))) > 0) {
+            ESP_LOGI(pcTaskGetName(NULL), "Sending %d-byte packet: %s", (int)txLen, out);
+
+            if (xSemaphoreTake(loraMutex, portMAX_DELAY) == pdTRUE) {
+                if (!LoRaSend((uint8_t *)out, txLen, SX126x_TXMODE_SYNC)) {
+                    ESP_LOGE(pcTaskGetName(NULL), "LoRaSend failed!");
+                }
+                xSemaphoreGive(loraMutex);
+                airtime_spend(AIRTIME_UPLINK, LoRaGetTimeOnAir(txLen));
             }
         }
-
-        // Block waiting for further messages or a notification
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 }
 
 
 // LoRa Receive Task - Receive messages and put them in the incoming queue
 void rx_task(void *pvParameters) {
-    char in[110];
+    static rx_packet_t pkt;
+    uint32_t seq = 0;
 
     while (1) {
-        uint8_t rxLen = LoRaReceive((uint8_t *)in, sizeof(in));
+        uint8_t rxLen = 0;
+        if (xSemaphoreTake(loraMutex, portMAX_DELAY) == pdTRUE) {
+            rxLen = LoRaReceive((uint8_t *)pkt.data, RX_PACKET_MAX);
+            xSemaphoreGive(loraMutex);
+        }
 
         if (rxLen > 0) {
-            if(in[0] == 'I'){
-                if(xQueueSend(image_out, (void *)in, pdMS_TO_TICKS(10)) != pdTRUE) {
-                    ESP_LOGI(TAG, "Incoming queue full!");
+            pkt.data[rxLen] = '\0';
+            pkt.len = rxLen;
+            pkt.seq = ++seq;
+            pkt.arrival_ms = (uint32_t)(esp_timer_get_time() / 1000);
+            pkt.flags = 0;
+            GetPacketStatus(&pkt.rssi, &pkt.snr);
+            // Image packets are binary, the text fields below are only ever in telemetry
+            bool image = pkt.data[0] == 'I';
+
+            // The can is listening now, let tx_task have the radio before anything else
+            if (!image && uplink_window_open(pkt.data, esp_timer_get_time())) {
+                xTaskNotifyGive(tx_task_handle);
+            }
+
+            // The can's packets are on the same channel as ours
+            airtime_heard(image ? AIRTIME_IMAGE : AIRTIME_TELEMETRY, LoRaGetTimeOnAir(rxLen));
+
+            // Never blocks, the journal task does the flash writes
+            journal_append(&pkt);
+
+            if (!image) {
+                // The can piggybacks acks for uplink commands on its telemetry
+                const char *acks = uplink_find_ack(pkt.data);
+                if (acks != NULL) {
+                    uplink_handle_ack(acks);
                 }
-            }else if (xQueueSend(incoming, (void *)in, pdMS_TO_TICKS(10)) != pdTRUE) {
+                image_rx_same(pkt.data);
+            }
+
+            if(image){
+                image_rx_packet((const uint8_t *)pkt.data, pkt.len);
+            }else if (xQueueSend(incoming, (void *)&pkt, pdMS_TO_TICKS(10)) != pdTRUE) {
                 ESP_LOGI(TAG, "Incoming queue full!");
             } else {
-                ESP_LOGI(pcTaskGetName(NULL), "Received: %s", in);
+                ESP_LOGI(pcTaskGetName(NULL), "Received: %s (RSSI %d, SNR %d)", pkt.data, pkt.rssi, pkt.snr);
             }
         }
 
@@ -108,9 +155,14 @@ void app_main(void)
 
     LoRaConfig(spreadingFactor, bandwidth, codingRate, preambleLength, payloadLen, crcOn, invertIrq);
 
-    outgoing = xQueueCreate(msg_queue_len, sizeof(char[100]));
-    incoming = xQueueCreate(msg_queue_len, sizeof(char[400]));
-    image_out = xQueueCreate(msg_queue_len, sizeof(char[110]));
+    incoming = xQueueCreate(msg_queue_len, sizeof(rx_packet_t));
+    loraMutex = xSemaphoreCreateMutex();
+    uplink_init();
+
+    // We only send uplink, and only inside the can's window. The budget is one full size packet
+    // per telemetry frame, with a second one's worth of burst for retries.
+    airtime_init();
+    airtime_configure(AIRTIME_UPLINK, LoRaGetTimeOnAir(UPLINK_PACKET_MAX) / 1000, 2 * LoRaGetTimeOnAir(UPLINK_PACKET_MAX) / 1000);
 
     // I don't know what all this does, and I am too fearful to touch it
     ESP_LOGI(TAG, "NVS init");
@@ -119,6 +171,14 @@ void app_main(void)
     ESP_LOGI(TAG, "Eventloop create");
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
+    if (history_init() != ESP_OK) {
+        ESP_LOGE(TAG, "No memory for packet history, /history will be empty");
+    }
+    journal_init();
+    if (image_rx_init() != ESP_OK) {
+        ESP_LOGE(TAG, "No memory for images, /image will only have thumbnails");
+    }
+
 
     // Create tasks with TX task having a higher priority
     xTaskCreate(start_network_task, "start network task", 5000, NULL, 10, NULL);
@@ -0,0 +1,85 @@
+#include "telemetry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Finds the value of a "KEY:" field in a downlink report. Keys always follow a ':' or the
+// '}' that closes the timestamp, so "GY:" will never match inside some other field.
+static const char *find_field(const char *msg, const char *key)
+{
+    size_t key_len = strlen(key);
+    const char *p = msg;
+
+    while ((p = strstr(p, key)) != NULL) {
+        if (p == msg || p[-1] == ':' || p[-1] == '}') {
+            return p + key_len;
+        }
+        p += key_len;
+    }
+    return NULL;
+}
+
+static bool read_floats(const char *msg, const char *key, float *out, int count)
+{
+    const char *p = find_field(msg, key);
+    if (p == NULL) return false;
+
+    for (int i = 0; i < count; i++) {
+        char *end;
+        out[i] = strtof(p, &end);
+        if (end == p) return false;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return true;
+}
+
+bool telemetry_decode(const char *msg, telemetry_downlink_t *out)
+{
+    if (strncmp(msg, "DWL:{", 5) != 0) return false;
+
+    memset(out, 0, sizeof(*out));
+    out->ts = (uint32_t)strtoul(msg + 5, NULL, 10);
+
+    if (!read_floats(msg, "ACC:", out->acc, 3)) return false;
+    if (!read_floats(msg, "GY:", out->gyro, 3)) return false;
+    read_floats(msg, "PITCH:", &out->pitch, 1);
+    read_floats(msg, "YAW:", &out->yaw, 1);
+    read_floats(msg, "ALT:", &out->alt, 1);
+    read_floats(msg, "TOF:", &out->tof, 1);
+
+    const char *p;
+    if ((p = find_field(msg, "STATE:")) != NULL) out->state = (uint8_t)atoi(p);
+    if ((p = find_field(msg, "CHUTE:")) != NULL) out->chute = (uint8_t)atoi(p);
+    return true;
+}
+
+// Appends one binary record for pkt to buf, returns the bytes written or 0 if it doesn't fit.
+// Anything that isn't a DWL report is forwarded as text so the client still sees it.
+size_t telemetry_encode_record(const rx_packet_t *pkt, uint8_t *buf, size_t buf_len)
+{
+    telemetry_downlink_t dwl;
+    const void *payload;
+    uint8_t type;
+    size_t len;
+
+    if (telemetry_decode(pkt->data, &dwl)) {
+        dwl.seq = pkt->seq;
+        dwl.rssi = pkt->rssi;
+        dwl.snr = pkt->snr;
+        type = (pkt->flags & RX_PACKET_REPLAY) ? TELEMETRY_RECORD_REPLAY : TELEMETRY_RECORD_DOWNLINK;
+        payload = &dwl;
+        len = sizeof(dwl);
+    } else {
+        type = TELEMETRY_RECORD_TEXT;
+        payload = pkt->data;
+        len = strlen(pkt->data);
+    }
+
+    if (TELEMETRY_RECORD_HEADER_LEN + len > buf_len) return 0;
+
+    buf[0] = type;
+    buf[1] = len & 0xFF;
+    buf[2] = (len >> 8) & 0xFF;
+    memcpy(buf + TELEMETRY_RECORD_HEADER_LEN, payload, len);
+    return TELEMETRY_RECORD_HEADER_LEN + len;
+}
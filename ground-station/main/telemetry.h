@@ -0,0 +1,53 @@
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Record types used in the binary /ws stream. Every record on the wire is
+// [type:u8][len:u16 little endian][payload], several records may share one frame.
+#define TELEMETRY_RECORD_DOWNLINK   1   // payload is a telemetry_downlink_t
+#define TELEMETRY_RECORD_TEXT       2   // payload is the raw packet text (no terminator)
+#define TELEMETRY_RECORD_REPLAY     3   // a telemetry_downlink_t out of the journal, its seq is from the recording
+
+#define TELEMETRY_RECORD_HEADER_LEN 3
+
+#define RX_PACKET_MAX 255   // largest LoRa payload
+
+#define RX_PACKET_REPLAY    0x01    // came out of the journal, not off the air
+
+// One received LoRa packet plus what the ground station knew when it arrived. This is what
+// rx_task puts on the incoming queue and what the history keeps.
+typedef struct {
+    uint32_t seq;           // ground station receive counter, starts at 1 every boot
+    uint32_t arrival_ms;    // ground station uptime when the packet came in
+    int8_t rssi;            // dBm
+    int8_t snr;             // dB
+    uint8_t flags;
+    uint8_t len;
+    char data[RX_PACKET_MAX + 1];   // always null terminated
+} rx_packet_t;
+
+// Decoded DWL report. Every field is naturally aligned so the struct has no hidden padding
+// and the browser can read it straight out of a DataView.
+typedef struct {
+    uint32_t seq;       // ground station receive counter
+    uint32_t ts;        // flight computer uptime in ms
+    float acc[3];       // g
+    float gyro[3];      // deg/s
+    float pitch;
+    float yaw;
+    float alt;
+    float tof;
+    uint8_t state;
+    uint8_t chute;
+    int8_t rssi;
+    int8_t snr;
+} telemetry_downlink_t;
+
+_Static_assert(sizeof(telemetry_downlink_t) == 52, "telemetry_downlink_t layout is shared with dashboard.js");
+
+bool telemetry_decode(const char *msg, telemetry_downlink_t *out);
+size_t telemetry_encode_record(const rx_packet_t *pkt, uint8_t *buf, size_t buf_len);
+
+#endif
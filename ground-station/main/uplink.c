@@ -0,0 +1,213 @@
+#include "uplink.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "uplink";
+
+typedef struct {
+    uplink_state_t state;
+    uint16_t id;
+    uint8_t attempts;
+    int64_t queued_us;
+    int64_t first_sent_us;
+    int64_t sent_us;        // latest attempt
+    int64_t retry_us;       // when to send it again if there's still no ack
+    int64_t acked_us;
+    char cmd[UPLINK_CMD_MAX];
+} uplink_cmd_t;
+
+static SemaphoreHandle_t uplink_mutex;
+static uplink_cmd_t cmds[UPLINK_TRACKED];
+static uint16_t next_id;
+static volatile int64_t window_close_us;
+
+void uplink_init(void)
+{
+    uplink_mutex = xSemaphoreCreateMutex();
+
+    // The can remembers the ids it has applied, so don't start from 1 every boot or the first
+    // commands after a ground station reset would get thrown away as duplicates
+    next_id = (esp_random() % 60000) + 1;
+}
+
+// Reuses a free slot, else the oldest finished one. Commands still waiting to go out or
+// waiting on an ack are never dropped.
+static uplink_cmd_t *alloc_slot(void)
+{
+    uplink_cmd_t *oldest = NULL;
+
+    for (int i = 0; i < UPLINK_TRACKED; i++) {
+        if (cmds[i].state == UPLINK_FREE) return &cmds[i];
+        if (cmds[i].state == UPLINK_ACKED || cmds[i].state == UPLINK_LOST) {
+            if (oldest == NULL || cmds[i].queued_us < oldest->queued_us) oldest = &cmds[i];
+        }
+    }
+    return oldest;
+}
+
+// Returns the id the command goes out with, 0 if too many are already in flight
+uint16_t uplink_submit(const char *cmd)
+{
+    uint16_t id = 0;
+
+    xSemaphoreTake(uplink_mutex, portMAX_DELAY);
+    uplink_cmd_t *slot = alloc_slot();
+    if (slot != NULL) {
+        memset(slot, 0, sizeof(*slot));
+        strncpy(slot->cmd, cmd, sizeof(slot->cmd) - 1);
+        if (next_id == 0) next_id = 1;
+        slot->id = id = next_id++;
+        slot->state = UPLINK_QUEUED;
+        slot->queued_us = esp_timer_get_time();
+    }
+    xSemaphoreGive(uplink_mutex);
+    return id;
+}
+
+// Anything whose ack is overdue goes back in the queue with the same id, or is given up on
+static void schedule_retries(int64_t now)
+{
+    for (int i = 0; i < UPLINK_TRACKED; i++) {
+        uplink_cmd_t *c = &cmds[i];
+        if (c->state != UPLINK_SENT || now < c->retry_us) continue;
+
+        if (c->attempts >= UPLINK_MAX_ATTEMPTS) {
+            c->state = UPLINK_LOST;
+            ESP_LOGW(TAG, "Giving up on #%u %s after %d attempts", c->id, c->cmd, c->attempts);
+        } else {
+            c->state = UPLINK_QUEUED;
+            ESP_LOGW(TAG, "No ack for #%u %s, retrying", c->id, c->cmd);
+        }
+    }
+}
+
+// Packs as many queued commands as fit into one packet, oldest first. Returns the packet
+// length, 0 if there's nothing to send right now.
+size_t uplink_build_packet(char *out, size_t len)
+{
+    int64_t now = esp_timer_get_time();
+    size_t max = MIN(len, UPLINK_PACKET_MAX);
+    size_t used = 0;
+
+    xSemaphoreTake(uplink_mutex, portMAX_DELAY);
+    schedule_retries(now);
+
+    while (1) {
+        uplink_cmd_t *next = NULL;
+        for (int i = 0; i < UPLINK_TRACKED; i++) {
+            if (cmds[i].state == UPLINK_QUEUED && (next == NULL || cmds[i].queued_us < next->queued_us)) next = &cmds[i];
+        }
+        if (next == NULL) break;
+
+        char entry[UPLINK_CMD_MAX + 8];
+        int n = snprintf(entry, sizeof(entry), "%u=%s\n", next->id, next->cmd);
+        if (used == 0) {
+            used = snprintf(out, max, "UPL:");
+        }
+        if (used + n >= max) break;     // the rest goes in the next packet
+
+        memcpy(out + used, entry, n + 1);
+        used += n;
+
+        if (next->attempts == 0) next->first_sent_us = now;
+        next->attempts++;
+        next->sent_us = now;
+        next->retry_us = now + ((int64_t)UPLINK_RETRY_MS * 1000 << (next->attempts - 1));
+        next->state = UPLINK_SENT;
+    }
+    xSemaphoreGive(uplink_mutex);
+
+    // Only the header made it in, i.e. nothing to send
+    return (used > 4) ? used : 0;
+}
+
+// Acks come back as an ACK:<ids>: field in a telemetry frame (or a bare ACK:<ids> packet).
+// Returns the start of the id list, NULL if there isn't one.
+const char *uplink_find_ack(const char *msg)
+{
+    if (strncmp(msg, "ACK:", 4) == 0) return msg + 4;
+
+    const char *p = strstr(msg, ":ACK:");
+    return p ? p + 5 : NULL;
+}
+
+// ids is a comma separated list, anything after it is ignored
+void uplink_handle_ack(const char *ids)
+{
+    int64_t now = esp_timer_get_time();
+    const char *p = ids;
+
+    xSemaphoreTake(uplink_mutex, portMAX_DELAY);
+    while (*p) {
+        char *end;
+        unsigned long id = strtoul(p, &end, 10);
+        if (end == p) break;
+
+        for (int i = 0; i < UPLINK_TRACKED; i++) {
+            uplink_cmd_t *c = &cmds[i];
+            if (c->id != id || c->attempts == 0 || c->state == UPLINK_ACKED) continue;
+
+            // A late ack for an attempt we already retried still counts
+            c->state = UPLINK_ACKED;
+            c->acked_us = now;
+            ESP_LOGI(TAG, "#%u %s acked after %d attempt(s), rtt %lld ms, %lld ms after it was queued",
+                     c->id, c->cmd, c->attempts,
+                     (long long)(now - c->sent_us) / 1000, (long long)(now - c->queued_us) / 1000);
+        }
+        if (*end != ',') break;
+        p = end + 1;
+    }
+    xSemaphoreGive(uplink_mutex);
+}
+
+// One line per tracked command:
+// id,state,attempts,queued_to_sent_ms,rtt_ms,total_ms,command
+// rtt is from the last attempt to the ack, total is from submit to the ack
+int uplink_status(char *buf, size_t len)
+{
+    static const char *names[] = { "free", "queued", "sent", "acked", "lost" };
+    int n = 0;
+
+    buf[0] = '\0';
+    xSemaphoreTake(uplink_mutex, portMAX_DELAY);
+    for (int i = 0; i < UPLINK_TRACKED && n < (int)len; i++) {
+        const uplink_cmd_t *c = &cmds[i];
+        if (c->state == UPLINK_FREE) continue;
+
+        long long wait_ms = c->attempts ? (c->first_sent_us - c->queued_us) / 1000 : -1;
+        long long rtt_ms = c->acked_us ? (c->acked_us - c->sent_us) / 1000 : -1;
+        long long total_ms = c->acked_us ? (c->acked_us - c->queued_us) / 1000 : -1;
+        n += snprintf(buf + n, len - n, "%u,%s,%d,%lld,%lld,%lld,%s\n",
+                      c->id, names[c->state], c->attempts, wait_ms, rtt_ms, total_ms, c->cmd);
+    }
+    xSemaphoreGive(uplink_mutex);
+    return n;
+}
+
+// msg is a received packet, rx_us when it came in. If it announces an uplink window, remember
+// when it closes and return true.
+bool uplink_window_open(const char *msg, int64_t rx_us)
+{
+    const char *uw = strstr(msg, ":UW:");
+    if (uw == NULL) return false;
+
+    long len_ms = strtol(uw + 4, NULL, 10);
+    if (len_ms <= UPLINK_GUARD_MS) return false;
+
+    window_close_us = rx_us + (int64_t)(len_ms - UPLINK_GUARD_MS) * 1000;
+    return true;
+}
+
+// How much of the current uplink window is left, 0 if it's closed
+int32_t uplink_window_left_ms(void)
+{
+    int64_t left = window_close_us - esp_timer_get_time();
+    return (left > 0) ? (int32_t)(left / 1000) : 0;
+}
@@ -0,0 +1,43 @@
+#ifndef UPLINK_H_
+#define UPLINK_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Uplink commands are numbered as they're submitted and packed into as few LoRa packets as
+// possible:
+//
+//     UPL:<id>=<command>\n<id>=<command>\n...
+//
+// The can applies each id once and reports it back in an ACK:<id>,<id>: field on its next
+// telemetry frame. Anything not acked in time is sent again with the same id, backing off
+// each time, so a lost uplink or a lost telemetry frame both just cost a retry.
+//
+// The link is half duplex, so we only transmit when the can is listening. Every telemetry frame
+// carries a UW:<ms>: field, the can stays quiet for that long after the frame ends and that's
+// the only time uplink packets go out.
+#define UPLINK_CMD_MAX          100     // longest command accepted
+#define UPLINK_PACKET_MAX       200     // keep uplink packets well under the 255 byte limit
+#define UPLINK_TRACKED          16      // commands in flight plus recent ones for /commands
+#define UPLINK_RETRY_MS         2500    // first ack timeout, a bit over one telemetry period
+#define UPLINK_MAX_ATTEMPTS     5       // timeout doubles each attempt, then it's lost
+#define UPLINK_GUARD_MS         50      // slack for us noticing the frame late, and the can's clock
+
+typedef enum {
+    UPLINK_FREE = 0,
+    UPLINK_QUEUED,
+    UPLINK_SENT,
+    UPLINK_ACKED,
+    UPLINK_LOST
+} uplink_state_t;
+
+void uplink_init(void);
+uint16_t uplink_submit(const char *cmd);
+size_t uplink_build_packet(char *out, size_t len);
+void uplink_handle_ack(const char *ids);
+const char *uplink_find_ack(const char *msg);
+int uplink_status(char *buf, size_t len);
+bool uplink_window_open(const char *msg, int64_t rx_us);
+int32_t uplink_window_left_ms(void);
+
+#endif
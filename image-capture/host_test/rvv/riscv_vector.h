@@ -0,0 +1,48 @@
+// Stand-in for the T-Head toolchain's riscv_vector.h, just the RVV 0.7 intrinsics kernels.cpp
+// uses, done element by element in plain C++ with VLEN 128 like the C906. kernel-bench-rvv builds
+// the vector kernels against it on a desktop, so their arithmetic gets checked against the scalar
+// ones without a Duo or T-Head's qemu. It says nothing about whether the real intrinsics are
+// spelled or behave the same, only the Duo toolchain and kernel-bench on the Duo can say that.
+#ifndef RISCV_VECTOR_STANDIN_H
+#define RISCV_VECTOR_STANDIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#define N 16
+struct vuint8m1_t { uint8_t e[N]; };
+struct vuint16m2_t { uint16_t e[N]; };
+struct vint16m2_t { int16_t e[N]; };
+struct vint32m4_t { int32_t e[N]; };
+struct vint32m1_t { int32_t e[4]; };
+static inline size_t vsetvl_e8m1(size_t avl){ return avl < N ? avl : N; }
+static inline vuint8m1_t vle8_v_u8m1(const uint8_t *p, size_t vl){ vuint8m1_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=p[i]; return r; }
+static inline vuint8m1_t vlse8_v_u8m1(const uint8_t *p, ptrdiff_t s, size_t vl){ vuint8m1_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=p[i*s]; return r; }
+static inline void vse8_v_u8m1(uint8_t *p, vuint8m1_t v, size_t vl){ for(size_t i=0;i<vl;i++) p[i]=v.e[i]; }
+static inline void vsse8_v_u8m1(uint8_t *p, ptrdiff_t s, vuint8m1_t v, size_t vl){ for(size_t i=0;i<vl;i++) p[i*s]=v.e[i]; }
+static inline vuint16m2_t vwaddu_vx_u16m2(vuint8m1_t a, uint8_t x, size_t vl){ vuint16m2_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=a.e[i]+x; return r; }
+static inline vuint16m2_t vwaddu_vv_u16m2(vuint8m1_t a, vuint8m1_t b, size_t vl){ vuint16m2_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=a.e[i]+b.e[i]; return r; }
+static inline vuint16m2_t vwaddu_wv_u16m2(vuint16m2_t a, vuint8m1_t b, size_t vl){ for(size_t i=0;i<vl;i++) a.e[i]+=b.e[i]; return a; }
+static inline vuint16m2_t vmv_v_x_u16m2(uint16_t x, size_t vl){ vuint16m2_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=x; return r; }
+static inline vint16m2_t vreinterpret_v_u16m2_i16m2(vuint16m2_t a){ vint16m2_t r; for(int i=0;i<N;i++) r.e[i]=(int16_t)a.e[i]; return r; }
+static inline vuint16m2_t vreinterpret_v_i16m2_u16m2(vint16m2_t a){ vuint16m2_t r; for(int i=0;i<N;i++) r.e[i]=(uint16_t)a.e[i]; return r; }
+static inline vint16m2_t vsub_vx_i16m2(vint16m2_t a, int16_t x, size_t vl){ for(size_t i=0;i<vl;i++) a.e[i]-=x; return a; }
+static inline vint16m2_t vmax_vx_i16m2(vint16m2_t a, int16_t x, size_t vl){ for(size_t i=0;i<vl;i++) if(a.e[i]<x) a.e[i]=x; return a; }
+static inline vint16m2_t vsll_vx_i16m2(vint16m2_t a, size_t s, size_t vl){ for(size_t i=0;i<vl;i++) a.e[i]=(int16_t)(a.e[i]<<s); return a; }
+static inline vint16m2_t vsub_vv_i16m2(vint16m2_t a, vint16m2_t b, size_t vl){ for(size_t i=0;i<vl;i++) a.e[i]-=b.e[i]; return a; }
+static inline vint32m4_t vwmul_vx_i32m4(vint16m2_t a, int16_t x, size_t vl){ vint32m4_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=(int32_t)a.e[i]*x; return r; }
+static inline vint32m4_t vwmul_vv_i32m4(vint16m2_t a, vint16m2_t b, size_t vl){ vint32m4_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=(int32_t)a.e[i]*b.e[i]; return r; }
+static inline vint32m4_t vwmacc_vx_i32m4(vint32m4_t acc, int16_t x, vint16m2_t b, size_t vl){ for(size_t i=0;i<vl;i++) acc.e[i]+=(int32_t)x*b.e[i]; return acc; }
+static inline vint32m4_t vadd_vx_i32m4(vint32m4_t a, int32_t x, size_t vl){ for(size_t i=0;i<vl;i++) a.e[i]+=x; return a; }
+static inline vint32m4_t vadd_vv_i32m4(vint32m4_t a, vint32m4_t b, size_t vl){ for(size_t i=0;i<vl;i++) a.e[i]+=b.e[i]; return a; }
+static inline vint32m4_t vsra_vx_i32m4(vint32m4_t a, size_t s, size_t vl){ for(size_t i=0;i<vl;i++) a.e[i]>>=s; return a; }
+static inline vint32m4_t vmin_vx_i32m4(vint32m4_t a, int32_t x, size_t vl){ for(size_t i=0;i<vl;i++) if(a.e[i]>x) a.e[i]=x; return a; }
+static inline vint32m4_t vmax_vx_i32m4(vint32m4_t a, int32_t x, size_t vl){ for(size_t i=0;i<vl;i++) if(a.e[i]<x) a.e[i]=x; return a; }
+static inline vint16m2_t vnsra_wx_i16m2(vint32m4_t a, size_t s, size_t vl){ vint16m2_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=(int16_t)(a.e[i]>>s); return r; }
+static inline vuint8m1_t vnsrl_wx_u8m1(vuint16m2_t a, size_t s, size_t vl){ vuint8m1_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=(uint8_t)(a.e[i]>>s); return r; }
+static inline vint32m1_t vmv_v_x_i32m1(int32_t x, size_t vl){ vint32m1_t r={}; for(size_t i=0;i<vl;i++) r.e[i]=x; return r; }
+static inline int32_t vmv_x_s_i32m1_i32(vint32m1_t a){ return a.e[0]; }
+static inline vint32m1_t vwredsum_vs_i16m2_i32m1(vint32m1_t d, vint16m2_t v, vint32m1_t s, size_t vl){ int32_t t=s.e[0]; for(size_t i=0;i<vl;i++) t+=v.e[i]; d.e[0]=t; return d; }
+static inline vint32m1_t vredsum_vs_i32m4_i32m1(vint32m1_t d, vint32m4_t v, vint32m1_t s, size_t vl){ int32_t t=s.e[0]; for(size_t i=0;i<vl;i++) t+=v.e[i]; d.e[0]=t; return d; }
+#undef N
+
+#endif
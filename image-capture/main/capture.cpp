@@ -0,0 +1,453 @@
+#include "capture.h"
+#include "v4l2.h"
+#include "kernels.h"
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <stdio.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <atomic>
+#include <algorithm>
+
+static CaptureBackend backend;
+static cv::VideoCapture cap;
+static V4l2Camera cam;
+static std::thread captureThread;
+static std::atomic<bool> capturing(false);
+static StageStats stats;
+
+//the capture thread owns back, the caller of captureLatest owns front, ready is whichever
+//finished frame hasn't been picked up yet
+static Frame frames[3];
+static int back = 0, ready = 1, front = 2;
+static bool fresh = false;
+static std::mutex swapLock;
+static std::condition_variable freshCv;
+
+//fill the back slot from cv::VideoCapture, which copies and converts to BGR
+static bool grabOpenCV(Frame &f){
+    if (!cap.read(f.image) || f.image.empty()) return false;
+    f.format = FRAME_BGR;
+    f.capturedUs = monotonicUs();
+    return true;
+}
+
+//point the back slot at the next driver buffer, nothing gets copied
+static bool grabV4L2(Frame &f){
+    //whatever buffer this slot had is stale by now, give it back to the driver first
+    if (f.buffer >= 0) {
+        v4l2Requeue(cam, f.buffer);
+        f.buffer = -1;
+    }
+
+    int index;
+    size_t bytes;
+    if (v4l2Dequeue(cam, 1000, &index, &bytes, &f.capturedUs) != 0) return false;
+
+    f.buffer = index;
+    unsigned char *data = (unsigned char *)cam.bufs[index].start;
+    if (cam.fourcc == V4L2_PIX_FMT_MJPEG) {
+        f.format = FRAME_MJPEG;
+        f.jpeg = data;
+        f.jpegLen = bytes;
+    } else {
+        f.format = FRAME_YUYV;
+        f.image = cv::Mat(cam.height, cam.width, CV_8UC2, data, cam.stride);
+    }
+    return true;
+}
+
+static void captureLoop(){
+    uint32_t seq = 0;
+
+    //the first two captures are all black and greyscale respectively, lets deal with those
+    for (int i = 0; i < 2; i++) {
+        if (backend == CAPTURE_V4L2) {
+            grabV4L2(frames[back]);
+        } else {
+            grabOpenCV(frames[back]);
+        }
+    }
+
+    while (capturing) {
+        Frame &f = frames[back];
+        int64_t start = monotonicUs();
+        bool ok = (backend == CAPTURE_V4L2) ? grabV4L2(f) : grabOpenCV(f);
+        if (!ok) {
+            fprintf(stderr, "capture failed\n");
+            usleep(100000);
+            continue;
+        }
+        f.seq = ++seq;
+        int64_t captured = f.capturedUs;
+
+        {
+            std::lock_guard<std::mutex> lock(swapLock);
+            std::swap(back, ready);
+            fresh = true;
+            freshCv.notify_one();
+        }
+        //most of a grab is waiting on the sensor, so this stage is always busy and its rate is the
+        //frame rate. Latency is how old a frame is by the time it's ready.
+        int64_t now = monotonicUs();
+        stageDone(stats, 1, now - start, now - captured);
+    }
+}
+
+int captureStart(int device, int width, int height, CaptureBackend want){
+    char dev[32];
+    snprintf(dev, sizeof(dev), "/dev/video%d", device);
+
+    //start from empty slots, the bench tool starts and stops more than once
+    for (int i = 0; i < 3; i++) frames[i] = Frame();
+    back = 0;
+    ready = 1;
+    front = 2;
+    fresh = false;
+
+    if (want != CAPTURE_OPENCV && v4l2Open(cam, dev, width, height) == 0) {
+        backend = CAPTURE_V4L2;
+    } else if (want == CAPTURE_V4L2) {
+        return -1;
+    } else {
+        //set up cv image capture parameters and open
+        cap.set(cv::CAP_PROP_FRAME_WIDTH, width);
+        cap.set(cv::CAP_PROP_FRAME_HEIGHT, height);
+        if (!cap.open(device)) {
+            fprintf(stderr, "couldn't open camera %d\n", device);
+            return -1;
+        }
+        backend = CAPTURE_OPENCV;
+    }
+
+    capturing = true;
+    captureThread = std::thread(captureLoop);
+    return 0;
+}
+
+CaptureBackend captureBackend(){
+    return backend;
+}
+
+const StageStats &captureStats(){
+    return stats;
+}
+
+//newest finished frame with a seq past newerThan, waiting up to timeoutMs for one. The frame
+//stays valid until the next call. Returns NULL if there's nothing new enough.
+const Frame *captureLatest(int timeoutMs, uint32_t newerThan){
+    std::unique_lock<std::mutex> lock(swapLock);
+    if (!fresh && frames[front].seq <= newerThan) {
+        freshCv.wait_for(lock, std::chrono::milliseconds(timeoutMs), []{ return fresh; });
+    }
+    if (fresh) {
+        std::swap(front, ready);
+        fresh = false;
+    }
+    return (frames[front].seq > newerThan) ? &frames[front] : NULL;
+}
+
+void captureStop(){
+    capturing = false;
+    if (captureThread.joinable()) captureThread.join();
+    if (backend == CAPTURE_V4L2) {
+        v4l2Close(cam);
+    } else {
+        cap.release();
+    }
+}
+
+//BGR view of a frame for encoding, converting YUYV into a reused buffer
+static const cv::Mat &frameBGR(const Frame &frame){
+    static cv::Mat bgr;
+    if (frame.format == FRAME_BGR) return frame.image;
+    bgr.create(frame.image.rows, frame.image.cols, CV_8UC3);
+    yuyvToBgr(frame.image.data, (int)frame.image.step, frame.image.cols, frame.image.rows, bgr.data, (int)bgr.step);
+    return bgr;
+}
+
+//shrink by a whole number, which is what INTER_AREA does but the kernels do it on the vector unit
+static void shrink(const cv::Mat &src, int factor, cv::Mat &dst){
+    if (src.depth() == CV_8U && factor <= 16 && (factor & (factor - 1)) == 0) {
+        dst.create(src.rows / factor, src.cols / factor, src.type());
+        boxDownscale(src.data, (int)src.step, src.cols, src.rows, src.channels(), factor, dst.data, (int)dst.step);
+        return;
+    }
+    cv::resize(src, dst, cv::Size(src.cols / factor, src.rows / factor), 0, 0, cv::INTER_AREA);
+}
+
+//jpeg bytes for a frame, an MJPEG frame is just copied out
+int frameEncode(const Frame &frame, std::vector<unsigned char> &out){
+    if (frame.format == FRAME_MJPEG) {
+        out.assign(frame.jpeg, frame.jpeg + frame.jpegLen);
+        return 0;
+    }
+    return cv::imencode(".jpg", frameBGR(frame), out) ? 0 : -1;
+}
+
+//BGR of any frame, an MJPEG one has to be decoded before it can be made any smaller
+static cv::Mat frameDecoded(const Frame &frame){
+    if (frame.format == FRAME_MJPEG) {
+        return cv::imdecode(cv::Mat(1, (int)frame.jpegLen, CV_8UC1, (void *)frame.jpeg), cv::IMREAD_COLOR);
+    }
+    return frameBGR(frame);
+}
+
+//restartBlocks puts a restart marker every that many MCUs (0 for none), the decoder starts from
+//scratch at each one so the data between them can be lost without taking the rest with it
+static int64_t encodeAt(const cv::Mat &image, int quality, std::vector<unsigned char> &out, int restartBlocks = 0){
+    std::vector<int> params(4);
+    params[0] = cv::IMWRITE_JPEG_QUALITY;
+    params[1] = quality;
+    params[2] = cv::IMWRITE_JPEG_RST_INTERVAL;
+    params[3] = restartBlocks;
+    int64_t start = monotonicUs();
+    if (!cv::imencode(".jpg", image, out, params)) out.clear();
+    return monotonicUs() - start;
+}
+
+//tiles jpeg is really cut into, from its DRI and the restart markers in the scan. 0 if it has
+//no DRI, which is what comes out of an imencode that ignores IMWRITE_JPEG_RST_INTERVAL.
+static int jpegTiles(const std::vector<unsigned char> &jpeg){
+    size_t n = jpeg.size();
+    size_t p = 2;
+    bool dri = false;
+    if (n < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return 0;
+    while (true) {
+        if (p + 4 > n || jpeg[p] != 0xFF) return 0;
+        uint8_t marker = jpeg[p + 1];
+        size_t len = (jpeg[p + 2] << 8) | jpeg[p + 3];
+        if (marker == 0xDD && len >= 4 && p + 6 <= n) dri = ((jpeg[p + 4] << 8) | jpeg[p + 5]) != 0;
+        p += 2 + len;
+        if (marker == 0xDA) break;
+    }
+    if (!dri) return 0;
+    int tiles = 1;
+    for (; p + 1 < n; p++) {
+        if (jpeg[p] == 0xFF && jpeg[p + 1] >= 0xD0 && jpeg[p + 1] <= 0xD7) tiles++;
+    }
+    return tiles;
+}
+
+static int blockCount(const cv::Mat &image){
+    return ((image.cols + TILE_BLOCK - 1) / TILE_BLOCK) * ((image.rows + TILE_BLOCK - 1) / TILE_BLOCK);
+}
+
+//false once an encode asked for tiles came out without them, then there's no point asking again
+static bool restartWorks = true;
+
+//restart interval that makes tiles of about tileBytes, if the whole image comes out near budget
+static int restartFor(const cv::Mat &image, size_t budget, size_t tileBytes){
+    if (tileBytes == 0 || budget == 0 || !restartWorks) return 0;
+    return std::max(1, (int)(blockCount(image) * (double)tileBytes / budget));
+}
+
+//jpeg of the frame that fits in budget bytes, as good as it can be. Starts from whatever quality
+//worked last time and steps out from there until it has one that fits and one that doesn't, then
+//bisects. Consecutive frames come out about the same size so that's usually two or three encodes.
+//Halves the size if even the lowest quality is too big.
+//With tileBytes it's cut into tiles of about that size (see TILE_BYTES).
+//Returns 0 if it fits, 1 if nothing did (out has the smallest try), -1 if encoding failed.
+int frameEncodeBudget(const Frame &frame, size_t budget, std::vector<unsigned char> &out, EncodeResult *result,
+                      size_t tileBytes){
+    static int lastQuality = 50;
+    static int lastScale = 1;
+    EncodeResult r;
+    r.quality = 0;
+    r.scale = 1;
+    r.attempts = 0;
+    r.encodeUs = 0;
+    r.tiles = 0;
+
+    int64_t start = monotonicUs();
+    cv::Mat full = frameDecoded(frame);
+    r.encodeUs += monotonicUs() - start;
+    if (full.empty()) return -1;
+
+    std::vector<unsigned char> tryOut;
+    int scale = lastScale;
+    int q = lastQuality;
+    int status = 1;
+    out.clear();
+
+    //start at last time's size, only going back up if the bigger one fits at the lowest quality
+    while (scale > 1) {
+        scale /= 2;
+        cv::Mat probe;
+        shrink(full, scale, probe);
+        r.encodeUs += encodeAt(probe, ENCODE_QUALITY_MIN, tryOut, restartFor(probe, budget, tileBytes));
+        r.attempts++;
+        if (tryOut.empty() || tryOut.size() > budget) {
+            scale *= 2;
+            break;
+        }
+    }
+
+    for (; scale <= ENCODE_SCALE_MAX && status != 0; scale *= 2) {
+        cv::Mat scaled;
+        if (scale == 1) {
+            scaled = full;
+        } else {
+            shrink(full, scale, scaled);
+        }
+
+        int restart = restartFor(scaled, budget, tileBytes);
+        int lo = ENCODE_QUALITY_MIN, hi = ENCODE_QUALITY_MAX;
+        bool fit = false, miss = false;
+        while (lo <= hi) {
+            r.encodeUs += encodeAt(scaled, q, tryOut, restart);
+            r.attempts++;
+            if (tryOut.empty()) return -1;
+            size_t got = tryOut.size();
+
+            if (got <= budget) {
+                out.swap(tryOut);
+                r.quality = q;
+                r.scale = scale;
+                status = 0;
+                fit = true;
+                lo = q + 1;
+            } else {
+                //keep the smallest one that didn't fit in case nothing does
+                if (status != 0 && (out.empty() || got < out.size())) {
+                    out.swap(tryOut);
+                    r.quality = q;
+                    r.scale = scale;
+                }
+                miss = true;
+                hi = q - 1;
+            }
+            //within a few quality steps isn't worth another encode
+            if (fit && hi - lo < 4) break;
+            if (fit && miss) {
+                q = (lo + hi) / 2;
+            } else {
+                //nothing on the other side yet, guess from how far off this one was (the size goes
+                //up roughly in proportion to the quality)
+                int guess = (int)(q * (double)budget / got);
+                q = fit ? std::max(guess, q + 1) : std::min(guess, q - 1);
+                q = std::min(std::max(q, lo), hi);
+            }
+        }
+    }
+
+    if (status == 0) {
+        lastQuality = r.quality;
+        lastScale = r.scale;
+    }
+    //counted rather than worked out from the interval, imencode only writes the markers if the
+    //libjpeg underneath it does
+    r.tiles = jpegTiles(out);
+    if (restartFor(full, budget, tileBytes) && r.tiles == 0 && !out.empty()) {
+        fprintf(stderr, "imencode wrote no restart markers, downlink copies go as one scan from now on\n");
+        restartWorks = false;
+    }
+    r.bytes = out.size();
+    if (result) *result = r;
+    return status;
+}
+
+int frameThumbnail(const Frame &frame, std::vector<unsigned char> &out){
+    cv::Mat full = frameDecoded(frame);
+    if (full.empty()) return -1;
+    cv::Mat small;
+    shrink(full, THUMB_SCALE, small);
+    encodeAt(small, THUMB_QUALITY, out);
+    return out.empty() ? -1 : 0;
+}
+
+//difference hash of a grey image, bit y * 8 + x is set when pixel x of row y is brighter than
+//the one to its right
+static uint64_t dHash(const cv::Mat &gray){
+    static cv::Mat tiny;
+    cv::resize(gray, tiny, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; y++) {
+        const uint8_t *row = tiny.ptr<uint8_t>(y);
+        for (int x = 0; x < 8; x++) {
+            if (row[x] > row[x + 1]) hash |= 1ull << (y * 8 + x);
+        }
+    }
+    return hash;
+}
+
+//bits two hashes differ in, 0 is the same picture and 64 is nothing alike
+int frameHashDistance(uint64_t a, uint64_t b){
+    return __builtin_popcountll(a ^ b);
+}
+
+//scores and hashes a frame (see FrameScore) from a half size grey copy, which is a quarter of the
+//pixels to go through and averages away sensor noise that would otherwise count as sharpness
+int frameScore(const Frame &frame, FrameScore *score){
+    static cv::Mat gray, half;
+    int64_t start = monotonicUs();
+
+    if (frame.format == FRAME_MJPEG) {
+        //libjpeg scales down as it decodes, so this costs a lot less than a full decode
+        half = cv::imdecode(cv::Mat(1, (int)frame.jpegLen, CV_8UC1, (void *)frame.jpeg), cv::IMREAD_REDUCED_GRAYSCALE_2);
+    } else {
+        if (frame.format == FRAME_YUYV) {
+            gray.create(frame.image.rows, frame.image.cols, CV_8UC1);
+            yuyvToGray(frame.image.data, (int)frame.image.step, frame.image.cols, frame.image.rows, gray.data,
+                       (int)gray.step);
+        } else {
+            cv::cvtColor(frame.image, gray, cv::COLOR_BGR2GRAY);
+        }
+        shrink(gray, 2, half);
+    }
+    if (half.empty()) return -1;
+
+    uint64_t total = 0;
+    size_t clipped = 0;
+    for (int y = 0; y < half.rows; y++) {
+        const uint8_t *row = half.ptr<uint8_t>(y);
+        for (int x = 0; x < half.cols; x++) {
+            total += row[x];
+            clipped += (row[x] <= SCORE_CLIP_LOW || row[x] >= SCORE_CLIP_HIGH);
+        }
+    }
+    double pixels = (double)half.rows * half.cols;
+
+    FrameScore s;
+    s.sharpness = laplacianVariance(half.data, (int)half.step, half.cols, half.rows);
+    s.mean = total / pixels;
+    s.clipped = clipped / pixels;
+    s.score = s.sharpness * (1.0 - s.clipped);
+    s.hash = dHash(half);
+    s.scoreUs = monotonicUs() - start;
+    *score = s;
+    return 0;
+}
+
+//copy of a frame that owns its pixels, so it stays good past the next captureLatest
+void frameCopy(const Frame &frame, Frame &copy){
+    copy.format = frame.format;
+    copy.buffer = -1;
+    copy.seq = frame.seq;
+    copy.capturedUs = frame.capturedUs;
+    if (frame.format == FRAME_MJPEG) {
+        copy.jpegCopy.assign(frame.jpeg, frame.jpeg + frame.jpegLen);
+        copy.jpeg = copy.jpegCopy.data();
+        copy.jpegLen = frame.jpegLen;
+    } else {
+        frame.image.copyTo(copy.image);
+    }
+}
+
+//MJPEG frames go straight from the driver buffer to disk, everything else gets encoded
+int frameSave(const Frame &frame, const char *filename){
+    if (frame.format != FRAME_MJPEG) {
+        return cv::imwrite(filename, frameBGR(frame)) ? 0 : -1;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) return -1;
+    size_t written = fwrite(frame.jpeg, 1, frame.jpegLen, fp);
+    fclose(fp);
+    return (written == frame.jpegLen) ? 0 : -1;
+}
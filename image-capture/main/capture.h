@@ -0,0 +1,109 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <opencv2/core/core.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "stage.h"
+
+// The camera runs on its own thread and never stops grabbing, so a command gets a frame that
+// was already exposed and read out instead of waiting on the sensor.
+//
+// Frames go through a triple buffer: the capture thread fills the back slot and swaps it with
+// the ready slot, captureLatest swaps the ready slot into the front slot. Neither side ever
+// waits on the other's copy and the three cv::Mats are reused, so there's no allocation per
+// frame once the first few have gone through.
+//
+// There are two ways of getting frames. V4L2 (v4l2.cpp) hands over the driver's own buffers,
+// already a jpeg if the camera does MJPEG, and is what UVC cameras and desktop testing use.
+// cv::VideoCapture is the fallback, and the only option for the Duo's CSI camera.
+enum CaptureBackend {
+    CAPTURE_AUTO = 0,       // V4L2 if the device takes it, otherwise OpenCV
+    CAPTURE_V4L2,
+    CAPTURE_OPENCV
+};
+
+enum FrameFormat {
+    FRAME_BGR = 0,          // cv::VideoCapture output
+    FRAME_YUYV,             // view straight onto a V4L2 buffer
+    FRAME_MJPEG             // V4L2 buffer that's already a jpeg
+};
+
+struct Frame {
+    FrameFormat format;
+    cv::Mat image;          // FRAME_BGR and FRAME_YUYV
+    const unsigned char *jpeg;  // FRAME_MJPEG
+    size_t jpegLen;
+    int buffer;             // V4L2 buffer this slot is holding, -1 for none
+    uint32_t seq;           // counts up from 1, 0 means no frame yet
+    int64_t capturedUs;     // CLOCK_MONOTONIC when the frame was captured
+    std::vector<unsigned char> jpegCopy;    // what jpeg points at in a frameCopy
+
+    Frame() : format(FRAME_BGR), jpeg(NULL), jpegLen(0), buffer(-1), seq(0), capturedUs(0) {}
+};
+
+// How usable a frame looks, worked out on a half size grey copy. sharpness is the variance of the
+// Laplacian, which motion blur drags right down. clipped is the fraction of pixels crushed to
+// black or blown out to white, which no amount of sharpness makes up for. score is sharpness
+// scaled by what isn't clipped, bigger is better.
+//
+// hash is a 64 bit difference hash of the same copy: shrunk to 9x8, one bit per pair of
+// neighbours saying which is brighter. It hardly moves with noise, exposure or jpeg artefacts, so
+// two frames of the same scene are only a few bits apart (see frameHashDistance).
+struct FrameScore {
+    double sharpness;
+    double mean;            // average grey level
+    double clipped;
+    double score;
+    uint64_t hash;
+    int64_t scoreUs;
+};
+
+// What frameEncodeBudget settled on. scale is how much each side was divided by.
+struct EncodeResult {
+    int quality;
+    int scale;
+    size_t bytes;
+    int attempts;           // encodes it took to get there
+    int64_t encodeUs;       // all of them together, decode of an MJPEG frame included
+    int tiles;              // restart intervals found in it, 0 for one long scan
+};
+
+#define ENCODE_QUALITY_MIN  10
+#define ENCODE_QUALITY_MAX  90
+#define ENCODE_SCALE_MAX    4   // 320x240 goes down to 80x60 at most
+
+// The thumbnail that goes down ahead of a transmitted image, 40x30 from 320x240. A few hundred
+// bytes, so it's on the ground a handful of packets after the image is taken.
+#define THUMB_SCALE         8
+#define THUMB_QUALITY       40
+
+// Downlink copies are cut into tiles that decode on their own: a restart marker every so many
+// 16x16 blocks, picked so a tile comes out about TILE_BYTES. The ground fills a tile it lost a
+// packet of with grey and keeps going, instead of losing the rest of the image.
+#define TILE_BYTES          200     // two LoRa packets
+#define TILE_BLOCK          16      // one MCU with the encoder's 4:2:0 subsampling
+
+// A spinning can under a chute blurs most frames, so a command takes a burst of consecutive
+// frames, saves them all and only sends the best scoring one down.
+#define BURST_FRAMES        5
+#define SCORE_CLIP_LOW      8       // grey levels at or past these count as clipped
+#define SCORE_CLIP_HIGH     247
+
+int captureStart(int device, int width, int height, CaptureBackend backend = CAPTURE_AUTO);
+const Frame *captureLatest(int timeoutMs, uint32_t newerThan = 0);
+CaptureBackend captureBackend();
+const StageStats &captureStats();
+void captureStop();
+int frameEncode(const Frame &frame, std::vector<unsigned char> &out);
+int frameEncodeBudget(const Frame &frame, size_t budget, std::vector<unsigned char> &out, EncodeResult *result = NULL,
+                      size_t tileBytes = 0);
+int frameThumbnail(const Frame &frame, std::vector<unsigned char> &out);
+int frameSave(const Frame &frame, const char *filename);
+int frameScore(const Frame &frame, FrameScore *score);
+int frameHashDistance(uint64_t a, uint64_t b);
+void frameCopy(const Frame &frame, Frame &copy);
+
+#endif
@@ -0,0 +1,173 @@
+// capture-bench: how fast each capture path delivers frames and how much CPU it costs, with and
+// without the jpeg encode a save command does, and what squeezing a frame into a transmit
+// command's byte budget costs, in one piece and cut into tiles, and whether scoring frames for a
+// burst keeps up with the camera. Run it on the Duo, or on a desktop against a vivid or
+// v4l2loopback device (build with -DIMAGE_CAPTURE_HOST=ON).
+//
+// usage: capture-bench [device] [frames] [width] [height] [budget bytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "capture.h"
+
+static int64_t cpuUs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char *formatName(FrameFormat format){
+    switch (format) {
+        case FRAME_BGR:     return "BGR";
+        case FRAME_YUYV:    return "YUYV";
+        case FRAME_MJPEG:   return "MJPEG";
+    }
+    return "?";
+}
+
+//takes count frames off the capture thread, encoding each one if encode is set. CPU is for the
+//whole process, so it includes the capture thread's share.
+static void run(const char *name, int device, int count, int width, int height, CaptureBackend backend, bool encode){
+    if (captureStart(device, width, height, backend) != 0) {
+        printf("%-8s %-7s  not available\n", name, encode ? "+jpeg" : "");
+        return;
+    }
+
+    std::vector<unsigned char> jpeg;
+    const Frame *frame = captureLatest(5000);
+    if (frame == NULL) {
+        printf("%-8s %-7s  no frames\n", name, encode ? "+jpeg" : "");
+        captureStop();
+        return;
+    }
+
+    FrameFormat format = frame->format;
+    uint32_t firstSeq = frame->seq, lastSeq = frame->seq;
+    size_t jpegBytes = 0;
+    int got = 0;
+    int64_t wall0 = monotonicUs(), cpu0 = cpuUs();
+
+    while (got < count && (frame = captureLatest(2000, lastSeq)) != NULL) {
+        if (encode && frameEncode(*frame, jpeg) == 0) jpegBytes += jpeg.size();
+        lastSeq = frame->seq;
+        got++;
+    }
+
+    int64_t wall = monotonicUs() - wall0, cpu = cpuUs() - cpu0;
+    captureStop();
+
+    if (got == 0) {
+        printf("%-8s %-7s  stalled\n", name, encode ? "+jpeg" : "");
+        return;
+    }
+    printf("%-8s %-7s %-6s %7.1f fps %8.2f ms cpu/frame %6u captured %6d used %8zu bytes/jpeg\n",
+           name, encode ? "+jpeg" : "", formatName(format),
+           got * 1e6 / wall, cpu / 1000.0 / got, lastSeq - firstSeq, got,
+           encode ? jpegBytes / got : 0);
+}
+
+//frameEncodeBudget on count frames, which is what a transmit command does on top of the save
+static void runBudget(int device, int count, int width, int height, size_t budget, size_t tileBytes){
+    if (captureStart(device, width, height) != 0) {
+        printf("budget %zu  not available\n", budget);
+        return;
+    }
+
+    std::vector<unsigned char> jpeg;
+    const Frame *frame;
+    uint32_t lastSeq = 0;
+    int got = 0, over = 0, attempts = 0, quality = 0, scale = 0, tiles = 0;
+    size_t bytes = 0;
+    int64_t encodeUs = 0, worstUs = 0;
+
+    while (got < count && (frame = captureLatest(2000, lastSeq)) != NULL) {
+        EncodeResult r;
+        int status = frameEncodeBudget(*frame, budget, jpeg, &r, tileBytes);
+        lastSeq = frame->seq;
+        if (status < 0) break;
+        if (status > 0) over++;
+        attempts += r.attempts;
+        quality += r.quality;
+        scale += r.scale;
+        tiles += r.tiles;
+        bytes += r.bytes;
+        encodeUs += r.encodeUs;
+        if (r.encodeUs > worstUs) worstUs = r.encodeUs;
+        got++;
+    }
+    captureStop();
+
+    if (got == 0) {
+        printf("budget %zu  no frames\n", budget);
+        return;
+    }
+    printf("budget %6zu %8.2f ms/image (worst %.2f) %5.2f encodes q %4.1f scale 1/%.1f %8zu bytes %d over\n",
+           budget, encodeUs / 1000.0 / got, worstUs / 1000.0, (double)attempts / got,
+           (double)quality / got, (double)scale / got, bytes / got, over);
+    //the tiles all come out of one encode, so per tile is one encode's time split between them
+    if (tiles) {
+        printf("       %6.1f tiles of %4zu bytes, %8.1f us/tile\n", (double)tiles / got, bytes / tiles,
+               (double)encodeUs / attempts / ((double)tiles / got));
+    }
+}
+
+//frameScore on count frames against the time between them, a burst only gets consecutive frames
+//if scoring (and saving) fits in that gap
+static void runScore(const char *name, int device, int count, int width, int height, CaptureBackend backend){
+    if (captureStart(device, width, height, backend) != 0) {
+        printf("score %-8s  not available\n", name);
+        return;
+    }
+
+    const Frame *frame = captureLatest(5000);
+    uint32_t firstSeq = frame ? frame->seq : 0, lastSeq = firstSeq;
+    int got = 0;
+    int64_t scoreUs = 0, worstUs = 0;
+    double sharpness = 0;
+    int64_t wall0 = monotonicUs();
+
+    while (frame != NULL && got < count && (frame = captureLatest(2000, lastSeq)) != NULL) {
+        FrameScore s;
+        lastSeq = frame->seq;
+        if (frameScore(*frame, &s) != 0) break;
+        scoreUs += s.scoreUs;
+        if (s.scoreUs > worstUs) worstUs = s.scoreUs;
+        sharpness += s.sharpness;
+        got++;
+    }
+
+    int64_t wall = monotonicUs() - wall0;
+    captureStop();
+
+    if (got == 0) {
+        printf("score %-8s  no frames\n", name);
+        return;
+    }
+    printf("score %-8s %8.2f ms/frame (worst %.2f) %8.2f ms between frames, sharpness %.0f, %u of %u frames scored\n",
+           name, scoreUs / 1000.0 / got, worstUs / 1000.0, wall / 1000.0 / (lastSeq - firstSeq), sharpness / got,
+           got, lastSeq - firstSeq);
+}
+
+int main(int argc, char **argv){
+    int device = (argc > 1) ? atoi(argv[1]) : 0;
+    int count = (argc > 2) ? atoi(argv[2]) : 100;
+    int width = (argc > 3) ? atoi(argv[3]) : 320;
+    int height = (argc > 4) ? atoi(argv[4]) : 240;
+    size_t budget = (argc > 5) ? atoi(argv[5]) : 6000;
+
+    printf("/dev/video%d, %d frames at %dx%d\n", device, count, width, height);
+    run("v4l2", device, count, width, height, CAPTURE_V4L2, false);
+    run("v4l2", device, count, width, height, CAPTURE_V4L2, true);
+    run("opencv", device, count, width, height, CAPTURE_OPENCV, false);
+    run("opencv", device, count, width, height, CAPTURE_OPENCV, true);
+    runBudget(device, count, width, height, budget, 0);
+    runBudget(device, count, width, height, budget / 4, 0);
+    runBudget(device, count, width, height, budget, TILE_BYTES);
+    runBudget(device, count, width, height, budget / 4, TILE_BYTES);
+    runScore("v4l2", device, count, width, height, CAPTURE_V4L2);
+    runScore("opencv", device, count, width, height, CAPTURE_OPENCV);
+    return 0;
+}
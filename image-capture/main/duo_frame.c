@@ -0,0 +1,77 @@
+#include "duo_frame.h"
+
+#include <string.h>
+
+static uint16_t crc_table[256];
+
+static void crc_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint16_t c = i << 8;
+        for (int b = 0; b < 8; b++) {
+            c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+// CRC-16/CCITT-FALSE, start with crc 0xFFFF and pass the result back in to carry on
+uint16_t duo_crc16(const uint8_t *data, size_t len, uint16_t crc) {
+    if (crc_table[1] == 0) crc_init();
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc << 8) ^ crc_table[((crc >> 8) ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+// Builds the frame straight into out (DUO_ENCODED_MAX bytes) and COBS encodes it as it goes,
+// so there's no separate raw copy. Returns the bytes to send including the trailing 0x00, or 0
+// if the payload is too big.
+size_t duo_frame_encode(uint8_t type, const uint8_t *payload, size_t len, uint8_t *out) {
+    if (len > DUO_PAYLOAD_MAX) return 0;
+
+    uint8_t head[3] = { type, len & 0xFF, len >> 8 };
+    uint16_t crc = duo_crc16(head, sizeof(head), 0xFFFF);
+    crc = duo_crc16(payload, len, crc);
+    uint8_t tail[2] = { crc & 0xFF, crc >> 8 };
+
+    const uint8_t *parts[3] = { head, payload, tail };
+    size_t sizes[3] = { sizeof(head), len, sizeof(tail) };
+
+    // out[code] holds the distance to the next zero, filled in once we get there
+    size_t code = 0, o = 1;
+    for (int p = 0; p < 3; p++) {
+        for (size_t i = 0; i < sizes[p]; i++) {
+            uint8_t c = parts[p][i];
+            if (c != 0) out[o++] = c;
+            if (c == 0 || o - code == 0xFF) {
+                out[code] = o - code;
+                code = o++;
+            }
+        }
+    }
+    out[code] = o - code;
+    out[o++] = 0;
+    return o;
+}
+
+// Decodes one frame in place. buf is everything between two 0x00s (without them). On success
+// points payload into buf and returns 0, returns -1 for anything mangled.
+int duo_frame_decode(uint8_t *buf, size_t len, uint8_t *type, const uint8_t **payload, size_t *payload_len) {
+    size_t in = 0, out = 0;
+    while (in < len) {
+        uint8_t code = buf[in++];
+        if (code == 0 || in + code - 1 > len) return -1;
+        for (uint8_t i = 1; i < code; i++) buf[out++] = buf[in++];
+        if (code != 0xFF && in < len) buf[out++] = 0;
+    }
+
+    if (out < 5) return -1;
+    size_t n = duo_get16(buf + 1);
+    if (n + 5 != out) return -1;
+    if (duo_crc16(buf, 3 + n, 0xFFFF) != duo_get16(buf + 3 + n)) return -1;
+
+    *type = buf[0];
+    *payload = buf + 3;
+    *payload_len = n;
+    return 0;
+}
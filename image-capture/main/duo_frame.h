@@ -0,0 +1,70 @@
+#ifndef DUO_FRAME_H
+#define DUO_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Framing for the flight computer <-> Duo uart. The same file is built on both ends
+// (flight-system/main and image-capture/main), keep the two copies identical.
+//
+// A frame is type u8 | len u16 | payload[len] | crc16 u16, little endian, with the crc
+// (CRC-16/CCITT-FALSE) over everything before it. That gets COBS encoded so it has no zero bytes
+// in it and a 0x00 goes after it, so a receiver that starts mid-stream or loses bytes just
+// throws away everything up to the next 0x00 and carries on from there.
+#define DUO_BAUD                921600
+#define DUO_PAYLOAD_MAX         1100
+#define DUO_RAW_MAX             (3 + DUO_PAYLOAD_MAX + 2)
+#define DUO_ENCODED_MAX         (DUO_RAW_MAX + DUO_RAW_MAX / 254 + 2)  // COBS overhead and the 0x00
+
+typedef enum {
+    DUO_CMD     = 'C',  // esp -> duo: op u8, then the op's arguments
+    DUO_ACK     = 'A',  // duo -> esp: op u8 | status u8 (0 done, 1 failed)
+    DUO_GPS     = 'G',  // duo -> esp: position text, G:{LAT:{...}:LON{...}:}:
+    DUO_IMAGE   = 'I',  // duo -> esp: image u16 | offset u32 | total u32 | data
+    DUO_SAME    = 'S',  // duo -> esp: image u16 | same as u16 | distance u8, sent instead of an image
+                        // that looks like one that already went down
+} duo_type_t;
+
+typedef enum {
+    DUO_OP_SAVE = 1,    // flight ms u32
+    DUO_OP_TRANSMIT,    // budget u32, the most bytes the image can be (0 for no limit) | flight ms u32
+    DUO_OP_SHUTDOWN,
+    DUO_OP_RESEND,      // image u16 | offset u32
+} duo_op_t;
+
+// flight ms is the flight computer's clock when it sent the command, the same ms since boot its
+// reports are stamped with, so the Duo can tag images with it. Either end can leave it off.
+#define DUO_IMAGE_HEADER        10
+#define DUO_IMAGE_THUMB         0x8000  // set in the image number of an image's thumbnail
+
+uint16_t duo_crc16(const uint8_t *data, size_t len, uint16_t crc);
+size_t duo_frame_encode(uint8_t type, const uint8_t *payload, size_t len, uint8_t *out);
+int duo_frame_decode(uint8_t *buf, size_t len, uint8_t *type, const uint8_t **payload, size_t *payload_len);
+
+static inline void duo_put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void duo_put32(uint8_t *p, uint32_t v) {
+    duo_put16(p, v & 0xFFFF);
+    duo_put16(p + 2, v >> 16);
+}
+
+static inline uint16_t duo_get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t duo_get32(const uint8_t *p) {
+    return duo_get16(p) | ((uint32_t)duo_get16(p + 2) << 16);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,278 @@
+#include "encode.h"
+#include "duo_frame.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <vector>
+
+//CLOCK_REALTIME at a CLOCK_MONOTONIC time, for when a frame was captured
+static int64_t realtimeAt(int64_t monotonic){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - (monotonicUs() - monotonic);
+}
+
+//where the gps has us right now, for a record. No fix if it's gone stale.
+static PackFix currentFix(GpsReader &gps){
+    GpsFix g;
+    PackFix fix;
+    if (!gpsLatest(gps, g)) return fix;
+    fix.lat = g.lat;
+    fix.lon = g.lon;
+    fix.altCm = g.altCm;
+    fix.quality = g.quality;
+    fix.sats = g.sats;
+    return fix;
+}
+
+//take a burst of frames from the capture thread and put every one in the pack, they've already
+//been exposed and read out so each only costs the jpeg encode (or nothing, for MJPEG cameras).
+//Each is scored as it comes in, the best one goes in as image's PACK_IMAGE record and the rest
+//as PACK_BURST. best gets a copy of the best frame, bestScore its score and bestRec its record.
+static int captureImage(ImagePack &pack, uint32_t image, GpsReader &gps, const EncodeJob &job, Frame &best,
+                        FrameScore &bestScore, PackRecord &bestRec){
+    static std::vector<unsigned char> jpegs[BURST_FRAMES];
+    PackRecord recs[BURST_FRAMES];
+    int bestIndex = -1;
+    int got = 0;
+    uint32_t seq = 0;
+
+    for (int k = 0; k < BURST_FRAMES; k++) {
+        //each one newer than the last so no frame is in there twice
+        const Frame *frame = captureLatest(1000, seq);
+        if (frame == NULL) break;
+        seq = frame->seq;
+
+        FrameScore s;
+        if (frameEncode(*frame, jpegs[got]) != 0 || frameScore(*frame, &s) != 0) {
+            fprintf(stderr, "capture of frame %u failed\n", frame->seq);
+            continue;
+        }
+        fprintf(stderr, "frame %u: sharpness %.0f, mean %.0f, %.1f%% clipped, hash %016llx, scored in %lld us\n",
+                frame->seq, s.sharpness, s.mean, s.clipped * 100, (unsigned long long)s.hash, (long long)s.scoreUs);
+
+        PackRecord &rec = recs[got];
+        rec.image = image;
+        rec.burst = k;
+        rec.capturedUs = frame->capturedUs;
+        rec.realtimeUs = realtimeAt(frame->capturedUs);
+        rec.fix = currentFix(gps);
+        if (job.flightMs) rec.flightMs = job.flightMs + (uint32_t)((frame->capturedUs - job.queuedUs) / 1000);
+        rec.quality = (frame->format == FRAME_MJPEG) ? 0 : SAVE_QUALITY;
+        rec.score = (float)s.score;
+        if (bestIndex < 0 || s.score > bestScore.score) {
+            frameCopy(*frame, best);
+            bestScore = s;
+            bestIndex = got;
+        }
+        got++;
+    }
+
+    if (bestIndex < 0) {
+        fprintf(stderr, "capture of image %u failed\n", image);
+        return -1;
+    }
+    for (int k = 0; k < got; k++) {
+        recs[k].kind = (k == bestIndex) ? PACK_IMAGE : PACK_BURST;
+        if (packAppend(pack, recs[k], jpegs[k].data(), jpegs[k].size()) != 0) {
+            fprintf(stderr, "image %u didn't go in the pack\n", image);
+            return -1;
+        }
+    }
+    bestRec = recs[bestIndex];
+    fprintf(stderr, "frame %u of the burst is the best, captured %lld ms ago at %lld us\n", best.seq,
+            (long long)(monotonicUs() - best.capturedUs) / 1000, (long long)best.capturedUs);
+    return 0;
+}
+
+//the GEO_TAG comment segment for rec (see encode.h) in seg, returns how long it is
+static size_t geoTag(const PackRecord &rec, unsigned char *seg){
+    char *text = (char *)seg + 4;
+    int n = snprintf(text, GEO_TAG_MAX - 4, GEO_TAG "%d,%d,%d,%u,%u,%lld,%u", rec.fix.lat, rec.fix.lon,
+                     rec.fix.altCm, rec.fix.quality, rec.fix.sats, (long long)(rec.realtimeUs / 1000000), rec.flightMs);
+    if (n < 0 || n >= GEO_TAG_MAX - 4) n = GEO_TAG_MAX - 5;
+    seg[0] = 0xFF;
+    seg[1] = 0xFE;  // COM
+    seg[2] = (n + 2) >> 8;
+    seg[3] = (n + 2) & 0xFF;
+    return 4 + n;
+}
+
+//puts the segment straight after the SOI, where every decoder skips it
+static void addSegment(std::vector<unsigned char> &jpeg, const unsigned char *seg, size_t len){
+    if (jpeg.size() < 2 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return;
+    jpeg.insert(jpeg.begin() + 2, seg, seg + len);
+}
+
+//the copies of a frame that go down with a budget: a tiny thumbnail and the best tiled jpeg that
+//fits in what's left of the budget, so the ground can show something after a few packets and a
+//lost packet only costs it the tile it was in. They go in the pack as like's thumb and downlink,
+//both geotagged.
+static int downlinkCopies(ImagePack &pack, const Frame &frame, const PackRecord &like, size_t budget){
+    unsigned char tag[GEO_TAG_MAX];
+    size_t tagLen = geoTag(like, tag);
+
+    std::vector<unsigned char> small;
+    PackRecord thumb = like;
+    thumb.kind = PACK_THUMB;
+    thumb.quality = THUMB_QUALITY;
+    if (frameThumbnail(frame, small) == 0) addSegment(small, tag, tagLen);
+    if (small.empty() || packAppend(pack, thumb, small.data(), small.size()) != 0) {
+        fprintf(stderr, "thumbnail of %u failed\n", like.image);
+        return -1;
+    }
+    //the thumbnail comes out of the same budget, but never leave the real image less than half
+    budget = (small.size() < budget / 2) ? budget - small.size() : budget / 2;
+    fprintf(stderr, "thumbnail %zu bytes\n", small.size());
+
+    std::vector<unsigned char> jpeg;
+    EncodeResult r;
+    int status = frameEncodeBudget(frame, budget > tagLen ? budget - tagLen : 1, jpeg, &r, TILE_BYTES);
+    addSegment(jpeg, tag, tagLen);
+    PackRecord downlink = like;
+    downlink.kind = PACK_DOWNLINK;
+    downlink.quality = r.quality;
+    if (status < 0 || packAppend(pack, downlink, jpeg.data(), jpeg.size()) != 0) {
+        fprintf(stderr, "downlink copy of %u failed\n", like.image);
+        return -1;
+    }
+    fprintf(stderr, "downlink copy %zu of %zu bytes in %d tiles, quality %d at 1/%d size, %d encodes in %lld ms%s\n",
+            r.bytes, budget, r.tiles, r.quality, r.scale, r.attempts, (long long)r.encodeUs / 1000,
+            status ? " (over budget)" : "");
+    return 0;
+}
+
+//hashes of the last few images that went down, so one that looks just like any of them can be
+//left on the disk (see FrameScore::hash)
+struct Downlinked {
+    int image;
+    uint64_t hash;
+};
+static Downlinked downlinked[DEDUP_RECENT];
+static int downlinkedCount = 0, downlinkedNext = 0;
+
+//image number of a recent downlink that looks like hash, or -1
+static int lookalike(uint64_t hash, int *distance){
+    int found = -1;
+    *distance = DEDUP_DISTANCE + 1;
+    for (int k = 0; k < downlinkedCount; k++) {
+        int d = frameHashDistance(hash, downlinked[k].hash);
+        if (d < *distance) {
+            *distance = d;
+            found = downlinked[k].image;
+        }
+    }
+    return found;
+}
+
+static void rememberDownlink(int image, uint64_t hash){
+    downlinked[downlinkedNext].image = image;
+    downlinked[downlinkedNext].hash = hash;
+    downlinkedNext = (downlinkedNext + 1) % DEDUP_RECENT;
+    if (downlinkedCount < DEDUP_RECENT) downlinkedCount++;
+}
+
+static void runJob(Encoder &e, const EncodeJob &job, EncodeDone &d){
+    static Frame best; //best frame of the last burst
+    FrameScore score;
+    PackRecord rec;
+
+    d.op = job.op;
+    d.image = e.nextImage;
+    d.same = -1;
+    d.distance = 0;
+    d.copies = false;
+    d.queuedUs = job.queuedUs;
+    d.ok = captureImage(*e.pack, d.image, *e.gps, job, best, score, rec) == 0;
+
+    if (d.ok && job.op == DUO_OP_TRANSMIT) {
+        d.same = lookalike(score.hash, &d.distance);
+        if (d.same >= 0) {
+            fprintf(stderr, "%u looks like %d (%d bits off), not sending it\n", d.image, d.same, d.distance);
+        } else {
+            if (job.budget) {
+                d.ok = downlinkCopies(*e.pack, best, rec, job.budget) == 0;
+                d.copies = true;
+            }
+            if (d.ok) rememberDownlink(d.image, score.hash);
+        }
+    }
+    if (d.ok) e.nextImage++;
+}
+
+//takes jobs one at a time until it's stopped, sleeping on wakeFd whenever there aren't any
+static void encodeLoop(Encoder *encoder){
+    Encoder &e = *encoder;
+    while (!e.stopping) {
+        EncodeJob job;
+        if (!ringPop(e.jobs, job)) {
+            uint64_t count;
+            if (read(e.wakeFd, &count, sizeof(count)) < 0 && errno != EINTR) break;
+            continue;
+        }
+
+        int64_t start = monotonicUs();
+        EncodeDone d;
+        runJob(e, job, d);
+        int64_t now = monotonicUs();
+        stageDone(e.stats, 1, now - start, now - job.queuedUs);
+
+        //can't be full, the main loop never has more than ENCODE_QUEUE out
+        ringPush(e.done, d);
+        uint64_t one = 1;
+        if (write(e.eventFd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+int encoderStart(Encoder &e, ImagePack &pack, GpsReader &gps){
+    e.pack = &pack;
+    e.gps = &gps;
+    e.nextImage = pack.nextImage;
+    e.stopping = false;
+    e.inFlight = 0;
+    e.wakeFd = eventfd(0, EFD_CLOEXEC);
+    e.eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (e.wakeFd < 0 || e.eventFd < 0) {
+        fprintf(stderr, "encoder eventfd failed: %s\n", strerror(errno));
+        encoderStop(e);
+        return -1;
+    }
+    e.thread = std::thread(encodeLoop, &e);
+    return 0;
+}
+
+//queues a job for the encoder, false if it already has ENCODE_QUEUE on its hands
+bool encoderSubmit(Encoder &e, const EncodeJob &job){
+    if (e.inFlight >= ENCODE_QUEUE || !ringPush(e.jobs, job)) return false;
+    e.inFlight++;
+    uint64_t one = 1;
+    if (write(e.wakeFd, &one, sizeof(one)) < 0) {}
+    return true;
+}
+
+//next finished job, false once there aren't any. Clears the eventfd, so call it until it's false.
+bool encoderNext(Encoder &e, EncodeDone &done){
+    uint64_t count;
+    if (read(e.eventFd, &count, sizeof(count)) < 0) {}
+    if (!ringPop(e.done, done)) return false;
+    e.inFlight--;
+    return true;
+}
+
+//finishes the job in hand and stops, anything still queued is dropped
+void encoderStop(Encoder &e){
+    if (e.thread.joinable()) {
+        e.stopping = true;
+        uint64_t one = 1;
+        if (write(e.wakeFd, &one, sizeof(one)) < 0) {}
+        e.thread.join();
+    }
+    if (e.wakeFd >= 0) close(e.wakeFd);
+    if (e.eventFd >= 0) close(e.eventFd);
+    e.wakeFd = -1;
+    e.eventFd = -1;
+}
@@ -0,0 +1,82 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <thread>
+#include <atomic>
+
+#include "capture.h"
+#include "imgpack.h"
+#include "gps.h"
+#include "stage.h"
+
+// The encode stage (see stage.h). Saves and transmits take a burst, score it, jpeg every frame
+// and put them in the pack, and a transmit makes the downlink copies too. That's seconds of work
+// on the C906, so it's done on its own thread and the main loop carries on streaming the last
+// image to the esp meanwhile.
+//
+// The main loop hands over an EncodeJob per command and gets an EncodeDone back for each, in the
+// same order, when the encoder's finished with it. The encoder's eventFd goes readable when
+// there's one waiting. At most ENCODE_QUEUE jobs can be waiting or in progress at once, a command
+// that comes in past that gets turned away instead of piling up.
+//
+// Image numbers are handed out here, carrying on from the pack's, and only move on when an
+// image makes it into the pack. Each frame of a burst is tagged with the gps fix as it was when
+// that frame was picked up, not when the command came in, and with the flight computer's clock
+// worked forward from the command to when the frame was captured.
+//
+// The downlink copies carry the same tags, as a GEO_TAG comment segment straight after the jpeg's
+// SOI: GEO:lat,lon,alt cm,fix,sats,unix s,flight ms with lat and lon in 1e-7 degrees and 0s
+// for anything that isn't known. It's in the first packet of the thumbnail, so the ground knows
+// where and when an image was taken before any of the picture is down.
+#define ENCODE_QUEUE    4
+#define SAVE_QUALITY    95      // what imencode uses when it isn't told
+#define GEO_TAG         "GEO:"
+#define GEO_TAG_MAX     96      // the whole segment, marker and length included
+
+//on the pad or after landing every transmit is the same picture again, minutes of airtime for
+//nothing. An image whose hash is within DEDUP_DISTANCE bits of one of the last DEDUP_RECENT that
+//went down gets a DUO_SAME instead, it's still saved here.
+#define DEDUP_RECENT    8
+#define DEDUP_DISTANCE  5
+
+struct EncodeJob {
+    uint8_t op;             // DUO_OP_SAVE or DUO_OP_TRANSMIT
+    size_t budget;          // how many bytes a transmitted image can be, 0 sends the full quality one
+    uint32_t flightMs;      // the flight computer's clock when it asked, 0 if it didn't say
+    int64_t queuedUs;       // when it asked
+};
+
+struct EncodeDone {
+    uint8_t op;
+    bool ok;
+    uint32_t image;
+    int same;               // image it looked like, so there's nothing to send, -1 if none
+    int distance;
+    bool copies;            // it's the thumbnail and downlink copy to send, not the image itself
+    int64_t queuedUs;
+};
+
+struct Encoder {
+    ImagePack *pack;
+    GpsReader *gps;
+    std::thread thread;
+    int wakeFd;             // eventfd the encoder sleeps on while there's nothing to do
+    int eventFd;            // eventfd that says there's something in done
+    std::atomic<bool> stopping;
+    Ring<EncodeJob, ENCODE_QUEUE> jobs;
+    Ring<EncodeDone, ENCODE_QUEUE> done;
+    int inFlight;           // main loop only, jobs that haven't come back yet
+    uint32_t nextImage;     // encoder only
+    StageStats stats;       // jobs done, latency from being queued
+
+    Encoder() : pack(NULL), gps(NULL), wakeFd(-1), eventFd(-1), stopping(false), inFlight(0), nextImage(0) {}
+};
+
+int encoderStart(Encoder &e, ImagePack &pack, GpsReader &gps);
+bool encoderSubmit(Encoder &e, const EncodeJob &job);
+bool encoderNext(Encoder &e, EncodeDone &done);
+void encoderStop(Encoder &e);
+
+#endif
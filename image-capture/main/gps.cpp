@@ -0,0 +1,257 @@
+#include "gps.h"
+#include "monotonic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static_assert(sizeof(GpsFix) % 4 == 0, "GpsFix is copied a word at a time");
+
+static int parse_comma_delimited_str(char *string, char **fields, int max_fields)
+{
+   int i = 0;
+   fields[i++] = string;
+   while ((i < max_fields) && NULL != (string = strchr(string, ','))) {
+      *string = '\0';
+      fields[i++] = ++string;
+   }
+   return --i;
+}
+
+//ddmm.mmmm (dddmm.mmmm for longitude) to 1e-7 degrees, negative for S and W
+static int32_t nmeaDegrees(const char *value, char hemisphere){
+    double v = atof(value);
+    int degrees = (int)(v / 100);
+    double d = degrees + (v - degrees * 100) / 60.0;
+    if (hemisphere == 'S' || hemisphere == 'W') d = -d;
+    return (int32_t)lround(d * 1e7);
+}
+
+//hhmmss.sss to milliseconds into the day
+static uint32_t nmeaTime(const char *value){
+    double v = atof(value);
+    int hms = (int)v;
+    return ((hms / 10000) * 3600 + (hms / 100 % 100) * 60 + hms % 100) * 1000 + (uint32_t)lround((v - hms) * 1000);
+}
+
+//xor of everything between the $ and the *
+static uint8_t nmeaChecksum(const char *body, size_t len){
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++) sum ^= (uint8_t)body[i];
+    return sum;
+}
+
+//the seqlock writer, see gps.h
+static void publish(GpsReader &g, const GpsFix &fix){
+    uint32_t words[GPS_FIX_WORDS];
+    memcpy(words, &fix, sizeof(fix));
+    uint32_t seq = g.seq.load(std::memory_order_relaxed);
+    g.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < GPS_FIX_WORDS; i++) g.words[i].store(words[i], std::memory_order_relaxed);
+    g.seq.store(seq + 2, std::memory_order_release);
+
+    uint64_t one = 1;
+    if (write(g.eventFd, &one, sizeof(one)) < 0) {}
+}
+
+//one whole sentence, $ to just before the \r\n. Returns true if it changed the fix.
+static bool parseSentence(GpsReader &g, char *line, GpsFix &fix){
+    //$<talker><type>,...*hh
+    char *star = strrchr(line, '*');
+    if (line[0] != '$' || star == NULL || strlen(star) < 3) return false;
+    if (nmeaChecksum(line + 1, star - line - 1) != (uint8_t)strtol(star + 1, NULL, 16)) {
+        g.bad++;
+        return false;
+    }
+    *star = '\0';
+    if (strlen(line) < 6) return false;
+
+    char *out[20];
+    int fields = parse_comma_delimited_str(line, out, 20);
+    const char *type = line + 3;
+
+    if (strncmp(type, "GGA", 3) == 0) {
+        //$GPGGA,time,lat,N,lon,E,fix,sats,hdop,alt,M,...
+        if (fields < 9) return false;
+        fix.utcMs = nmeaTime(out[1]);
+        fix.quality = (out[2][0] != '\0') ? atoi(out[6]) : 0;
+        fix.sats = atoi(out[7]);
+        if (fix.quality) {
+            fix.lat = nmeaDegrees(out[2], out[3][0]);
+            fix.lon = nmeaDegrees(out[4], out[5][0]);
+            fix.hdopCenti = (uint16_t)lround(atof(out[8]) * 100);
+            fix.altCm = (int32_t)lround(atof(out[9]) * 100);
+        }
+    } else if (strncmp(type, "RMC", 3) == 0) {
+        //$GPRMC,time,A/V,lat,N,lon,E,knots,course,ddmmyy,...
+        if (fields < 9) return false;
+        fix.utcMs = nmeaTime(out[1]);
+        if (out[9][0] != '\0') fix.date = atoi(out[9]);
+        if (out[2][0] == 'A') {
+            fix.lat = nmeaDegrees(out[3], out[4][0]);
+            fix.lon = nmeaDegrees(out[5], out[6][0]);
+            fix.speedCms = (int32_t)lround(atof(out[7]) * 51.4444);
+            fix.courseCdeg = (int32_t)lround(atof(out[8]) * 100);
+        }
+    } else if (strncmp(type, "VTG", 3) == 0) {
+        //$GPVTG,course,T,course,M,knots,N,km/h,K,...
+        if (fields < 7 || out[1][0] == '\0') return false;
+        fix.courseCdeg = (int32_t)lround(atof(out[1]) * 100);
+        fix.speedCms = (int32_t)lround(atof(out[7]) * 27.7778);
+    } else {
+        return false;
+    }
+    fix.updatedUs = monotonicUs();
+    fix.updates++;
+    return true;
+}
+
+//queue a PMTK command, the checksum gets worked out here
+static void queuePmtk(SerialPort &port, const char *body){
+    char line[GPS_LINE_MAX];
+    snprintf(line, sizeof(line), "$%s*%02X\r\n", body, nmeaChecksum(body, strlen(body)));
+    serialQueue(port, line);
+}
+
+//queue a UBX message, sync | class | id | len u16 | payload | Fletcher checksum over class to payload
+static void queueUbx(SerialPort &port, uint8_t cls, uint8_t id, const uint8_t *payload, uint16_t len){
+    uint8_t msg[6 + 16 + 2];
+    if (len > 16) return;
+    msg[0] = 0xB5;
+    msg[1] = 0x62;
+    msg[2] = cls;
+    msg[3] = id;
+    msg[4] = len & 0xFF;
+    msg[5] = len >> 8;
+    memcpy(msg + 6, payload, len);
+    uint8_t a = 0, b = 0;
+    for (int i = 2; i < 6 + len; i++) {
+        a += msg[i];
+        b += a;
+    }
+    msg[6 + len] = a;
+    msg[7 + len] = b;
+    serialQueue(port, msg, 8 + len);
+}
+
+//ask for a fix every GPS_RATE_MS with just GGA and RMC, see gps.h
+static void configureReceiver(SerialPort &port){
+    //u-blox: CFG-RATE, then CFG-MSG to set how often each NMEA sentence comes out
+    uint8_t rate[6] = { GPS_RATE_MS & 0xFF, GPS_RATE_MS >> 8, 1, 0, 1, 0 };
+    queueUbx(port, 0x06, 0x08, rate, sizeof(rate));
+    const uint8_t sentences[6][2] = { {0x00, 1}, {0x01, 0}, {0x02, 0}, {0x03, 0}, {0x04, 1}, {0x05, 0} };  // GGA GLL GSA GSV RMC VTG
+    for (int i = 0; i < 6; i++) {
+        uint8_t msg[3] = { 0xF0, sentences[i][0], sentences[i][1] };
+        queueUbx(port, 0x06, 0x01, msg, sizeof(msg));
+    }
+
+    //MediaTek: PMTK314 is GLL RMC VTG GGA GSA GSV and a lot of things nobody sends
+    queuePmtk(port, "PMTK314,0,1,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0");
+    char body[32];
+    snprintf(body, sizeof(body), "PMTK220,%d", GPS_RATE_MS);
+    queuePmtk(port, body);
+}
+
+static void gpsLoop(GpsReader *reader){
+    GpsReader &g = *reader;
+    SerialPort &port = *g.port;
+    GpsFix fix;
+    memset(&fix, 0, sizeof(fix));
+    char line[GPS_LINE_MAX];
+    size_t len = 0;
+    bool inLine = false;
+
+    configureReceiver(port);
+    while (!g.stopping) {
+        //wakes up now and then to see if it's been stopped
+        struct pollfd pfd;
+        pfd.fd = port.fd;
+        pfd.events = POLLIN | (serialTxPending(port) ? POLLOUT : 0);
+        pfd.revents = 0;
+        int n = poll(&pfd, 1, 200);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "gps poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (n <= 0) continue;
+        if ((pfd.revents & POLLOUT) && serialWrite(port) < 0) break;
+        if (!(pfd.revents & (POLLIN | POLLERR | POLLHUP))) continue;
+        if (serialRead(port) < 0) break;
+
+        bool changed = false;
+        for (size_t i = 0; i < port.rx.size(); i++) {
+            char c = port.rx[i];
+            if (c == '$') {
+                //a $ always starts a new one, whatever came before it was cut short
+                inLine = true;
+                len = 0;
+            } else if (!inLine) {
+                continue;
+            } else if (c == '\r' || c == '\n') {
+                line[len] = '\0';
+                changed |= parseSentence(g, line, fix);
+                inLine = false;
+                continue;
+            } else if (len + 1 >= sizeof(line)) {
+                //too long to be NMEA, skip to the next $
+                inLine = false;
+                continue;
+            }
+            line[len++] = c;
+        }
+        port.rx.clear();
+        if (changed) publish(g, fix);
+    }
+}
+
+int gpsStart(GpsReader &g, SerialPort &port){
+    g.port = &port;
+    g.stopping = false;
+    g.eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g.eventFd < 0) {
+        fprintf(stderr, "gps eventfd failed: %s\n", strerror(errno));
+        return -1;
+    }
+    g.thread = std::thread(gpsLoop, &g);
+    return 0;
+}
+
+//copies out the latest fix (see gps.h), true if it's a real one and recent
+bool gpsLatest(GpsReader &g, GpsFix &fix){
+    uint32_t words[GPS_FIX_WORDS];
+    uint32_t before, after;
+    while (true) {
+        before = g.seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            //the gps thread's part way through, let it finish
+            sched_yield();
+            continue;
+        }
+        for (size_t i = 0; i < GPS_FIX_WORDS; i++) words[i] = g.words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = g.seq.load(std::memory_order_relaxed);
+        if (before == after) break;
+    }
+    memcpy(&fix, words, sizeof(fix));
+    return fix.quality != 0 && monotonicUs() - fix.updatedUs < (int64_t)GPS_STALE_MS * 1000;
+}
+
+//clears the eventfd, gpsLatest has whatever woke it
+void gpsEvents(GpsReader &g){
+    uint64_t count;
+    while (read(g.eventFd, &count, sizeof(count)) == sizeof(count)) {}
+}
+
+void gpsStop(GpsReader &g){
+    g.stopping = true;
+    if (g.thread.joinable()) g.thread.join();
+    if (g.eventFd >= 0) close(g.eventFd);
+    g.eventFd = -1;
+}
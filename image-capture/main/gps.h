@@ -0,0 +1,67 @@
+#ifndef GPS_H
+#define GPS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <thread>
+#include <atomic>
+
+#include "serial.h"
+
+// The gps uart gets a thread of its own that does nothing but read it. Bytes go through a line
+// assembler a byte at a time, so a sentence split across reads or one that starts mid-stream
+// is no problem, and anything without a good checksum is thrown away. GGA, RMC and VTG from any
+// talker (GP, GN, GL...) go into one GpsFix.
+//
+// The latest fix is published through a seqlock: the gps thread bumps seq to odd, writes the fix,
+// bumps it back to even, and gpsLatest copies the fix out and tries again if seq moved while it
+// was copying. Neither side ever takes a lock, so the encoder can look at it for every frame of a
+// burst and the main loop every time one comes in.
+//
+// At startup the receiver is asked for a fix every GPS_RATE_MS and only GGA and RMC, in both
+// u-blox (UBX) and MediaTek (PMTK) speak since we don't know which one will be on the board, each
+// ignores the other's. At 9600 baud that's most of the uart at 5 Hz, VTG is dropped to fit (RMC
+// has the same speed and course) but gets used if a receiver sends it anyway. One that ignores
+// both carries on at its default rate, which works too, just less often.
+#define GPS_RATE_MS     200
+#define GPS_STALE_MS    3000    // a fix older than this doesn't count
+#define GPS_LINE_MAX    100     // NMEA says 82 with the $ and \r\n
+
+struct GpsFix {
+    int32_t lat;            // 1e-7 degrees, negative south
+    int32_t lon;            // 1e-7 degrees, negative west
+    int32_t altCm;          // above mean sea level
+    int32_t speedCms;       // over the ground
+    int32_t courseCdeg;     // true track, hundredths of a degree
+    uint32_t utcMs;         // time of day of the fix
+    uint32_t date;          // ddmmyy from RMC, 0 until there's been one
+    uint16_t hdopCenti;
+    uint8_t quality;        // GGA fix quality, 0 for no fix
+    uint8_t sats;
+    int64_t updatedUs;      // CLOCK_MONOTONIC of the last sentence that went into it
+    uint32_t updates;       // sentences that went into it
+    uint32_t pad;
+};
+
+#define GPS_FIX_WORDS   (sizeof(GpsFix) / 4)
+
+struct GpsReader {
+    SerialPort *port;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    int eventFd;            // goes readable every time a new fix is published
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> words[GPS_FIX_WORDS];     // the GpsFix, a word at a time
+    std::atomic<uint32_t> bad;                      // sentences that failed their checksum
+
+    GpsReader() : port(NULL), stopping(false), eventFd(-1), seq(0), bad(0) {
+        for (size_t i = 0; i < GPS_FIX_WORDS; i++) words[i] = 0;
+    }
+};
+
+int gpsStart(GpsReader &g, SerialPort &port);
+bool gpsLatest(GpsReader &g, GpsFix &fix);
+void gpsEvents(GpsReader &g);
+void gpsStop(GpsReader &g);
+
+#endif
@@ -0,0 +1,422 @@
+#include "imgpack.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <string>
+#include <chrono>
+
+//zlib's crc32, so a pack can be checked with anything that has it
+uint32_t packCrc32(const void *data, size_t len, uint32_t crc){
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put16(uint8_t *p, uint16_t v){
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v){
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v){
+    put32(p, (uint32_t)v);
+    put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get16(const uint8_t *p){
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p){
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t *p){
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static void encodeHeader(const PackRecord &rec, uint8_t *h){
+    memset(h, 0, PACK_HEADER_BYTES);
+    put32(h, PACK_MAGIC);
+    put16(h + 4, PACK_HEADER_BYTES);
+    h[6] = rec.kind;
+    h[7] = rec.burst;
+    put32(h + 8, rec.image);
+    put32(h + 12, rec.size);
+    put32(h + 16, rec.crc);
+    put64(h + 20, rec.realtimeUs);
+    put64(h + 28, rec.capturedUs);
+    put32(h + 36, rec.fix.lat);
+    put32(h + 40, rec.fix.lon);
+    put32(h + 44, rec.fix.altCm);
+    h[48] = rec.fix.quality;
+    h[49] = rec.fix.sats;
+    h[50] = rec.quality;
+    uint32_t score;
+    memcpy(&score, &rec.score, sizeof(score));
+    put32(h + 52, score);
+    put32(h + 56, rec.flightMs);
+    put32(h + 60, packCrc32(h, 60));
+}
+
+//false if it isn't a header, or one that got mangled
+static bool decodeHeader(const uint8_t *h, PackRecord &rec){
+    if (get32(h) != PACK_MAGIC || get16(h + 4) != PACK_HEADER_BYTES) return false;
+    if (get32(h + 60) != packCrc32(h, 60)) return false;
+    rec.kind = h[6];
+    rec.burst = h[7];
+    rec.image = get32(h + 8);
+    rec.size = get32(h + 12);
+    rec.crc = get32(h + 16);
+    rec.realtimeUs = (int64_t)get64(h + 20);
+    rec.capturedUs = (int64_t)get64(h + 28);
+    rec.fix.lat = (int32_t)get32(h + 36);
+    rec.fix.lon = (int32_t)get32(h + 40);
+    rec.fix.altCm = (int32_t)get32(h + 44);
+    rec.fix.quality = h[48];
+    rec.fix.sats = h[49];
+    rec.quality = h[50];
+    uint32_t score = get32(h + 52);
+    memcpy(&rec.score, &score, sizeof(score));
+    rec.flightMs = get32(h + 56);
+    return true;
+}
+
+static void encodeIndex(const PackEntry &e, uint8_t *b){
+    memset(b, 0, PACK_INDEX_BYTES);
+    put32(b, e.image);
+    b[4] = e.kind;
+    b[5] = e.burst;
+    put64(b + 8, e.offset);
+    put32(b + 16, e.size);
+    put32(b + 20, packCrc32(b, 20));
+}
+
+static bool readAll(int fd, void *buf, size_t len, uint64_t offset){
+    uint8_t *p = (uint8_t *)buf;
+    while (len) {
+        ssize_t got = pread(fd, p, len, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        p += got;
+        len -= got;
+        offset += got;
+    }
+    return true;
+}
+
+static int writeAll(int fd, const void *buf, size_t len){
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len) {
+        ssize_t put = write(fd, p, len);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return -1;
+        p += put;
+        len -= put;
+    }
+    return 0;
+}
+
+//the record at offset, header and data. -1 if there isn't a whole good one there.
+int packReadRecord(int fd, uint64_t offset, uint64_t fileSize, PackRecord &rec, std::vector<unsigned char> &data){
+    uint8_t h[PACK_HEADER_BYTES];
+    if (offset + PACK_HEADER_BYTES > fileSize || !readAll(fd, h, sizeof(h), offset)) return -1;
+    if (!decodeHeader(h, rec) || offset + PACK_HEADER_BYTES + rec.size > fileSize) return -1;
+    data.resize(rec.size);
+    if (rec.size && !readAll(fd, data.data(), rec.size, offset + PACK_HEADER_BYTES)) return -1;
+    if (packCrc32(data.data(), rec.size) != rec.crc) return -1;
+    rec.offset = offset;
+    return 0;
+}
+
+static void addEntry(ImagePack &p, const PackRecord &rec){
+    PackEntry e;
+    e.image = rec.image;
+    e.kind = rec.kind;
+    e.burst = rec.burst;
+    e.offset = rec.offset;
+    e.size = rec.size;
+    p.entries.push_back(e);
+    if (rec.image >= p.nextImage) p.nextImage = rec.image + 1;
+}
+
+static void writerLoop(ImagePack *pack);
+
+//opens the pack at path (making it if it isn't there), reads what's in it from the index and
+//then the pack itself, and cuts off a record a crash left half written
+int packOpen(ImagePack &p, const char *path){
+    std::string indexPath = std::string(path) + ".idx";
+    p.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    p.indexFd = open(indexPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat st, ist;
+    if (p.fd < 0 || p.indexFd < 0 || fstat(p.fd, &st) != 0 || fstat(p.indexFd, &ist) != 0) {
+        fprintf(stderr, "couldn't open %s: %s\n", path, strerror(errno));
+        packClose(p);
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    p.entries.clear();
+    p.nextImage = 0;
+
+    //the index as far as it agrees with the pack, every record starting where the last ended
+    uint64_t end = 0;
+    std::vector<uint8_t> index(ist.st_size);
+    if (!index.empty() && !readAll(p.indexFd, index.data(), index.size(), 0)) index.clear();
+    for (size_t at = 0; at + PACK_INDEX_BYTES <= index.size(); at += PACK_INDEX_BYTES) {
+        const uint8_t *b = &index[at];
+        PackRecord rec;
+        rec.image = get32(b);
+        rec.kind = b[4];
+        rec.burst = b[5];
+        rec.offset = get64(b + 8);
+        rec.size = get32(b + 16);
+        if (get32(b + 20) != packCrc32(b, 20) || rec.offset != end || end + PACK_HEADER_BYTES + rec.size > size) break;
+        addEntry(p, rec);
+        end += PACK_HEADER_BYTES + rec.size;
+    }
+    size_t indexed = p.entries.size();
+
+    //then whatever the index hadn't caught up with
+    std::vector<unsigned char> data;
+    PackRecord rec;
+    while (packReadRecord(p.fd, end, size, rec, data) == 0) {
+        addEntry(p, rec);
+        end += PACK_HEADER_BYTES + rec.size;
+    }
+
+    if (end < size) {
+        fprintf(stderr, "%s: cutting off %llu bytes that didn't get written properly\n", path,
+                (unsigned long long)(size - end));
+        if (ftruncate(p.fd, end) != 0) {
+            fprintf(stderr, "couldn't truncate %s: %s\n", path, strerror(errno));
+            packClose(p);
+            return -1;
+        }
+        fdatasync(p.fd);
+    }
+
+    //bring the index back in line, it's only a shortcut so it doesn't matter if this fails
+    if (index.size() != indexed * PACK_INDEX_BYTES || indexed != p.entries.size()) {
+        if (ftruncate(p.indexFd, indexed * PACK_INDEX_BYTES) == 0) {
+            std::vector<uint8_t> extra((p.entries.size() - indexed) * PACK_INDEX_BYTES);
+            for (size_t i = indexed; i < p.entries.size(); i++) {
+                encodeIndex(p.entries[i], &extra[(i - indexed) * PACK_INDEX_BYTES]);
+            }
+            writeAll(p.indexFd, extra.data(), extra.size());
+        }
+    }
+
+    p.eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (p.eventFd < 0) {
+        fprintf(stderr, "couldn't make an eventfd: %s\n", strerror(errno));
+        packClose(p);
+        return -1;
+    }
+    p.written = end;
+    p.queue.clear();
+    p.queuedBytes = 0;
+    p.urgent = false;
+    p.stopping = false;
+    p.writer = std::thread(writerLoop, &p);
+    fprintf(stderr, "%s: %zu records (%zu from the index), next image %u\n", path, p.entries.size(), indexed,
+            p.nextImage);
+    return 0;
+}
+
+//queues a record for the writer, filling in rec's size and crc. It's findable straight away but
+//its offset is PACK_UNWRITTEN until it's on the card.
+int packAppend(ImagePack &p, PackRecord &rec, const void *data, size_t len){
+    if (p.fd < 0) return -1;
+    rec.size = len;
+    rec.crc = packCrc32(data, len);
+    rec.offset = PACK_UNWRITTEN;
+
+    std::lock_guard<std::mutex> lock(p.lock);
+    //the card's behind, make room. The rest of a burst is only there in case the best frame
+    //wasn't, so that goes before anything else does.
+    size_t need = PACK_HEADER_BYTES + len;
+    while (!p.queue.empty() && p.queuedBytes + need > PACK_QUEUE_BYTES) {
+        std::deque<PackQueued>::iterator victim = p.queue.begin();
+        for (std::deque<PackQueued>::iterator q = p.queue.begin(); q != p.queue.end(); ++q) {
+            if (q->rec.kind == PACK_BURST) {
+                victim = q;
+                break;
+            }
+        }
+        fprintf(stderr, "pack: %zu bytes waiting, dropping image %u kind %u\n", p.queuedBytes, victim->rec.image,
+                victim->rec.kind);
+        p.entries[victim->entry].offset = PACK_DROPPED;
+        p.queuedBytes -= PACK_HEADER_BYTES + victim->data.size();
+        p.queue.erase(victim);
+        p.dropped++;
+    }
+
+    if (p.queue.empty()) p.queuedSince = monotonicUs();
+    addEntry(p, rec);
+    p.queue.push_back(PackQueued());
+    PackQueued &q = p.queue.back();
+    q.rec = rec;
+    q.data.assign((const unsigned char *)data, (const unsigned char *)data + len);
+    q.entry = p.entries.size() - 1;
+    p.queuedBytes += need;
+    if (p.queuedBytes >= PACK_BATCH_BYTES) p.wake.notify_one();
+    return 0;
+}
+
+//writes out whatever's queued without waiting for a full batch, for when something needs it on
+//the card. Doesn't wait for it either, the eventfd says when it's there.
+void packFlush(ImagePack &p){
+    std::lock_guard<std::mutex> lock(p.lock);
+    if (p.queue.empty()) return;
+    p.urgent = true;
+    p.wake.notify_one();
+}
+
+//clears the eventfd once the batches it was woken for have been dealt with
+void packEvents(ImagePack &p){
+    uint64_t count;
+    while (read(p.eventFd, &count, sizeof(count)) == sizeof(count)) {}
+}
+
+//writes one batch, in one go, and waits for the card to have it. Offsets are only handed out here
+//so dropping a queued record never leaves a hole. Returns false with nothing changed if the write
+//failed, whatever made it is cut back off.
+static bool writeBatch(ImagePack &p, std::deque<PackQueued> &batch, uint64_t at){
+    static std::vector<unsigned char> buf, index;
+    buf.clear();
+    index.clear();
+    for (size_t i = 0; i < batch.size(); i++) {
+        PackQueued &q = batch[i];
+        q.rec.offset = at + buf.size();
+        size_t h = buf.size();
+        buf.resize(h + PACK_HEADER_BYTES);
+        encodeHeader(q.rec, &buf[h]);
+        buf.insert(buf.end(), q.data.begin(), q.data.end());
+
+        PackEntry e;
+        e.image = q.rec.image;
+        e.kind = q.rec.kind;
+        e.burst = q.rec.burst;
+        e.offset = q.rec.offset;
+        e.size = q.rec.size;
+        index.resize(index.size() + PACK_INDEX_BYTES);
+        encodeIndex(e, &index[index.size() - PACK_INDEX_BYTES]);
+    }
+
+    int64_t start = monotonicUs();
+    if (writeAll(p.fd, buf.data(), buf.size()) != 0 || fdatasync(p.fd) != 0) {
+        fprintf(stderr, "pack write failed: %s\n", strerror(errno));
+        if (ftruncate(p.fd, at) != 0) fprintf(stderr, "pack truncate failed: %s\n", strerror(errno));
+        return false;
+    }
+    writeAll(p.indexFd, index.data(), index.size());
+    fprintf(stderr, "pack: wrote %zu records, %zu bytes in %lld ms\n", batch.size(), buf.size(),
+            (long long)(monotonicUs() - start) / 1000);
+    return true;
+}
+
+//waits for a batch's worth (or for the oldest record to have waited PACK_BATCH_MS, or for
+//packFlush) and writes it with the lock let go, so appends carry on while the card's busy
+static void writerLoop(ImagePack *pack){
+    ImagePack &p = *pack;
+    std::deque<PackQueued> batch;
+    std::unique_lock<std::mutex> lock(p.lock);
+
+    while (true) {
+        if (p.queue.empty()) {
+            if (p.stopping) break;
+            p.wake.wait(lock);
+            continue;
+        }
+        if (!p.urgent && !p.stopping && p.queuedBytes < PACK_BATCH_BYTES) {
+            int64_t left = p.queuedSince + (int64_t)PACK_BATCH_MS * 1000 - monotonicUs();
+            if (left > 0 && p.wake.wait_for(lock, std::chrono::microseconds(left)) == std::cv_status::no_timeout) continue;
+        }
+        if (p.queue.empty()) continue;
+
+        batch.swap(p.queue);
+        p.queuedBytes = 0;
+        p.urgent = false;
+        uint64_t at = p.written;
+        int64_t since = p.queuedSince;
+        lock.unlock();
+        int64_t start = monotonicUs();
+        bool ok = writeBatch(p, batch, at);
+        if (ok) {
+            int64_t now = monotonicUs();
+            stageDone(p.stats, batch.size(), now - start, now - since);
+        }
+        lock.lock();
+
+        if (ok) {
+            for (size_t i = 0; i < batch.size(); i++) {
+                p.entries[batch[i].entry].offset = batch[i].rec.offset;
+                p.written = batch[i].rec.offset + PACK_HEADER_BYTES + batch[i].rec.size;
+            }
+            batch.clear();
+            uint64_t one = 1;
+            if (write(p.eventFd, &one, sizeof(one)) < 0) {}
+        } else if (p.stopping) {
+            fprintf(stderr, "pack: giving up on %zu records\n", batch.size());
+            batch.clear();
+        } else {
+            //put it back in front of anything that came in meanwhile and give the card a second
+            for (size_t i = 0; i < p.queue.size(); i++) batch.push_back(p.queue[i]);
+            p.queue.swap(batch);
+            batch.clear();
+            p.queuedBytes = 0;
+            for (size_t i = 0; i < p.queue.size(); i++) p.queuedBytes += PACK_HEADER_BYTES + p.queue[i].data.size();
+            p.queuedSince = monotonicUs();
+            p.wake.wait_for(lock, std::chrono::seconds(1));
+        }
+    }
+}
+
+//newest record of image of that kind, comparing only the bits in mask
+bool packFind(ImagePack &p, uint32_t image, uint8_t kind, PackEntry &found, uint32_t mask){
+    std::lock_guard<std::mutex> lock(p.lock);
+    for (size_t i = p.entries.size(); i-- > 0;) {
+        const PackEntry &e = p.entries[i];
+        if (e.kind == kind && ((e.image ^ image) & mask) == 0) {
+            found = e;
+            return true;
+        }
+    }
+    return false;
+}
+
+//writes out everything that's queued and stops the writer
+void packClose(ImagePack &p){
+    if (p.writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(p.lock);
+            p.stopping = true;
+            p.wake.notify_one();
+        }
+        p.writer.join();
+    }
+    if (p.fd >= 0) close(p.fd);
+    if (p.indexFd >= 0) close(p.indexFd);
+    if (p.eventFd >= 0) close(p.eventFd);
+    p.fd = -1;
+    p.indexFd = -1;
+    p.eventFd = -1;
+}
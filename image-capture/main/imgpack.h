@@ -0,0 +1,134 @@
+#ifndef IMGPACK_H
+#define IMGPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "stage.h"
+
+// Every image goes into one append-only pack file instead of a file each, so a save doesn't pay
+// for creating a file on the SD card and image numbers carry on from the last run instead of
+// starting at 0 and writing over it.
+//
+// A record is a PACK_HEADER_BYTES header and then the jpeg, little endian:
+//   magic u32 | header bytes u16 | kind u8 | burst u8 | image u32 | size u32 | data crc u32 |
+//   realtime us i64 | monotonic us i64 | lat i32 | lon i32 | alt cm i32 | fix u8 | sats u8 |
+//   quality u8 | 0 u8 | score f32 | flight ms u32 | header crc u32
+// lat and lon are in 1e-7 degrees, fix is the GGA fix quality (0 for none), quality the jpeg's
+// (0 if the camera made it) and score the burst's sharpness score. flight ms is the flight
+// computer's clock (ms since it booted, what its reports are stamped with) when the frame was
+// captured, 0 if it didn't say. The crcs are zlib's crc32,
+// the header one covers everything before it.
+//
+// packAppend only queues a record, a writer thread writes them PACK_BATCH_BYTES or PACK_BATCH_MS
+// at a time with one write and one fdatasync for the lot, so nothing that appends ever waits on
+// the SD card. A record's offset isn't known until it's been written (PACK_UNWRITTEN until then)
+// and the pack's eventfd goes readable every time a batch is done. If the card falls behind and
+// more than PACK_QUEUE_BYTES is waiting, records are dropped to make room, the rest of a burst
+// first and then the oldest.
+//
+// If the power goes part way through a write, the record that didn't make it fails its crc when
+// the pack is next opened and gets cut off along with anything after it, everything before it is
+// fine.
+//
+// <pack>.idx has image u32 | kind u8 | burst u8 | 0 u16 | offset u64 | size u32 | crc u32 per
+// record so opening doesn't have to read the whole pack. It's only a shortcut, it isn't synced
+// and whatever it's missing gets found by scanning the pack from where it stops.
+#define PACK_MAGIC          0x52474D49  // "IMGR"
+#define PACK_HEADER_BYTES   64
+#define PACK_INDEX_BYTES    24
+#define PACK_BATCH_BYTES    (256 * 1024)
+#define PACK_BATCH_MS       2000
+#define PACK_QUEUE_BYTES    (2 * 1024 * 1024)
+#define PACK_UNWRITTEN      UINT64_MAX          // PackEntry offsets for records not on the card
+#define PACK_DROPPED        (UINT64_MAX - 1)
+
+enum PackKind {
+    PACK_IMAGE = 0,         // the best frame of a burst, what a save or transmit is about
+    PACK_BURST,             // the rest of the burst
+    PACK_DOWNLINK,          // copy squeezed into the esp's byte budget
+    PACK_THUMB              // goes down ahead of the downlink copy
+};
+
+struct PackFix {
+    int32_t lat;
+    int32_t lon;
+    int32_t altCm;
+    uint8_t quality;        // 0 for no fix
+    uint8_t sats;
+
+    PackFix() : lat(0), lon(0), altCm(0), quality(0), sats(0) {}
+};
+
+struct PackRecord {
+    uint8_t kind;
+    uint8_t burst;          // where the frame was in its burst
+    uint32_t image;
+    uint32_t size;          // packAppend fills in size and crc
+    uint32_t crc;
+    int64_t realtimeUs;     // CLOCK_REALTIME when the frame was captured
+    int64_t capturedUs;     // CLOCK_MONOTONIC, same as Frame::capturedUs
+    PackFix fix;
+    uint8_t quality;
+    float score;
+    uint32_t flightMs;
+    uint64_t offset;        // where the header starts in the pack, once it's been written
+
+    PackRecord() : kind(PACK_IMAGE), burst(0), image(0), size(0), crc(0), realtimeUs(0), capturedUs(0),
+                   quality(0), score(0), flightMs(0), offset(0) {}
+};
+
+// what's kept in memory for every record
+struct PackEntry {
+    uint32_t image;
+    uint8_t kind;
+    uint8_t burst;
+    uint64_t offset;
+    uint32_t size;
+};
+
+struct PackQueued {
+    PackRecord rec;
+    std::vector<unsigned char> data;
+    size_t entry;           // its place in entries
+};
+
+// written and everything after it is shared with the writer thread and guarded by lock
+struct ImagePack {
+    int fd;
+    int indexFd;
+    int eventFd;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake;
+    uint64_t written;       // bytes of the pack that are on disk
+    std::deque<PackQueued> queue;           // records waiting to be written
+    size_t queuedBytes;
+    int64_t queuedSince;    // monotonicUs() when the oldest of them was added
+    bool urgent;            // write what's queued without waiting for a full batch
+    bool stopping;
+    std::vector<PackEntry> entries;
+    uint32_t nextImage;     // one past the highest image number in the pack
+    uint32_t dropped;
+    StageStats stats;       // records written, latency from the oldest in a batch being queued
+
+    ImagePack() : fd(-1), indexFd(-1), eventFd(-1), written(0), queuedBytes(0), urgent(false), stopping(false),
+                  nextImage(0), dropped(0) {}
+};
+
+int packOpen(ImagePack &p, const char *path);
+int packAppend(ImagePack &p, PackRecord &rec, const void *data, size_t len);
+void packFlush(ImagePack &p);
+void packEvents(ImagePack &p);
+bool packFind(ImagePack &p, uint32_t image, uint8_t kind, PackEntry &found, uint32_t mask = 0xFFFFFFFF);
+void packClose(ImagePack &p);
+
+int packReadRecord(int fd, uint64_t offset, uint64_t fileSize, PackRecord &rec, std::vector<unsigned char> &data);
+uint32_t packCrc32(const void *data, size_t len, uint32_t crc = 0);
+
+#endif
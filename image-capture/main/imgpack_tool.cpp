@@ -0,0 +1,266 @@
+// imgpack: lists what's in an image pack (imgpack.h) and pulls the jpegs back out. It reads the
+// pack itself rather than the index, so it works on one straight off the card after a crash, and
+// stops at the first record that's been cut short or fails its crc.
+//
+// usage: imgpack list <pack>
+//        imgpack extract <pack> <dir> [image]
+//
+// extract writes <dir>/<image>_<kind>.jpg, and <image>_burst<n>.jpg for the rest of a burst. Each
+// gets an EXIF block made from its record header, so photo tools put it on a map: GPS position
+// and altitude if there was a fix, GPS date and time and DateTime (UTC) if the clock was set,
+// and the image number, flight computer time and score in ImageDescription. The pack itself
+// stays as it is, so nothing is done to the capture path to tag images.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <vector>
+
+#include "imgpack.h"
+
+static const char *kindName(uint8_t kind){
+    switch (kind) {
+        case PACK_IMAGE:    return "image";
+        case PACK_BURST:    return "burst";
+        case PACK_DOWNLINK: return "downlink";
+        case PACK_THUMB:    return "thumb";
+    }
+    return "?";
+}
+
+static void printRecord(const PackRecord &rec){
+    char when[32] = "-";
+    time_t t = (time_t)(rec.realtimeUs / 1000000);
+    struct tm tm;
+    if (rec.realtimeUs > 0 && gmtime_r(&t, &tm)) strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    printf("%6u %-8s %2u %10llu %7u %3u %8.0f %s", rec.image, kindName(rec.kind), rec.burst,
+           (unsigned long long)rec.offset, rec.size, rec.quality, rec.score, when);
+    if (rec.fix.quality) {
+        printf(" %.7f,%.7f %.1fm fix %u %u sats", rec.fix.lat / 1e7, rec.fix.lon / 1e7, rec.fix.altCm / 100.0,
+               rec.fix.quality, rec.fix.sats);
+    }
+    if (rec.flightMs) printf(" flight %u ms", rec.flightMs);
+    printf("\n");
+}
+
+struct ExifEntry {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    std::vector<unsigned char> value;
+};
+
+#define EXIF_BYTE       1
+#define EXIF_ASCII      2
+#define EXIF_LONG       4
+#define EXIF_RATIONAL   5
+
+static void le16(std::vector<unsigned char> &b, uint16_t v){
+    b.push_back(v & 0xFF);
+    b.push_back(v >> 8);
+}
+
+static void le32(std::vector<unsigned char> &b, uint32_t v){
+    le16(b, v & 0xFFFF);
+    le16(b, v >> 16);
+}
+
+static void exifAdd(std::vector<ExifEntry> &ifd, uint16_t tag, uint16_t type, uint32_t count,
+                    const std::vector<unsigned char> &value){
+    ExifEntry e;
+    e.tag = tag;
+    e.type = type;
+    e.count = count;
+    e.value = value;
+    ifd.push_back(e);
+}
+
+static void exifText(std::vector<ExifEntry> &ifd, uint16_t tag, const char *text){
+    std::vector<unsigned char> v(text, text + strlen(text) + 1);
+    exifAdd(ifd, tag, EXIF_ASCII, v.size(), v);
+}
+
+//n rationals, num over den each
+static void exifRationals(std::vector<ExifEntry> &ifd, uint16_t tag, const uint32_t *num, const uint32_t *den, int n){
+    std::vector<unsigned char> v;
+    for (int i = 0; i < n; i++) {
+        le32(v, num[i]);
+        le32(v, den[i]);
+    }
+    exifAdd(ifd, tag, EXIF_RATIONAL, n, v);
+}
+
+//how much an IFD takes up with the values that don't fit in their entries, which go after it
+static size_t ifdBytes(const std::vector<ExifEntry> &ifd){
+    size_t n = 2 + 12 * ifd.size() + 4;
+    for (size_t i = 0; i < ifd.size(); i++) {
+        if (ifd[i].value.size() > 4) n += (ifd[i].value.size() + 1) & ~(size_t)1;
+    }
+    return n;
+}
+
+//appends an IFD at the end of tiff, offsets are from the start of tiff
+static void writeIfd(std::vector<unsigned char> &tiff, const std::vector<ExifEntry> &ifd){
+    size_t data = tiff.size() + 2 + 12 * ifd.size() + 4;
+    le16(tiff, ifd.size());
+    for (size_t i = 0; i < ifd.size(); i++) {
+        const ExifEntry &e = ifd[i];
+        le16(tiff, e.tag);
+        le16(tiff, e.type);
+        le32(tiff, e.count);
+        if (e.value.size() <= 4) {
+            std::vector<unsigned char> v = e.value;
+            v.resize(4, 0);
+            tiff.insert(tiff.end(), v.begin(), v.end());
+        } else {
+            le32(tiff, data);
+            data += (e.value.size() + 1) & ~(size_t)1;
+        }
+    }
+    le32(tiff, 0);
+    for (size_t i = 0; i < ifd.size(); i++) {
+        if (ifd[i].value.size() <= 4) continue;
+        tiff.insert(tiff.end(), ifd[i].value.begin(), ifd[i].value.end());
+        if (ifd[i].value.size() & 1) tiff.push_back(0);
+    }
+}
+
+//the APP1 segment with rec's position and time in it, see the top of the file
+static void exifFor(const PackRecord &rec, std::vector<unsigned char> &app1){
+    std::vector<ExifEntry> ifd0, gps;
+    char text[128];
+    const char *kinds[] = { "image", "burst", "downlink", "thumb" };
+    snprintf(text, sizeof(text), "cansat image %u %s %u, flight time %u ms, score %.0f", rec.image,
+             rec.kind < 4 ? kinds[rec.kind] : "?", rec.burst, rec.flightMs, rec.score);
+    exifText(ifd0, 0x010E, text);  // ImageDescription
+
+    struct tm tm;
+    time_t t = (time_t)(rec.realtimeUs / 1000000);
+    bool timed = rec.realtimeUs > 0 && gmtime_r(&t, &tm);
+    if (timed) {
+        strftime(text, sizeof(text), "%Y:%m:%d %H:%M:%S", &tm);
+        exifText(ifd0, 0x0132, text);  // DateTime
+    }
+
+    std::vector<unsigned char> version;
+    version.push_back(2);
+    version.push_back(3);
+    version.push_back(0);
+    version.push_back(0);
+    exifAdd(gps, 0x0000, EXIF_BYTE, 4, version);  // GPSVersionID
+    if (rec.fix.quality) {
+        uint32_t one[3] = { 10000000, 1, 1 };
+        uint32_t lat[3] = { (uint32_t)(rec.fix.lat < 0 ? -rec.fix.lat : rec.fix.lat), 0, 0 };
+        uint32_t lon[3] = { (uint32_t)(rec.fix.lon < 0 ? -rec.fix.lon : rec.fix.lon), 0, 0 };
+        uint32_t alt = rec.fix.altCm < 0 ? -rec.fix.altCm : rec.fix.altCm, cm = 100;
+        exifText(gps, 0x0001, rec.fix.lat < 0 ? "S" : "N");
+        exifRationals(gps, 0x0002, lat, one, 3);
+        exifText(gps, 0x0003, rec.fix.lon < 0 ? "W" : "E");
+        exifRationals(gps, 0x0004, lon, one, 3);
+        exifAdd(gps, 0x0005, EXIF_BYTE, 1, std::vector<unsigned char>(1, rec.fix.altCm < 0 ? 1 : 0));
+        exifRationals(gps, 0x0006, &alt, &cm, 1);
+    }
+    if (timed) {
+        uint32_t hms[3] = { (uint32_t)tm.tm_hour, (uint32_t)tm.tm_min, (uint32_t)tm.tm_sec };
+        uint32_t ones[3] = { 1, 1, 1 };
+        exifRationals(gps, 0x0007, hms, ones, 3);  // GPSTimeStamp
+        strftime(text, sizeof(text), "%Y:%m:%d", &tm);
+        exifText(gps, 0x001D, text);  // GPSDateStamp
+    }
+
+    //IFD0 points at the GPS IFD, which goes right after IFD0 and its values
+    std::vector<unsigned char> at;
+    le32(at, 8 + ifdBytes(ifd0) + 12);
+    exifAdd(ifd0, 0x8825, EXIF_LONG, 1, at);  // GPSInfo, the highest tag so it stays in order
+
+    std::vector<unsigned char> tiff;
+    tiff.push_back('I');
+    tiff.push_back('I');
+    le16(tiff, 42);
+    le32(tiff, 8);
+    writeIfd(tiff, ifd0);
+    writeIfd(tiff, gps);
+
+    app1.clear();
+    app1.push_back(0xFF);
+    app1.push_back(0xE1);
+    size_t len = 2 + 6 + tiff.size();
+    app1.push_back(len >> 8);
+    app1.push_back(len & 0xFF);
+    const char exif[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+    app1.insert(app1.end(), exif, exif + 6);
+    app1.insert(app1.end(), tiff.begin(), tiff.end());
+}
+
+int main(int argc, char **argv){
+    bool list = argc == 3 && strcmp(argv[1], "list") == 0;
+    bool extract = (argc == 4 || argc == 5) && strcmp(argv[1], "extract") == 0;
+    if (!list && !extract) {
+        fprintf(stderr, "usage: imgpack list <pack>\n       imgpack extract <pack> <dir> [image]\n");
+        return 2;
+    }
+
+    int fd = open(argv[2], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "couldn't open %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    long only = (argc == 5) ? atol(argv[4]) : -1;
+
+    if (list) printf(" image kind     burst    offset   bytes   q    score when\n");
+    PackRecord rec;
+    std::vector<unsigned char> data;
+    uint64_t offset = 0;
+    int records = 0, written = 0;
+    while (packReadRecord(fd, offset, st.st_size, rec, data) == 0) {
+        offset += PACK_HEADER_BYTES + rec.size;
+        records++;
+        if (list) {
+            printRecord(rec);
+            continue;
+        }
+        if (only >= 0 && rec.image != (uint32_t)only) continue;
+
+        char name[512];
+        if (rec.kind == PACK_BURST) {
+            snprintf(name, sizeof(name), "%s/%u_burst%u.jpg", argv[3], rec.image, rec.burst);
+        } else {
+            snprintf(name, sizeof(name), "%s/%u_%s.jpg", argv[3], rec.image, kindName(rec.kind));
+        }
+        //the EXIF goes straight after the SOI
+        std::vector<unsigned char> app1;
+        size_t skip = 0;
+        if (data.size() >= 2 && data[0] == 0xFF && data[1] == 0xD8) {
+            exifFor(rec, app1);
+            skip = 2;
+        }
+        FILE *fp = fopen(name, "wb");
+        if (fp == NULL || fwrite(data.data(), 1, skip, fp) != skip ||
+            fwrite(app1.data(), 1, app1.size(), fp) != app1.size() ||
+            fwrite(data.data() + skip, 1, data.size() - skip, fp) != data.size() - skip) {
+            fprintf(stderr, "couldn't write %s\n", name);
+            if (fp) fclose(fp);
+            close(fd);
+            return 1;
+        }
+        fclose(fp);
+        written++;
+    }
+    close(fd);
+
+    if (extract) fprintf(stderr, "%d of %d records written to %s\n", written, records, argv[3]);
+    if (offset < (uint64_t)st.st_size) {
+        fprintf(stderr, "%llu bytes at %llu aren't a whole record\n", (unsigned long long)(st.st_size - offset),
+                (unsigned long long)offset);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+// kernel-bench: checks the image kernels (kernels.h) and times them. Every kernel is run against
+// its scalar version, which has to match exactly, and the scalar versions against a
+// straightforward floating point reference. Then each is timed on camera sized frames.
+//
+// On a desktop both sides are the scalar code so it only checks the reference and gives a
+// baseline. On the Duo, or under T-Head's qemu (qemu-riscv64 -cpu c906fdv), it checks the vector
+// path. kernel-bench-rvv is the vector path on a desktop, built against the stand-in intrinsics
+// in host_test/rvv, its timings mean nothing. Exits 1 if anything doesn't match.
+//
+// usage: kernel-bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "kernels.h"
+#include "monotonic.h"
+
+static int failures = 0;
+
+//something with smooth areas and sharp edges, plus a bit of noise
+static void fillTest(std::vector<uint8_t> &buf, int seed){
+    srand(seed);
+    for (size_t i = 0; i < buf.size(); i++) {
+        int v = (int)((i * 7) % 251) + ((i / 97) % 2 ? 60 : 0) + rand() % 16;
+        buf[i] = (uint8_t)(v & 0xFF);
+    }
+}
+
+static void check(const char *what, bool ok, const char *detail = ""){
+    if (!ok) {
+        printf("FAIL %s %s\n", what, detail);
+        failures++;
+    }
+}
+
+static void checkYuyv(int width, int height){
+    int srcStride = width * 2 + 6;      //padded rows, as V4L2 sometimes hands over
+    std::vector<uint8_t> src(srcStride * height);
+    fillTest(src, width);
+    std::vector<uint8_t> a(width * 3 * height), b(width * 3 * height);
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%dx%d", width, height);
+
+    yuyvToGray(src.data(), srcStride, width, height, a.data(), width);
+    yuyvToGrayScalar(src.data(), srcStride, width, height, b.data(), width);
+    check("yuyvToGray matches scalar", memcmp(a.data(), b.data(), width * height) == 0, detail);
+
+    yuyvToBgr(src.data(), srcStride, width, height, a.data(), width * 3);
+    yuyvToBgrScalar(src.data(), srcStride, width, height, b.data(), width * 3);
+    check("yuyvToBgr matches scalar", a == b, detail);
+
+    int worst = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const uint8_t *p = &src[y * srcStride + (x & ~1) * 2];
+            double luma = 1.164383 * std::max(0, p[(x & 1) * 2] - 16);
+            double u = p[1] - 128, v = p[3] - 128;
+            double ref[3] = { luma + 2.017232 * u, luma - 0.391762 * u - 0.812968 * v, luma + 1.596027 * v };
+            for (int c = 0; c < 3; c++) {
+                int want = (int)lround(std::min(255.0, std::max(0.0, ref[c])));
+                worst = std::max(worst, abs(want - b[y * width * 3 + x * 3 + c]));
+            }
+        }
+    }
+    check("yuyvToBgr within 1 of the reference", worst <= 1, detail);
+}
+
+static void checkBox(int width, int height, int channels, int factor){
+    int stride = width * channels + 3;
+    std::vector<uint8_t> src(stride * height);
+    fillTest(src, factor * 10 + channels);
+    int outW = width / factor, outH = height / factor;
+    std::vector<uint8_t> a(outW * channels * outH), b(a.size());
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%dx%d c%d /%d", width, height, channels, factor);
+
+    boxDownscale(src.data(), stride, width, height, channels, factor, a.data(), outW * channels);
+    boxDownscaleScalar(src.data(), stride, width, height, channels, factor, b.data(), outW * channels);
+    check("boxDownscale matches scalar", a == b, detail);
+
+    bool exact = true;
+    for (int y = 0; y < outH && exact; y++) {
+        for (int x = 0; x < outW * channels && exact; x++) {
+            int c = x % channels;
+            double total = 0;
+            for (int dy = 0; dy < factor; dy++) {
+                for (int dx = 0; dx < factor; dx++) {
+                    total += src[(y * factor + dy) * stride + ((x / channels) * factor + dx) * channels + c];
+                }
+            }
+            exact = b[y * outW * channels + x] == (int)floor(total / (factor * factor) + 0.5);
+        }
+    }
+    check("boxDownscale is the rounded average", exact, detail);
+}
+
+static void checkLaplacian(int width, int height){
+    std::vector<uint8_t> img(width * height);
+    fillTest(img, height);
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%dx%d", width, height);
+
+    double a = laplacianVariance(img.data(), width, width, height);
+    double b = laplacianVarianceScalar(img.data(), width, width, height);
+    check("laplacianVariance matches scalar", a == b, detail);
+    if (width < 3 || height < 3) return;
+
+    double sum = 0, sumSq = 0, n = 0;
+    for (int y = 1; y < height - 1; y++) {
+        for (int x = 1; x < width - 1; x++) {
+            double lap = 4.0 * img[y * width + x] - img[y * width + x - 1] - img[y * width + x + 1] -
+                         img[(y - 1) * width + x] - img[(y + 1) * width + x];
+            sum += lap;
+            sumSq += lap * lap;
+            n++;
+        }
+    }
+    double ref = sumSq / n - (sum / n) * (sum / n);
+    check("laplacianVariance matches the reference", fabs(ref - b) <= 1e-6 * ref, detail);
+}
+
+//runs fn iterations times and prints how many megapixels a second it got through
+template <typename Fn>
+static void timeIt(const char *name, int width, int height, int iterations, Fn fn){
+    int64_t start = monotonicUs();
+    for (int i = 0; i < iterations; i++) fn();
+    int64_t us = monotonicUs() - start;
+    printf("  %-28s %4dx%-4d %8.3f ms %8.1f Mpix/s\n", name, width, height, us / 1000.0 / iterations,
+           (double)width * height * iterations / (us ? us : 1));
+}
+
+static void bench(int width, int height, int iterations){
+    std::vector<uint8_t> yuyv(width * 2 * height), bgr(width * 3 * height), gray(width * height);
+    std::vector<uint8_t> small(width * 3 * height / 4);
+    fillTest(yuyv, 1);
+    volatile double sink = 0;
+
+    timeIt("yuyvToGray", width, height, iterations, [&]() {
+        yuyvToGray(yuyv.data(), width * 2, width, height, gray.data(), width); });
+    timeIt("yuyvToGrayScalar", width, height, iterations, [&]() {
+        yuyvToGrayScalar(yuyv.data(), width * 2, width, height, gray.data(), width); });
+    timeIt("yuyvToBgr", width, height, iterations, [&]() {
+        yuyvToBgr(yuyv.data(), width * 2, width, height, bgr.data(), width * 3); });
+    timeIt("yuyvToBgrScalar", width, height, iterations, [&]() {
+        yuyvToBgrScalar(yuyv.data(), width * 2, width, height, bgr.data(), width * 3); });
+    for (int factor = 2; factor <= 4; factor *= 2) {
+        char name[40];
+        snprintf(name, sizeof(name), "boxDownscale bgr /%d", factor);
+        timeIt(name, width, height, iterations, [&]() {
+            boxDownscale(bgr.data(), width * 3, width, height, 3, factor, small.data(), width / factor * 3); });
+        snprintf(name, sizeof(name), "boxDownscaleScalar bgr /%d", factor);
+        timeIt(name, width, height, iterations, [&]() {
+            boxDownscaleScalar(bgr.data(), width * 3, width, height, 3, factor, small.data(), width / factor * 3); });
+    }
+    timeIt("laplacianVariance", width, height, iterations, [&]() {
+        sink = sink + laplacianVariance(gray.data(), width, width, height); });
+    timeIt("laplacianVarianceScalar", width, height, iterations, [&]() {
+        sink = sink + laplacianVarianceScalar(gray.data(), width, width, height); });
+}
+
+int main(int argc, char **argv){
+    int iterations = (argc > 1) ? atoi(argv[1]) : 50;
+    printf("kernels: %s\n", kernelsPath());
+
+    //odd sizes so the vector loops end on partial vectors
+    const int sizes[][2] = { { 2, 1 }, { 6, 3 }, { 34, 17 }, { 322, 241 }, { 640, 480 } };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        checkYuyv(sizes[i][0], sizes[i][1]);
+        checkLaplacian(sizes[i][0], sizes[i][1]);
+        for (int channels = 1; channels <= 4; channels++) {
+            for (int factor = 2; factor <= 16; factor *= 2) checkBox(sizes[i][0], sizes[i][1], channels, factor);
+        }
+    }
+    printf("correctness: %s\n", failures ? "FAILED" : "ok");
+
+    bench(320, 240, iterations);
+    bench(640, 480, iterations / 4 + 1);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#if defined(KERNELS_RVV) && defined(__riscv_vector)
+#define KERNELS_VECTOR 1
+#include <riscv_vector.h>
+#endif
+
+//BT.601 studio range to BGR in 13 bit fixed point, small enough that every product fits in 32
+//bits and the vector path can do exactly the same sums
+#define YUV_SHIFT   13
+#define YUV_ROUND   (1 << (YUV_SHIFT - 1))
+#define YUV_CY      9539    // 255/219
+#define YUV_CUB     16525
+#define YUV_CUG     (-3209)
+#define YUV_CVG     (-6660)
+#define YUV_CVR     13075
+
+static inline uint8_t clamp8(int v){
+    return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline int log2Factor(int factor){
+    int shift = 0;
+    while ((1 << shift) < factor) shift++;
+    return shift;
+}
+
+//---------------------------------------------------------------------------------------------
+// scalar
+
+void yuyvToGrayScalar(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride){
+    for (int y = 0; y < height; y++) {
+        const uint8_t *s = src + (size_t)y * srcStride;
+        uint8_t *d = dst + (size_t)y * dstStride;
+        for (int x = 0; x < width; x++) d[x] = s[2 * x];
+    }
+}
+
+void yuyvToBgrScalar(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride){
+    for (int y = 0; y < height; y++) {
+        const uint8_t *s = src + (size_t)y * srcStride;
+        uint8_t *d = dst + (size_t)y * dstStride;
+        for (int x = 0; x < width / 2; x++, s += 4, d += 6) {
+            int u = s[1] - 128, v = s[3] - 128;
+            int bu = YUV_CUB * u;
+            int g = YUV_CUG * u + YUV_CVG * v;
+            int rv = YUV_CVR * v;
+            for (int i = 0; i < 2; i++) {
+                int yy = s[2 * i] - 16;
+                yy = (yy < 0 ? 0 : yy) * YUV_CY + YUV_ROUND;
+                d[3 * i + 0] = clamp8((yy + bu) >> YUV_SHIFT);
+                d[3 * i + 1] = clamp8((yy + g) >> YUV_SHIFT);
+                d[3 * i + 2] = clamp8((yy + rv) >> YUV_SHIFT);
+            }
+        }
+    }
+}
+
+void boxDownscaleScalar(const uint8_t *src, int srcStride, int width, int height, int channels, int factor,
+                        uint8_t *dst, int dstStride){
+    int shift = 2 * log2Factor(factor);
+    int outW = width / factor, outH = height / factor;
+    for (int oy = 0; oy < outH; oy++) {
+        const uint8_t *rows = src + (size_t)oy * factor * srcStride;
+        uint8_t *d = dst + (size_t)oy * dstStride;
+        for (int ox = 0; ox < outW; ox++) {
+            for (int c = 0; c < channels; c++) {
+                unsigned sum = 0;
+                for (int dy = 0; dy < factor; dy++) {
+                    const uint8_t *s = rows + (size_t)dy * srcStride + (size_t)ox * factor * channels + c;
+                    for (int dx = 0; dx < factor; dx++) sum += s[dx * channels];
+                }
+                d[ox * channels + c] = (uint8_t)((sum + (1u << (shift - 1))) >> shift);
+            }
+        }
+    }
+}
+
+double laplacianVarianceScalar(const uint8_t *gray, int stride, int width, int height){
+    if (width < 3 || height < 3) return 0;
+    int64_t sum = 0, sumSq = 0;
+    for (int y = 1; y < height - 1; y++) {
+        const uint8_t *up = gray + (size_t)(y - 1) * stride;
+        const uint8_t *row = up + stride;
+        const uint8_t *down = row + stride;
+        for (int x = 1; x < width - 1; x++) {
+            int lap = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+            sum += lap;
+            sumSq += lap * lap;
+        }
+    }
+    double n = (double)(width - 2) * (height - 2);
+    double mean = sum / n;
+    return sumSq / n - mean * mean;
+}
+
+#ifndef KERNELS_VECTOR
+
+void yuyvToGray(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride){
+    yuyvToGrayScalar(src, srcStride, width, height, dst, dstStride);
+}
+
+void yuyvToBgr(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride){
+    yuyvToBgrScalar(src, srcStride, width, height, dst, dstStride);
+}
+
+void boxDownscale(const uint8_t *src, int srcStride, int width, int height, int channels, int factor,
+                  uint8_t *dst, int dstStride){
+    boxDownscaleScalar(src, srcStride, width, height, channels, factor, dst, dstStride);
+}
+
+double laplacianVariance(const uint8_t *gray, int stride, int width, int height){
+    return laplacianVarianceScalar(gray, stride, width, height);
+}
+
+const char *kernelsPath(){
+    return "scalar";
+}
+
+#else
+//---------------------------------------------------------------------------------------------
+// RVV 0.7, for the C906 in the Duo (VLEN 128). Written against the T-Head toolchain's
+// intrinsics. Interleaved data goes through strided loads and stores, the C906 has no segment
+// loads worth using, and everything is widened before it's added up so nothing wraps.
+
+void yuyvToGray(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride){
+    for (int y = 0; y < height; y++) {
+        const uint8_t *s = src + (size_t)y * srcStride;
+        uint8_t *d = dst + (size_t)y * dstStride;
+        for (size_t x = 0, vl; x < (size_t)width; x += vl) {
+            vl = vsetvl_e8m1(width - x);
+            vse8_v_u8m1(d + x, vlse8_v_u8m1(s + 2 * x, 2, vl), vl);
+        }
+    }
+}
+
+//scales one channel's fixed point sums down to bytes and stores them every 6 bytes
+static inline void bgrChannel(vint32m4_t sum, uint8_t *d, size_t vl){
+    vint32m4_t v = vsra_vx_i32m4(sum, YUV_SHIFT, vl);
+    v = vmin_vx_i32m4(vmax_vx_i32m4(v, 0, vl), 255, vl);
+    vuint16m2_t v16 = vreinterpret_v_i16m2_u16m2(vnsra_wx_i16m2(v, 0, vl));
+    vsse8_v_u8m1(d, 6, vnsrl_wx_u8m1(v16, 0, vl), vl);
+}
+
+//one of a pair's two pixels, given the chroma terms they share
+static inline void bgrPixel(vuint8m1_t luma, vint32m4_t bu, vint32m4_t g, vint32m4_t rv, uint8_t *d, size_t vl){
+    vint16m2_t yy = vreinterpret_v_u16m2_i16m2(vwaddu_vx_u16m2(luma, 0, vl));
+    yy = vmax_vx_i16m2(vsub_vx_i16m2(yy, 16, vl), 0, vl);
+    vint32m4_t base = vadd_vx_i32m4(vwmul_vx_i32m4(yy, YUV_CY, vl), YUV_ROUND, vl);
+    bgrChannel(vadd_vv_i32m4(base, bu, vl), d, vl);
+    bgrChannel(vadd_vv_i32m4(base, g, vl), d + 1, vl);
+    bgrChannel(vadd_vv_i32m4(base, rv, vl), d + 2, vl);
+}
+
+void yuyvToBgr(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride){
+    size_t pairs = width / 2;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *s = src + (size_t)y * srcStride;
+        uint8_t *d = dst + (size_t)y * dstStride;
+        for (size_t x = 0, vl; x < pairs; x += vl) {
+            vl = vsetvl_e8m1(pairs - x);
+            const uint8_t *p = s + 4 * x;
+            vint16m2_t u = vsub_vx_i16m2(vreinterpret_v_u16m2_i16m2(vwaddu_vx_u16m2(vlse8_v_u8m1(p + 1, 4, vl), 0, vl)), 128, vl);
+            vint16m2_t v = vsub_vx_i16m2(vreinterpret_v_u16m2_i16m2(vwaddu_vx_u16m2(vlse8_v_u8m1(p + 3, 4, vl), 0, vl)), 128, vl);
+            vint32m4_t bu = vwmul_vx_i32m4(u, YUV_CUB, vl);
+            vint32m4_t g = vwmacc_vx_i32m4(vwmul_vx_i32m4(u, YUV_CUG, vl), YUV_CVG, v, vl);
+            vint32m4_t rv = vwmul_vx_i32m4(v, YUV_CVR, vl);
+            bgrPixel(vlse8_v_u8m1(p, 4, vl), bu, g, rv, d + 6 * x, vl);
+            bgrPixel(vlse8_v_u8m1(p + 2, 4, vl), bu, g, rv, d + 6 * x + 3, vl);
+        }
+    }
+}
+
+//a vector's worth of output pixels of one channel at a time, summing the block a column at a
+//time with strided loads (neighbouring output pixels are factor * channels bytes apart)
+void boxDownscale(const uint8_t *src, int srcStride, int width, int height, int channels, int factor,
+                  uint8_t *dst, int dstStride){
+    int shift = 2 * log2Factor(factor);
+    size_t outW = width / factor;
+    int outH = height / factor;
+    ptrdiff_t step = factor * channels;
+    for (int oy = 0; oy < outH; oy++) {
+        const uint8_t *rows = src + (size_t)oy * factor * srcStride;
+        uint8_t *d = dst + (size_t)oy * dstStride;
+        for (size_t ox = 0, vl; ox < outW; ox += vl) {
+            vl = vsetvl_e8m1(outW - ox);
+            for (int c = 0; c < channels; c++) {
+                vuint16m2_t sum = vmv_v_x_u16m2(1u << (shift - 1), vl);
+                for (int dy = 0; dy < factor; dy++) {
+                    const uint8_t *s = rows + (size_t)dy * srcStride + ox * step + c;
+                    for (int dx = 0; dx < factor; dx++) {
+                        sum = vwaddu_wv_u16m2(sum, vlse8_v_u8m1(s + dx * channels, step, vl), vl);
+                    }
+                }
+                vsse8_v_u8m1(d + ox * channels + c, channels, vnsrl_wx_u8m1(sum, shift, vl), vl);
+            }
+        }
+    }
+}
+
+double laplacianVariance(const uint8_t *gray, int stride, int width, int height){
+    if (width < 3 || height < 3) return 0;
+    int64_t sum = 0, sumSq = 0;
+    vint32m1_t zero = vmv_v_x_i32m1(0, 1);
+    size_t inner = width - 2;
+    for (int y = 1; y < height - 1; y++) {
+        const uint8_t *up = gray + (size_t)(y - 1) * stride + 1;
+        const uint8_t *row = up + stride;
+        const uint8_t *down = row + stride;
+        for (size_t x = 0, vl; x < inner; x += vl) {
+            vl = vsetvl_e8m1(inner - x);
+            vuint16m2_t around = vwaddu_vv_u16m2(vle8_v_u8m1(row + x - 1, vl), vle8_v_u8m1(row + x + 1, vl), vl);
+            around = vwaddu_wv_u16m2(around, vle8_v_u8m1(up + x, vl), vl);
+            around = vwaddu_wv_u16m2(around, vle8_v_u8m1(down + x, vl), vl);
+            vint16m2_t centre = vreinterpret_v_u16m2_i16m2(vwaddu_vx_u16m2(vle8_v_u8m1(row + x, vl), 0, vl));
+            vint16m2_t lap = vsub_vv_i16m2(vsll_vx_i16m2(centre, 2, vl), vreinterpret_v_u16m2_i16m2(around), vl);
+
+            //|lap| <= 1020, so a row chunk's squares can't overflow 32 bits until vl is in the thousands
+            sum += vmv_x_s_i32m1_i32(vwredsum_vs_i16m2_i32m1(zero, lap, zero, vl));
+            sumSq += (uint32_t)vmv_x_s_i32m1_i32(vredsum_vs_i32m4_i32m1(zero, vwmul_vv_i32m4(lap, lap, vl), zero, vl));
+        }
+    }
+    double n = (double)(width - 2) * (height - 2);
+    double mean = sum / n;
+    return sumSq / n - mean * mean;
+}
+
+const char *kernelsPath(){
+    return "rvv0.7";
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+
+// Pixel loops that run on every frame, written out by hand so they can use the C906's vector
+// unit. Built with KERNELS_RVV on a compiler that does RVV 0.7 (the Duo toolchain with
+// -march=rv64imafdcv0p7xthead) they're vectorized, everywhere else they're plain C++ that any
+// compiler can build. The Scalar versions are always there so kernel-bench can check one
+// against the other.
+//
+// Images are 8 bit, rows are stride bytes apart. Both paths give exactly the same output.
+
+// YUYV (Y0 U Y1 V per pair of pixels) is what V4L2 cameras hand over. BGR is BT.601 with
+// studio range luma like cv::COLOR_YUV2BGR_YUYV, within a level of what OpenCV gives. width
+// has to be even.
+void yuyvToGray(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride);
+void yuyvToBgr(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride);
+
+// Each output pixel is the rounded average of a factor x factor block, which is what
+// cv::INTER_AREA does for a whole number factor. factor is 2, 4, 8 or 16, channels 1 to 4 and
+// interleaved. The output is width / factor by height / factor, leftover edge pixels are dropped.
+void boxDownscale(const uint8_t *src, int srcStride, int width, int height, int channels, int factor,
+                  uint8_t *dst, int dstStride);
+
+// Variance of the 4-neighbour Laplacian over the inside of a grey image, bigger is sharper
+double laplacianVariance(const uint8_t *gray, int stride, int width, int height);
+
+void yuyvToGrayScalar(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride);
+void yuyvToBgrScalar(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride);
+void boxDownscaleScalar(const uint8_t *src, int srcStride, int width, int height, int channels, int factor,
+                        uint8_t *dst, int dstStride);
+double laplacianVarianceScalar(const uint8_t *gray, int stride, int width, int height);
+
+// "rvv0.7" or "scalar", whichever the functions above use
+const char *kernelsPath();
+
+#endif
@@ -4,135 +4,152 @@
 
 #include <unistd.h>   // sleep()
 #include <stdio.h>
-//#include <string.h>
+#include <string.h>
+#include <errno.h>
 #include <wiringx.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "serial.h"
+#include "capture.h"
+#include "transfer.h"
+#include "imgpack.h"
+#include "encode.h"
+#include "gps.h"
 
 // Duo:     milkv_duo
 // Duo256M: milkv_duo256m
 // DuoS:    milkv_duos
 #define WIRINGX_TARGET "milkv_duo256m"
 
-int parse_comma_delimited_str(char *string, char **fields, int max_fields)
-{
-   int i = 0;
-   fields[i++] = string;
-   while ((i < max_fields) && NULL != (string = strchr(string, ','))) {
-      *string = '\0';
-      fields[i++] = ++string;
-   }
-   return --i;
-}
+#define GPS_DEV     "/dev/ttyS1"
+#define ESP_DEV     "/dev/ttyS2"
+#define MAX_EVENTS  8
+#define PACK_PATH   "/root/images/images.pack"  // every image, see imgpack.h
+#define GPS_FORWARD_MS  1000    // the esp only keeps the latest for its next report, no use sending it every fix
+
+//RTS/CTS on the esp uart, see IMAGE_CAPTURE_ESP_FLOW. Without it the esp throws away anything
+//its buffer can't take and asks for a resend from the gap.
+#ifdef ESP_HW_FLOW
+#define ESP_FLOW    true
+#else
+#define ESP_FLOW    false
+#endif
 
-//stolen file size function
-int fsize(FILE *fp){
-    int prev=ftell(fp);
-    fseek(fp, 0L, SEEK_END);
-    int sz=ftell(fp);
-    fseek(fp,prev,SEEK_SET); //go back to where we were
-    return sz;
+//everything from the esp comes as DUO_CMD frames, each one gets a DUO_ACK back once it's been
+//dealt with (or couldn't be)
+void ack(SerialPort &esp, uint8_t op, bool ok){
+    uint8_t payload[2] = { op, (uint8_t)(ok ? 0 : 1) };
+    serialQueueFrame(esp, DUO_ACK, payload, sizeof(payload));
 }
 
-int getGPS(struct wiringXSerial_t gpsUart){
-    int fd;
+//a record that's to go to the esp once the pack's writer has it on the card
+struct WaitingSend {
+    uint32_t image;
+    uint8_t kind;
+    int64_t offset;     // -1 to queue it behind whatever's being sent
+};
 
-    if ((fd = wiringXSerialOpen("/dev/ttyS1", gpsUart)) < 0) {
-        fprintf(stderr, "Open serial device failed: 1\n");
-        wiringXGC();
-        return -1;
-    }
+//lines up image's record of that kind to go to the esp, or with an offset to (re)start sending it
+//from there. -1 if there's no such record.
+int sendRecord(std::deque<WaitingSend> &waiting, ImagePack &pack, uint32_t image, uint8_t kind, int64_t offset = -1){
+    PackEntry e;
+    if (!packFind(pack, image, kind, e, 0x7FFF)) return -1;
+    WaitingSend w;
+    w.image = e.image;
+    w.kind = kind;
+    w.offset = offset;
+    waiting.push_back(w);
+    //the transfer reads it off the card, so don't hang about
+    packFlush(pack);
+    return 0;
+}
 
-    char buf[256];
-    char **out;
-    int i;
-    int recv_len = 0;
-    recv_len = wiringXSerialDataAvail(fd);
-
-    if (recv_len > 0) {
-        i = 0;
-        while (recv_len--)
-        {
-            buf[i++] = wiringXSerialGetChar(fd);
+//hands waiting records to the transfer, in order, as they make it to the card. Only the bottom 15
+//bits of an image number go down, the top one is DUO_IMAGE_THUMB.
+void startSends(std::deque<WaitingSend> &waiting, ImagePack &pack, Transfer &tx){
+    while (!waiting.empty()) {
+        const WaitingSend &w = waiting.front();
+        PackEntry e;
+        if (!packFind(pack, w.image, w.kind, e) || e.offset == PACK_UNWRITTEN) return;
+        int wire = (w.image & 0x7FFF) | (w.kind == PACK_THUMB ? DUO_IMAGE_THUMB : 0);
+        if (e.offset == PACK_DROPPED) {
+            fprintf(stderr, "image %u kind %u was dropped before it was written, not sending it\n", w.image, w.kind);
+        } else if (w.offset >= 0) {
+            transferStart(tx, PACK_PATH, wire, w.offset, e.offset + PACK_HEADER_BYTES, e.size);
+        } else {
+            transferQueue(tx, PACK_PATH, wire, e.offset + PACK_HEADER_BYTES, e.size);
         }
-        parse_comma_delimited_str(buf, out, 8);
-
-        wiringXSerialPrintf(fd, "G:{LAT:{%s%c}:LON{%s%c}:}:", out[2], out[3], out[4], out[5]);
+        waiting.pop_front();
     }
-
 }
 
-int waitOnUart(struct wiringXSerial_t espUart){
-    char buf[1024];
-
-    int recv_len = 0;
-    int i;
-    int fd;
+//our position on to the esp, in the ddmm.mmmm the gps gave us
+void forwardFix(SerialPort &esp, const GpsFix &fix){
+    int32_t lat = fix.lat < 0 ? -fix.lat : fix.lat;
+    int32_t lon = fix.lon < 0 ? -fix.lon : fix.lon;
+    char msg[96];
+    snprintf(msg, sizeof(msg), "G:{LAT:{%02d%07.4f%c}:LON{%03d%07.4f%c}:}:",
+             lat / 10000000, (lat % 10000000) * 60 / 1e7, fix.lat < 0 ? 'S' : 'N',
+             lon / 10000000, (lon % 10000000) * 60 / 1e7, fix.lon < 0 ? 'W' : 'E');
+    serialQueueFrame(esp, DUO_GPS, msg, strlen(msg));
+}
 
-    //open serial connection
-    if ((fd = wiringXSerialOpen("/dev/ttyS2", espUart)) < 0) {
-        fprintf(stderr, "Open serial device failed: 2\n");
-        wiringXGC();
-        return -1;
-    }
-    wiringXSerialFlush(fd);
-
-    //hang until data is recieved
-    recv_len = wiringXSerialDataAvail(fd);
-    if (recv_len > 0) {
-        fprintf(stderr, "recieved!\n");
-        i = 0;
-        while (recv_len--)
-        {
-            buf[i++] = wiringXSerialGetChar(fd);
-        }
-        if (recv_len > 1){
-            if(buf[0] == 't'){
-                //transmit image instruction
-                return 2;
-            } else if(buf[0] == 's'){
-                //shutdown program instruction
-                wiringXSerialPuts(fd, "ACK");
-                return 3;
-            } else{
-                //unrecognized instruction
-                wiringXSerialPuts(fd, "?");
-                return 1;
-            }
-        }
+//what's left of a save or transmit once the encoder's done with it: the ACK, and for a transmit
+//the records that go down or the DUO_SAME that goes instead
+void finishJob(const EncodeDone &d, SerialPort &esp, std::deque<WaitingSend> &waiting, ImagePack &pack){
+    bool ok = d.ok;
+    if (ok && d.same >= 0) {
+        //the esp passes this on instead of an image
+        uint8_t notice[5];
+        duo_put16(notice, d.image & 0x7FFF);
+        duo_put16(notice + 2, d.same & 0x7FFF);
+        notice[4] = d.distance;
+        serialQueueFrame(esp, DUO_SAME, notice, sizeof(notice));
+    } else if (ok && d.copies) {
+        //thumbnail first, the esp puts it ahead of anything else it's holding
+        ok = sendRecord(waiting, pack, d.image, PACK_THUMB) == 0 &&
+             sendRecord(waiting, pack, d.image, PACK_DOWNLINK) == 0;
+    } else if (ok && d.op == DUO_OP_TRANSMIT) {
+        ok = sendRecord(waiting, pack, d.image, PACK_IMAGE) == 0;
     }
-
-    wiringXSerialClose(fd);
-    return 0;
+    if (ok) fprintf(stderr, "done %u, %lld ms after it was asked for\n", d.image,
+                    (long long)(monotonicUs() - d.queuedUs) / 1000);
+    ack(esp, d.op, ok);
 }
 
-int transmit(char* filename, struct wiringXSerial_t espUart){
-    FILE* fp;
-    fp = fopen(filename, "rb");
-
-    int fd;
-
-    int file_size = fsize(fp);
-
-    char buf[file_size];
-    int i;
-    
-    //open serial connection
-    if ((fd = wiringXSerialOpen("/dev/ttyS2", espUart)) < 0) {
-        fprintf(stderr, "Open serial device failed: 2");
-        wiringXGC();
-        return -1;
+//kill -USR1 prints this, one line per stage (see stage.h)
+void printStats(const Encoder &enc, ImagePack &pack, const Transfer &tx, GpsReader &gps, int64_t startUs){
+    int64_t elapsed = monotonicUs() - startUs;
+    size_t unwritten;
+    {
+        std::lock_guard<std::mutex> lock(pack.lock);
+        unwritten = pack.queue.size();
     }
+    fprintf(stderr, "up %lld s, %d waiting on the encoder, %zu records waiting on the card\n",
+            (long long)elapsed / 1000000, enc.inFlight, unwritten);
+    stagePrint("capture", "frames", captureStats(), elapsed);
+    stagePrint("encode", "jobs", enc.stats, elapsed);
+    stagePrint("write", "records", pack.stats, elapsed);
+    stagePrint("transmit", "records", tx.stats, elapsed);
 
-    fprintf(stderr, "filesize: %d\n", file_size);
-
-    //copy image to serial buffer
-    fread(buf, 1, file_size, fp);
-    write(fd, buf, file_size);
+    GpsFix fix;
+    bool current = gpsLatest(gps, fix);
+    fprintf(stderr, "gps      %6u updates, %u bad checksums, fix %u with %u sats%s, last %lld ms ago\n", fix.updates,
+            gps.bad.load(), fix.quality, fix.sats, current ? "" : " (stale)",
+            fix.updatedUs ? (long long)(monotonicUs() - fix.updatedUs) / 1000 : -1LL);
+}
 
-    wiringXSerialClose(fd);
-    fclose(fp);
-    return 0;
+//(re)register a port with epoll, only asking for EPOLLOUT while it has something to send
+int watchPort(int epfd, int op, SerialPort &port, bool sending = false){
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | ((sending || serialTxPending(port)) ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = &port;
+    return epoll_ctl(epfd, op, port.fd, &ev);
 }
 
 int main(){
@@ -142,61 +159,241 @@ int main(){
         return -1;
     }
     //define wiringx serial parameters
-    struct wiringXSerial_t espUart = {115200, 8, 'n', 1, 'n'};
+    struct wiringXSerial_t espUart = {DUO_BAUD, 8, 'n', 1, 'n'};
     struct wiringXSerial_t gpsUart = {9600, 8, 'n', 1, 'n'};
 
-    //set up cv image capture parameters and open
-    cv::VideoCapture cap;
-    cap.set(cv::CAP_PROP_FRAME_WIDTH, 320);
-    cap.set(cv::CAP_PROP_FRAME_HEIGHT, 240);
-    cap.open(0);
+    //both uarts stay open for the whole run, so nothing that arrives between commands is lost. The
+    //gps one belongs to the gps thread (gps.h), the esp one to this loop.
+    SerialPort gps, esp;
+    if (serialOpen(gps, GPS_DEV, gpsUart) != 0 || serialOpen(esp, ESP_DEV, espUart, ESP_FLOW) != 0) {
+        serialClose(gps);
+        wiringXGC();
+        return -1;
+    }
 
-    //define intermediary image matrix
-    cv::Mat image;
+    //SIGUSR1 comes through epoll rather than a handler. It has to be blocked before any of the
+    //threads start, otherwise one of them could get it instead and be killed by it.
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    int sigFd = signalfd(-1, &usr1, SFD_NONBLOCK | SFD_CLOEXEC);
 
-    //the first two captures are all black and greyscale respectively, lets deal with those
-    cap >> image;
-    cap >> image;
+    int epfd = epoll_create1(0);
+    if (epfd < 0 || watchPort(epfd, EPOLL_CTL_ADD, esp) != 0) {
+        fprintf(stderr, "epoll setup failed: %s\n", strerror(errno));
+        serialClose(gps);
+        serialClose(esp);
+        wiringXGC();
+        return -1;
+    }
+    struct epoll_event sigEv;
+    memset(&sigEv, 0, sizeof(sigEv));
+    sigEv.events = EPOLLIN;
+    sigEv.data.ptr = &sigFd;
+    if (sigFd >= 0) epoll_ctl(epfd, EPOLL_CTL_ADD, sigFd, &sigEv);
+    int64_t startUs = monotonicUs();
+
+    //says when there's a new fix
+    GpsReader gpsReader;
+    if (gpsStart(gpsReader, gps) != 0) {
+        close(epfd);
+        serialClose(gps);
+        serialClose(esp);
+        wiringXGC();
+        return -1;
+    }
+    struct epoll_event gpsEv;
+    memset(&gpsEv, 0, sizeof(gpsEv));
+    gpsEv.events = EPOLLIN;
+    gpsEv.data.ptr = &gpsReader;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, gpsReader.eventFd, &gpsEv);
+
+    //the camera keeps grabbing in the background from here on
+    if (captureStart(0, 320, 240) != 0) {
+        gpsStop(gpsReader);
+        close(epfd);
+        serialClose(gps);
+        serialClose(esp);
+        wiringXGC();
+        return -1;
+    }
+
+    //every image goes in the pack, numbered on from the last run's
+    ImagePack pack;
+    if (packOpen(pack, PACK_PATH) != 0) {
+        captureStop();
+        gpsStop(gpsReader);
+        close(epfd);
+        serialClose(gps);
+        serialClose(esp);
+        wiringXGC();
+        return -1;
+    }
+    //the pack's writer says when a batch is on the card
+    struct epoll_event packEv;
+    memset(&packEv, 0, sizeof(packEv));
+    packEv.events = EPOLLIN;
+    packEv.data.ptr = &pack;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, pack.eventFd, &packEv);
+
+    //saves and transmits get done on the encoder's thread, it says when one's finished
+    Encoder enc;
+    if (encoderStart(enc, pack, gpsReader) != 0) {
+        packClose(pack);
+        captureStop();
+        gpsStop(gpsReader);
+        close(epfd);
+        serialClose(gps);
+        serialClose(esp);
+        wiringXGC();
+        return -1;
+    }
+    struct epoll_event encEv;
+    memset(&encEv, 0, sizeof(encEv));
+    encEv.events = EPOLLIN;
+    encEv.data.ptr = &enc;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, enc.eventFd, &encEv);
 
     //various declarations
-    char filename[100];
+    int64_t forwardedUs = 0; //when the esp last got our position
     bool running = true;
-    int i = 0; //image number
+    Transfer tx; //image currently going out to the esp
+    std::deque<WaitingSend> waiting; //records to go to tx once they're written
+    uint8_t type;
+    std::string payload;
 
-    //main loop
+    //main loop, sleeps in epoll_wait until one of the uarts has something for us, the pack has
+    //written something or the encoder has finished something. Nothing in here waits on the SD card
+    //or on an encode, this is the transmit stage (see stage.h).
     while(running){
-        getGPS(gpsUart);
-        switch(waitOnUart(espUart)) {
-            case 1: //save image
-                fprintf(stderr, "save requested\n");
-                sprintf(filename, "/root/images/out%d.jpg", i);
-                cap >> image;
-                cv::imwrite(filename, image);
-                fprintf(stderr, "done %d\n",  i);
-                break;
-            case 2: //save and transmit image
-                fprintf(stderr, "transmit requested\n");
-                sprintf(filename, "/root/images/out%d.jpg", i);
-                cap >> image;
-                cv::imwrite(filename, image);
-                if(transmit(filename, espUart)!=0){
-                    cap.release();
-                    wiringXGC();
-                    return -1;
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.ptr == &pack) {
+                packEvents(pack);
+                continue;
+            }
+            if (events[e].data.ptr == &enc) {
+                EncodeDone done;
+                while (encoderNext(enc, done)) finishJob(done, esp, waiting, pack);
+                continue;
+            }
+            if (events[e].data.ptr == &gpsReader) {
+                gpsEvents(gpsReader);
+                GpsFix fix;
+                if (gpsLatest(gpsReader, fix) && monotonicUs() - forwardedUs >= GPS_FORWARD_MS * 1000) {
+                    forwardFix(esp, fix);
+                    forwardedUs = monotonicUs();
+                }
+                continue;
+            }
+            if (events[e].data.ptr == &sigFd) {
+                struct signalfd_siginfo info;
+                while (read(sigFd, &info, sizeof(info)) == sizeof(info)) {}
+                printStats(enc, pack, tx, gpsReader, startUs);
+                continue;
+            }
+            SerialPort *port = (SerialPort *)events[e].data.ptr;
+
+            if (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                if (serialRead(*port) < 0) {
+                    running = false;
+                    break;
+                }
+            }
+            if (events[e].events & EPOLLOUT) {
+                serialWrite(*port);
+            }
+
+            while (serialNextFrame(esp, &type, payload)) {
+                if (type != DUO_CMD || payload.empty()) continue;
+                uint8_t op = payload[0];
+                switch (op) {
+                    case DUO_OP_SAVE:
+                    case DUO_OP_TRANSMIT: {
+                        //the esp says how many bytes the image can be, 0 (or an older esp that
+                        //doesn't say) sends the full quality one
+                        EncodeJob job;
+                        job.op = op;
+                        const uint8_t *arg = (const uint8_t *)payload.data() + 1;
+                        size_t args = payload.size() - 1;
+                        job.budget = (op == DUO_OP_TRANSMIT && args >= 4) ? duo_get32(arg) : 0;
+                        //and the flight computer's clock after that, for tagging the image with
+                        size_t at = (op == DUO_OP_TRANSMIT) ? 4 : 0;
+                        job.flightMs = (args >= at + 4) ? duo_get32(arg + at) : 0;
+                        job.queuedUs = monotonicUs();
+                        fprintf(stderr, "%s requested, budget %zu, flight time %u ms\n",
+                                op == DUO_OP_SAVE ? "save" : "transmit", job.budget, job.flightMs);
+                        //the ACK goes when the encoder's done with it
+                        if (!encoderSubmit(enc, job)) {
+                            fprintf(stderr, "encoder has %d on its hands already, turning it away\n", enc.inFlight);
+                            ack(esp, op, false);
+                        }
+                        break;
+                    }
+                    case DUO_OP_RESEND: {
+                        if (payload.size() < 7) {
+                            ack(esp, op, false);
+                            break;
+                        }
+                        const uint8_t *arg = (const uint8_t *)payload.data() + 1;
+                        int image = duo_get16(arg);
+                        uint32_t offset = duo_get32(arg + 2);
+                        fprintf(stderr, "resend of %d from %u requested\n", image, offset);
+                        //it's the downlink copy that went out, if there is one
+                        int sent;
+                        if (image & DUO_IMAGE_THUMB) {
+                            sent = sendRecord(waiting, pack, image, PACK_THUMB, offset);
+                        } else {
+                            sent = sendRecord(waiting, pack, image, PACK_DOWNLINK, offset);
+                            if (sent != 0) sent = sendRecord(waiting, pack, image, PACK_IMAGE, offset);
+                        }
+                        ack(esp, op, sent == 0);
+                        break;
+                    }
+                    case DUO_OP_SHUTDOWN:
+                        ack(esp, op, true);
+                        running = false;
+                        break;
+                    default:
+                        ack(esp, op, false);
+                        break;
                 }
-                fprintf(stderr, "done %d\n",  i);
-                break;
-            case 3:
-                running = false;
-                break;
-            default: 
-                break;
+            }
         }
-        i++;
+
+        //top up tx from anything that's made it to the card, then from the image being sent, then
+        //try sending straight away, epoll only gets involved if the uart backs up
+        startSends(waiting, pack, tx);
+        transferPump(tx, esp);
+        if (serialWrite(esp) < 0) break;
+        watchPort(epfd, EPOLL_CTL_MOD, esp, transferActive(tx));
+    }
+
+    //give whatever's left (the shutdown ACK) a second to go out
+    for (int tries = 0; serialTxPending(esp) && tries < 100; tries++) {
+        if (serialWrite(esp) < 0) break;
+        usleep(10000);
     }
 
     //wrap up
+    encoderStop(enc);
+    printStats(enc, pack, tx, gpsReader, startUs);
+    transferStop(tx);
+    packClose(pack);
+    gpsStop(gpsReader);
+    if (sigFd >= 0) close(sigFd);
+    close(epfd);
+    serialClose(gps);
+    serialClose(esp);
     wiringXGC();
-    cap.release();
+    captureStop();
     return 0;
-}
\ No newline at end of file
+}
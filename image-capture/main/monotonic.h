@@ -0,0 +1,15 @@
+#ifndef MONOTONIC_H
+#define MONOTONIC_H
+
+#include <stdint.h>
+#include <time.h>
+
+// CLOCK_MONOTONIC in microseconds, what every timestamp and stat in image-capture is in. It's
+// header only so the tools that don't link capture.cpp (and OpenCV with it) can use it too.
+inline int64_t monotonicUs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "serial.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+int serialOpen(SerialPort &port, const char *dev, struct wiringXSerial_t cfg, bool hwFlow){
+    port.dev = dev;
+    if ((port.fd = wiringXSerialOpen(dev, cfg)) < 0) {
+        fprintf(stderr, "Open serial device failed: %s\n", dev);
+        return -1;
+    }
+
+    //the event loop does all the waiting, reads and writes should never block
+    int flags = fcntl(port.fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(port.fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Couldn't make %s non-blocking: %s\n", dev, strerror(errno));
+        serialClose(port);
+        return -1;
+    }
+
+    //wiringx only knows about xon/xoff, so RTS/CTS gets set here, and cleared otherwise since the
+    //port keeps whatever the last program left it with. With it on the uart stops sending whenever
+    //the other end drops CTS and the kernel buffer takes up the slack
+    struct termios tio;
+    if (tcgetattr(port.fd, &tio) != 0) {
+        fprintf(stderr, "Couldn't read %s settings: %s\n", dev, strerror(errno));
+        serialClose(port);
+        return -1;
+    }
+    if (hwFlow) {
+        tio.c_cflag |= CRTSCTS;
+    } else {
+        tio.c_cflag &= ~CRTSCTS;
+    }
+    if (tcsetattr(port.fd, TCSANOW, &tio) != 0) {
+        fprintf(stderr, "Couldn't set flow control for %s: %s\n", dev, strerror(errno));
+        serialClose(port);
+        return -1;
+    }
+    return 0;
+}
+
+void serialClose(SerialPort &port){
+    if (port.fd >= 0) {
+        wiringXSerialClose(port.fd);
+        port.fd = -1;
+    }
+}
+
+//read everything that's waiting onto the end of rx, returns how much came in or -1
+int serialRead(SerialPort &port){
+    char buf[256];
+    int total = 0;
+
+    while (true) {
+        ssize_t n = read(port.fd, buf, sizeof(buf));
+        if (n > 0) {
+            port.rx.append(buf, n);
+            total += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return total;
+        } else {
+            fprintf(stderr, "Read from %s failed: %s\n", port.dev, n == 0 ? "closed" : strerror(errno));
+            return -1;
+        }
+    }
+}
+
+void serialQueue(SerialPort &port, const void *data, size_t len){
+    //drop what's already gone out so tx doesn't grow forever. An image transfer keeps topping
+    //tx up before it's empty, so the written part gets trimmed off once it's worth the move too
+    if (port.txPos == port.tx.size()) {
+        port.tx.clear();
+        port.txPos = 0;
+    } else if (port.txPos >= 4096) {
+        port.tx.erase(port.tx.begin(), port.tx.begin() + port.txPos);
+        port.txPos = 0;
+    }
+    const unsigned char *p = (const unsigned char *)data;
+    port.tx.insert(port.tx.end(), p, p + len);
+}
+
+void serialQueue(SerialPort &port, const char *str){
+    serialQueue(port, str, strlen(str));
+}
+
+//queue payload as one duo frame (duo_frame.h)
+void serialQueueFrame(SerialPort &port, uint8_t type, const void *payload, size_t len){
+    uint8_t buf[DUO_ENCODED_MAX];
+    size_t n = duo_frame_encode(type, (const uint8_t *)payload, len, buf);
+    if (n == 0) {
+        fprintf(stderr, "%zu bytes is too big for a frame to %s\n", len, port.dev);
+        return;
+    }
+    serialQueue(port, buf, n);
+}
+
+//pull the next good frame out of rx, anything that doesn't decode gets dropped. Returns false
+//once there are no more whole frames in rx.
+bool serialNextFrame(SerialPort &port, uint8_t *type, std::string &payload){
+    size_t end;
+    while ((end = port.rx.find('\0')) != std::string::npos) {
+        uint8_t buf[DUO_ENCODED_MAX];
+        size_t len = end;
+        bool fits = len <= sizeof(buf);
+        if (fits) memcpy(buf, port.rx.data(), len);
+        port.rx.erase(0, end + 1);
+
+        const uint8_t *p;
+        size_t n;
+        if (len == 0) continue;
+        if (!fits || duo_frame_decode(buf, len, type, &p, &n) != 0) {
+            fprintf(stderr, "bad frame from %s (%zu bytes)\n", port.dev, len);
+            continue;
+        }
+        payload.assign((const char *)p, n);
+        return true;
+    }
+
+    //no frame is this long, whatever's there is garbage
+    if (port.rx.size() > DUO_ENCODED_MAX) port.rx.clear();
+    return false;
+}
+
+//write as much of tx as the port takes right now, returns how many bytes are still waiting or -1
+int serialWrite(SerialPort &port){
+    while (port.txPos < port.tx.size()) {
+        ssize_t n = write(port.fd, &port.tx[port.txPos], port.tx.size() - port.txPos);
+        if (n > 0) {
+            port.txPos += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            fprintf(stderr, "Write to %s failed: %s\n", port.dev, strerror(errno));
+            return -1;
+        }
+    }
+    return port.tx.size() - port.txPos;
+}
+
+bool serialTxPending(const SerialPort &port){
+    return port.txPos < port.tx.size();
+}
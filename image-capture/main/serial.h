@@ -0,0 +1,34 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <wiringx.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "duo_frame.h"
+
+// A UART that gets opened once at startup and stays open. The fd is non-blocking so it can sit
+// in the epoll loop, received bytes pile up in rx until whoever handles them eats them, and
+// anything queued in tx gets written out as the port takes it.
+struct SerialPort {
+    const char *dev;
+    int fd;
+    std::string rx;
+    std::vector<unsigned char> tx;
+    size_t txPos;   // how much of tx has been written
+
+    SerialPort() : dev(NULL), fd(-1), txPos(0) {}
+};
+
+int serialOpen(SerialPort &port, const char *dev, struct wiringXSerial_t cfg, bool hwFlow = false);
+void serialClose(SerialPort &port);
+int serialRead(SerialPort &port);
+void serialQueue(SerialPort &port, const void *data, size_t len);
+void serialQueue(SerialPort &port, const char *str);
+void serialQueueFrame(SerialPort &port, uint8_t type, const void *payload, size_t len);
+bool serialNextFrame(SerialPort &port, uint8_t *type, std::string &payload);
+int serialWrite(SerialPort &port);
+bool serialTxPending(const SerialPort &port);
+
+#endif
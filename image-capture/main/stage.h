@@ -0,0 +1,82 @@
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <atomic>
+
+#include "monotonic.h"
+
+// image-capture is a pipeline, each stage on its own thread, so how many images a minute it can
+// keep up comes down to the slowest stage instead of all of them added together:
+//   capture   the camera thread (capture.cpp), grabs frames nonstop
+//   encode    the encode thread (encode.cpp), takes a burst, scores it, makes the jpegs
+//   write     the pack's writer thread (imgpack.cpp), gets records onto the card
+//   transmit  the main loop, streams records out of the pack to the esp
+// Jobs go to the encoder and come back through Rings, and every stage keeps a StageStats that
+// the main loop prints on SIGUSR1.
+
+// Single producer, single consumer queue of up to N items, N a power of two. Neither side ever
+// takes a lock or waits, a full ring is the producer's problem and an empty one the consumer's.
+template <typename T, size_t N>
+struct Ring {
+    static_assert((N & (N - 1)) == 0, "ring size has to be a power of two");
+    T items[N];
+    std::atomic<size_t> head;   // next to pop, only the consumer moves it
+    std::atomic<size_t> tail;   // next to push to, only the producer moves it
+
+    Ring() : head(0), tail(0) {}
+};
+
+template <typename T, size_t N>
+bool ringPush(Ring<T, N> &r, const T &item){
+    size_t tail = r.tail.load(std::memory_order_relaxed);
+    if (tail - r.head.load(std::memory_order_acquire) >= N) return false;
+    r.items[tail & (N - 1)] = item;
+    r.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T, size_t N>
+bool ringPop(Ring<T, N> &r, T &item){
+    size_t head = r.head.load(std::memory_order_relaxed);
+    if (head == r.tail.load(std::memory_order_acquire)) return false;
+    item = r.items[head & (N - 1)];
+    r.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// What a stage has got through since startup. Only the stage's own thread adds to it, anyone can
+// read it. busyUs is time spent working rather than waiting for work, latency is from something
+// being asked of the stage to the stage being done with it, queueing included.
+struct StageStats {
+    std::atomic<uint32_t> items;
+    std::atomic<int64_t> busyUs;
+    std::atomic<int64_t> latencyUs;
+    std::atomic<int64_t> maxLatencyUs;
+
+    StageStats() : items(0), busyUs(0), latencyUs(0), maxLatencyUs(0) {}
+};
+
+inline void stageDone(StageStats &s, uint32_t items, int64_t busyUs, int64_t latencyUs){
+    s.items.fetch_add(items, std::memory_order_relaxed);
+    s.busyUs.fetch_add(busyUs, std::memory_order_relaxed);
+    s.latencyUs.fetch_add(latencyUs * items, std::memory_order_relaxed);
+    if (latencyUs > s.maxLatencyUs.load(std::memory_order_relaxed)) {
+        s.maxLatencyUs.store(latencyUs, std::memory_order_relaxed);
+    }
+}
+
+// one line for a stage, what over elapsedUs
+inline void stagePrint(const char *name, const char *what, const StageStats &s, int64_t elapsedUs){
+    uint32_t items = s.items.load(std::memory_order_relaxed);
+    double seconds = elapsedUs / 1e6;
+    fprintf(stderr, "%-8s %6u %-7s %7.1f a minute, busy %3.0f%%, latency %lld ms avg %lld ms max\n", name, items, what,
+            seconds > 0 ? items * 60 / seconds : 0.0,
+            elapsedUs > 0 ? 100.0 * s.busyUs.load(std::memory_order_relaxed) / elapsedUs : 0.0,
+            items ? (long long)(s.latencyUs.load(std::memory_order_relaxed) / items / 1000) : 0LL,
+            (long long)(s.maxLatencyUs.load(std::memory_order_relaxed) / 1000));
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include "transfer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//open filename and get ready to send it from offset on, dropping whatever was being sent before.
+//Anything queued still goes after it. With a size it's only size bytes of the file from base.
+int transferStart(Transfer &t, const char *filename, int image, uint32_t offset, uint64_t base, uint32_t size){
+    transferStop(t);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "couldn't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || base > (uint64_t)st.st_size) size = 0;
+    else if (size == 0) size = st.st_size - base;
+    if (size == 0 || base + size > (uint64_t)st.st_size || offset > size) {
+        fprintf(stderr, "can't send %s from %u\n", filename, offset);
+        close(fd);
+        return -1;
+    }
+
+    t.fd = fd;
+    t.image = image;
+    t.base = base;
+    t.size = size;
+    t.offset = offset;
+    t.startedUs = monotonicUs();
+    t.queuedUs = t.startedUs;
+    fprintf(stderr, "sending %s at %llu, %u bytes from %u\n", filename, (unsigned long long)base, t.size, offset);
+    return 0;
+}
+
+//send filename once everything queued before it has gone
+void transferQueue(Transfer &t, const char *filename, int image, uint64_t base, uint32_t size){
+    PendingFile file;
+    file.filename = filename;
+    file.image = image;
+    file.base = base;
+    file.size = size;
+    file.queuedUs = monotonicUs();
+    t.pending.push_back(file);
+}
+
+//move on to the next queued file that can be opened
+static bool transferNext(Transfer &t){
+    while (!t.pending.empty()) {
+        PendingFile file = t.pending.front();
+        t.pending.pop_front();
+        if (transferStart(t, file.filename.c_str(), file.image, 0, file.base, file.size) == 0) {
+            t.queuedUs = file.queuedUs;
+            return true;
+        }
+    }
+    return false;
+}
+
+//queue chunks until there's about two in flight, which is enough to keep the uart busy between
+//trips round the event loop. Returns 1 while there's more to send, 0 once it's all queued, -1
+//if the file couldn't be read.
+int transferPump(Transfer &t, SerialPort &port){
+    uint8_t chunk[DUO_IMAGE_HEADER + CHUNK_DATA_MAX];
+
+    if (t.fd < 0) transferNext(t);
+
+    while (t.fd >= 0 && port.tx.size() - port.txPos < DUO_ENCODED_MAX) {
+        if (t.offset >= t.size) {
+            fprintf(stderr, "%s %d queued\n", (t.image & DUO_IMAGE_THUMB) ? "thumbnail" : "image",
+                    t.image & ~DUO_IMAGE_THUMB);
+            int64_t now = monotonicUs();
+            stageDone(t.stats, 1, now - t.startedUs, now - t.queuedUs);
+            transferStop(t);
+            if (transferNext(t)) continue;
+            return 0;
+        }
+
+        size_t want = t.size - t.offset;
+        if (want > CHUNK_DATA_MAX) want = CHUNK_DATA_MAX;
+        ssize_t got = pread(t.fd, chunk + DUO_IMAGE_HEADER, want, t.base + t.offset);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) continue;
+            fprintf(stderr, "image %d read failed at %u: %s\n", t.image, t.offset,
+                    got == 0 ? "file got shorter" : strerror(errno));
+            transferStop(t);
+            return -1;
+        }
+
+        duo_put16(chunk, t.image);
+        duo_put32(chunk + 2, t.offset);
+        duo_put32(chunk + 6, t.size);
+        serialQueueFrame(port, DUO_IMAGE, chunk, DUO_IMAGE_HEADER + got);
+        t.offset += got;
+    }
+    return transferActive(t) ? 1 : 0;
+}
+
+bool transferActive(const Transfer &t){
+    return t.fd >= 0 || !t.pending.empty();
+}
+
+void transferStop(Transfer &t){
+    if (t.fd >= 0) {
+        close(t.fd);
+        t.fd = -1;
+    }
+}
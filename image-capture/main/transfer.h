@@ -0,0 +1,53 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+
+#include "serial.h"
+#include "duo_frame.h"
+#include "stage.h"
+
+// Streams a saved image to the esp a chunk at a time, so memory use doesn't depend on how big
+// the image is and a chunk that got mangled can be asked for again without resending the rest.
+//
+// Each chunk is a DUO_IMAGE frame (duo_frame.h): image u16 | offset u32 | total u32 | data, the
+// frame's crc covers it. total is the whole file size so the esp knows when it has everything,
+// and a DUO_OP_RESEND command (re)starts a transfer of an image from any offset.
+//
+// Files queued with transferQueue go one after another in the order they were queued, that's how
+// a thumbnail gets down ahead of the image it belongs to. What's sent can be size bytes from base
+// in the file instead of the whole thing, which is how a record comes out of the image pack.
+#define CHUNK_DATA_MAX  1024
+
+struct PendingFile {
+    std::string filename;
+    int image;
+    uint64_t base;
+    uint32_t size;
+    int64_t queuedUs;
+};
+
+struct Transfer {
+    int fd;             // the image file, -1 when nothing is being sent
+    int image;
+    uint64_t base;      // where the image starts in the file
+    uint32_t size;
+    uint32_t offset;    // next byte of the image to go in a chunk
+    int64_t queuedUs;   // CLOCK_MONOTONIC when it was asked for
+    int64_t startedUs;  // and when it started going out
+    std::deque<PendingFile> pending;    // queued to go after this one
+    StageStats stats;   // files sent, busy while one is going out
+
+    Transfer() : fd(-1), image(0), base(0), size(0), offset(0), queuedUs(0), startedUs(0) {}
+};
+
+int transferStart(Transfer &t, const char *filename, int image, uint32_t offset, uint64_t base = 0, uint32_t size = 0);
+void transferQueue(Transfer &t, const char *filename, int image, uint64_t base = 0, uint32_t size = 0);
+int transferPump(Transfer &t, SerialPort &port);
+bool transferActive(const Transfer &t);
+void transferStop(Transfer &t);
+
+#endif
@@ -0,0 +1,171 @@
+#include "v4l2.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+static int xioctl(int fd, unsigned long request, void *arg){
+    int r;
+    do {
+        r = ioctl(fd, request, arg);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+//ask for fourcc at width x height, returns 0 if the driver gave us that format (it's allowed
+//to change the size)
+static int setFormat(V4l2Camera &cam, uint32_t fourcc, int width, int height){
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = fourcc;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+
+    if (xioctl(cam.fd, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix.pixelformat != fourcc) return -1;
+
+    cam.fourcc = fourcc;
+    cam.width = fmt.fmt.pix.width;
+    cam.height = fmt.fmt.pix.height;
+    cam.stride = fmt.fmt.pix.bytesperline ? fmt.fmt.pix.bytesperline : fmt.fmt.pix.width * 2;
+    return 0;
+}
+
+//opens dev and starts streaming, MJPEG if the camera can do it (then frames are already jpegs
+//and can go straight to disk), YUYV otherwise
+int v4l2Open(V4l2Camera &cam, const char *dev, int width, int height){
+    if ((cam.fd = open(dev, O_RDWR | O_NONBLOCK)) < 0) {
+        fprintf(stderr, "couldn't open %s: %s\n", dev, strerror(errno));
+        return -1;
+    }
+
+    struct v4l2_capability caps;
+    if (xioctl(cam.fd, VIDIOC_QUERYCAP, &caps) < 0 ||
+        !(caps.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(caps.capabilities & V4L2_CAP_STREAMING)) {
+        fprintf(stderr, "%s can't stream video capture\n", dev);
+        v4l2Close(cam);
+        return -1;
+    }
+
+    if (setFormat(cam, V4L2_PIX_FMT_MJPEG, width, height) != 0 &&
+        setFormat(cam, V4L2_PIX_FMT_YUYV, width, height) != 0) {
+        fprintf(stderr, "%s does neither MJPEG nor YUYV\n", dev);
+        v4l2Close(cam);
+        return -1;
+    }
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = V4L2_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(cam.fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 4) {
+        fprintf(stderr, "%s: not enough buffers (%u)\n", dev, req.count);
+        v4l2Close(cam);
+        return -1;
+    }
+
+    int want = (req.count < V4L2_BUFFERS) ? req.count : V4L2_BUFFERS;
+    bool queued = true;
+    for (int i = 0; i < want; i++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(cam.fd, VIDIOC_QUERYBUF, &buf) < 0) break;
+
+        void *start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cam.fd, buf.m.offset);
+        if (start == MAP_FAILED) break;
+        cam.bufs[i].start = start;
+        cam.bufs[i].length = buf.length;
+        cam.nbufs = i + 1;
+
+        if (xioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+            queued = false;
+            break;
+        }
+    }
+    if (!queued || cam.nbufs != want) {
+        fprintf(stderr, "%s: buffer setup failed: %s\n", dev, strerror(errno));
+        v4l2Close(cam);
+        return -1;
+    }
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+        fprintf(stderr, "%s: stream on failed: %s\n", dev, strerror(errno));
+        v4l2Close(cam);
+        return -1;
+    }
+
+    fprintf(stderr, "%s: %dx%d %s, %d buffers\n", dev, cam.width, cam.height,
+            cam.fourcc == V4L2_PIX_FMT_MJPEG ? "MJPEG" : "YUYV", cam.nbufs);
+    return 0;
+}
+
+//waits up to timeoutMs for a filled buffer. On success the buffer belongs to the caller until
+//it's given back with v4l2Requeue. Returns 0, 1 on timeout, -1 on error.
+int v4l2Dequeue(V4l2Camera &cam, int timeoutMs, int *index, size_t *bytes, int64_t *timestampUs){
+    struct pollfd pfd = { cam.fd, POLLIN, 0 };
+    int r = poll(&pfd, 1, timeoutMs);
+    if (r == 0) return 1;
+    if (r < 0) return (errno == EINTR) ? 1 : -1;
+
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+        if (errno == EAGAIN) return 1;
+        fprintf(stderr, "dequeue failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    *index = buf.index;
+    *bytes = buf.bytesused;
+
+    //most drivers stamp with CLOCK_MONOTONIC already, which is what the rest of the program uses
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        *timestampUs = (int64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    } else {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        *timestampUs = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+    return 0;
+}
+
+int v4l2Requeue(V4l2Camera &cam, int index){
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    if (xioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+        fprintf(stderr, "requeue of buffer %d failed: %s\n", index, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void v4l2Close(V4l2Camera &cam){
+    if (cam.fd < 0) return;
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+    for (int i = 0; i < cam.nbufs; i++) {
+        munmap(cam.bufs[i].start, cam.bufs[i].length);
+    }
+    cam.nbufs = 0;
+    close(cam.fd);
+    cam.fd = -1;
+}
@@ -0,0 +1,31 @@
+#ifndef V4L2_H
+#define V4L2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bare V4L2 streaming capture with mmap'ed driver buffers. Frames are handed out as pointers
+// straight into the driver's buffers, nothing is copied or converted here. Works with any UVC
+// camera, and with vivid or v4l2loopback on a desktop for testing.
+#define V4L2_BUFFERS    5   // 3 can be held by the triple buffer, plus some for the driver to fill
+
+struct V4l2Camera {
+    int fd;
+    uint32_t fourcc;        // V4L2_PIX_FMT_MJPEG or V4L2_PIX_FMT_YUYV
+    int width, height;
+    size_t stride;          // bytes per line for YUYV
+    int nbufs;
+    struct {
+        void *start;
+        size_t length;
+    } bufs[V4L2_BUFFERS];
+
+    V4l2Camera() : fd(-1), fourcc(0), width(0), height(0), stride(0), nbufs(0) {}
+};
+
+int v4l2Open(V4l2Camera &cam, const char *dev, int width, int height);
+int v4l2Dequeue(V4l2Camera &cam, int timeoutMs, int *index, size_t *bytes, int64_t *timestampUs);
+int v4l2Requeue(V4l2Camera &cam, int index);
+void v4l2Close(V4l2Camera &cam);
+
+#endif